@@ -0,0 +1,388 @@
+#include <cstdio>
+#include <cstring>
+#include <climits>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <fcntl.h>
+#include <unistd.h>
+#include "VirtualUSBDevice.h"
+#include "VirtualUSBHost.h"
+#include "IOWorkerPool.h"
+#include "Descriptor.h"
+
+// Bench: measures the URB path of VirtualUSBDevice, driven by an in-process VirtualUSBHost
+// over a socketpair (so no vhci-hcd required).
+//
+// Benchmarks:
+//   bulk_out / bulk_in     throughput (MB/s, URBs/s), sweeping transfer sizes and queue depths
+//   intr_rtt               round-trip latency: OUT on EP2 echoed back on the interrupt EP1 IN,
+//                          split into intr_poll_wait (the echo waiting for the host's next
+//                          poll) and intr_stack (the rest)
+//   control                GET_DESCRIPTOR(Device) latency
+//   enumerate              time to start a device and enumerate it
+//
+// Results are printed to stdout as one JSON object per line. The device's own diagnostics
+// (which also go to stdout) are discarded so that they don't interleave with the results.
+//
+// Usage: VirtualUSBBench [--engine threads|threads-uring|threads-sqpoll|eventloop|workerpool]
+//                        [--secs <sec per point>] [--samples <latency samples>] [--quick]
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr uint8_t _EPOut = 0x02;
+static constexpr uint8_t _EPIn = 0x82;
+static constexpr uint8_t _EPIntrIn = 0x81;
+
+static constexpr size_t _XferLens[] = { 64, 512, 4096, 16384, 65536 };
+static constexpr size_t _QueueDepths[] = { 1, 4, 32, 128 };
+
+static struct
+{
+    double secs = 0.5;
+    size_t samples = 10000;
+    bool quick = false;
+    FILE* out = stdout;
+} _Args;
+
+// Descriptor.h's configuration, but with the interrupt endpoint polled every (micro)frame
+// rather than every 10, so that intr_rtt isn't dominated by the wait for the host's next poll
+static const auto _Configuration = [] {
+    std::remove_const_t<decltype(Descriptor::Configuration)> c = Descriptor::Configuration;
+    c.epIn1Desc.bInterval = Toastbox::Endian::LFH_U8(1);
+    return c;
+}();
+
+static const Toastbox::USB::ConfigurationDescriptor* _Configurations[] = {
+    (const Toastbox::USB::ConfigurationDescriptor*)&_Configuration,
+};
+
+// Source of the data that we send, so that we don't allocate or copy it per transfer
+static uint8_t _Pattern[65536];
+
+// The device configurations that we bench: each engine, plus Engine::Threads over io_uring
+// (with and without the SQ poll thread)
+struct _Engine
+{
+    const char* name;
+    VirtualUSBDevice::Engine engine;
+    bool useIOURing;
+    bool uringSQPoll;
+};
+
+static constexpr _Engine _Engines[] = {
+    {"threads",         VirtualUSBDevice::Engine::Threads,      false,  false},
+    {"threads-uring",   VirtualUSBDevice::Engine::Threads,      true,   false},
+    {"threads-sqpoll",  VirtualUSBDevice::Engine::Threads,      true,   true},
+    {"eventloop",       VirtualUSBDevice::Engine::EventLoop,    false,  false},
+    {"workerpool",      VirtualUSBDevice::Engine::WorkerPool,   false,  false},
+};
+
+static double _Secs(Clock::duration d)
+{
+    return std::chrono::duration<double>(d).count();
+}
+
+static IOWorkerPool& _WorkerPool()
+{
+    static IOWorkerPool pool(2);
+    return pool;
+}
+
+// A device plus the host driving it. The device's app discards OUT data on EP2, or echoes it
+// on the interrupt IN endpoint when `echo` is set.
+struct _Rig
+{
+    _Rig(const _Engine& engine) :
+    dev({
+        .deviceDesc             = &Descriptor::Device,
+        .deviceQualifierDesc    = &Descriptor::DeviceQualifier,
+        .configDescs            = _Configurations,
+        .configDescsCount       = std::size(_Configurations),
+        .stringDescs            = Descriptor::Strings,
+        .stringDescsCount       = std::size(Descriptor::Strings),
+        .throwOnErr             = true,
+        .engine                 = engine.engine,
+        .useIOURing             = engine.useIOURing,
+        .uringSQPoll            = engine.uringSQPoll,
+        .workerPool             = (engine.engine==VirtualUSBDevice::Engine::WorkerPool ? &_WorkerPool() : nullptr),
+    }),
+    host({.device = &dev, .queueDepth = *std::max_element(std::begin(_QueueDepths), std::end(_QueueDepths))})
+    {
+        host.start();
+        app = std::thread([this] { _app(); });
+        host.enumerate();
+    }
+    
+    ~_Rig()
+    {
+        host.stop();
+        app.join();
+    }
+    
+    void _app()
+    {
+        try
+        {
+            VirtualUSBDevice::XferRef xfers[32];
+            for (;;)
+            {
+                const size_t n = dev.readRefMany(xfers);
+                for (size_t i=0; i<n; i++)
+                {
+                    if (echo && xfers[i].ep==_EPOut)
+                    {
+                        echoTime.store(Clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+                        dev.write(_EPIntrIn, std::move(xfers[i].data));
+                    }
+                    // Recycle the receive buffer now, rather than when the slot is reused
+                    xfers[i] = {};
+                }
+            }
+        }
+        catch (...) {} // Stopped
+    }
+    
+    VirtualUSBDevice dev;
+    VirtualUSBHost host;
+    std::thread app;
+    std::atomic<bool> echo = false;
+    std::atomic<Clock::rep> echoTime = 0; // When the app last echoed
+};
+
+// Submits URBs via `submit` (keeping the host's queue `depth` deep) for `_Args.secs`, and
+// returns the number of URBs completed and the elapsed time
+template<typename Fn>
+static std::pair<uint64_t,Clock::duration> _RunQueue(VirtualUSBHost& host, size_t depth, Fn submit)
+{
+    std::mutex lock;
+    std::condition_variable signal;
+    size_t inFlight = 0;
+    uint64_t done = 0;
+    int32_t status = 0;
+    
+    // Runs on the host's read thread, so just record failures
+    const VirtualUSBHost::Callback cb = [&] (VirtualUSBHost::Urb&& urb)
+    {
+        auto l = std::unique_lock(lock);
+        inFlight--;
+        done++;
+        if (urb.status) status = urb.status;
+        signal.notify_all();
+    };
+    
+    const Clock::time_point start = Clock::now();
+    const Clock::time_point end = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(_Args.secs));
+    while (Clock::now() < end)
+    {
+        {
+            auto l = std::unique_lock(lock);
+            while (inFlight >= depth) signal.wait(l);
+            inFlight++;
+        }
+        submit(cb);
+    }
+    host.drain();
+    const Clock::duration elapsed = Clock::now()-start;
+    if (status) throw RUNTIME_ERROR("URB failed: %d", status);
+    return {done, elapsed};
+}
+
+static void _PrintThroughput(const char* bench, const _Engine& engine, size_t xferLen, size_t depth, uint64_t urbs, Clock::duration elapsed)
+{
+    const double secs = _Secs(elapsed);
+    fprintf(_Args.out,
+        "{\"bench\":\"%s\",\"engine\":\"%s\",\"xfer_len\":%zu,\"queue_depth\":%zu,"
+        "\"urbs\":%ju,\"secs\":%.6f,\"mb_per_sec\":%.3f,\"urbs_per_sec\":%.1f}\n",
+        bench, engine.name, xferLen, depth,
+        (uintmax_t)urbs, secs, (urbs*xferLen)/secs/1e6, urbs/secs);
+    fflush(_Args.out);
+}
+
+static void _PrintLatency(const char* bench, const _Engine& engine, std::vector<double>& us)
+{
+    if (us.empty()) return;
+    std::sort(us.begin(), us.end());
+    auto pct = [&] (double p) { return us[std::min(us.size()-1, (size_t)(p*us.size()))]; };
+    fprintf(_Args.out,
+        "{\"bench\":\"%s\",\"engine\":\"%s\",\"samples\":%zu,"
+        "\"p50_us\":%.2f,\"p99_us\":%.2f,\"p999_us\":%.2f,\"max_us\":%.2f}\n",
+        bench, engine.name, us.size(),
+        pct(.5), pct(.99), pct(.999), us.back());
+    fflush(_Args.out);
+}
+
+static void _BenchBulkOut(_Rig& rig, const _Engine& engine)
+{
+    for (size_t xferLen : _XferLens)
+    {
+        for (size_t depth : _QueueDepths)
+        {
+            const auto [urbs, elapsed] = _RunQueue(rig.host, depth, [&] (const VirtualUSBHost::Callback& cb)
+            {
+                rig.host.submitOut(_EPOut, Buffer::Wrap(_Pattern, xferLen, nullptr), cb);
+            });
+            _PrintThroughput("bulk_out", engine, xferLen, depth, urbs, elapsed);
+        }
+    }
+}
+
+static void _BenchBulkIn(_Rig& rig, const _Engine& engine)
+{
+    for (size_t xferLen : _XferLens)
+    {
+        for (size_t depth : _QueueDepths)
+        {
+            // The device produces one buffer per IN URB, as the host submits them
+            const auto [urbs, elapsed] = _RunQueue(rig.host, depth, [&] (const VirtualUSBHost::Callback& cb)
+            {
+                rig.host.submitIn(_EPIn, xferLen, cb);
+                rig.dev.write(_EPIn, Buffer::Wrap(_Pattern, xferLen, nullptr));
+            });
+            _PrintThroughput("bulk_in", engine, xferLen, depth, urbs, elapsed);
+        }
+    }
+}
+
+static void _BenchIntrRTT(_Rig& rig, const _Engine& engine)
+{
+    // The device polls the endpoint at the start of the (micro)frame after the echo, so find
+    // a frame boundary to tell when that is
+    const Clock::duration period = (rig.dev.speed()>=USBIPLib::USB_SPEED_HIGH ?
+        std::chrono::microseconds(125) : std::chrono::milliseconds(1));
+    const uint64_t frame = rig.dev.frame();
+    while (rig.dev.frame() == frame);
+    const Clock::time_point frameStart = Clock::now();
+    
+    rig.echo = true;
+    std::vector<double> us, pollWaitUs, stackUs;
+    for (size_t i=0; i<_Args.samples; i++)
+    {
+        const Clock::time_point start = Clock::now();
+        std::mutex lock;
+        std::condition_variable signal;
+        bool done = false;
+        rig.host.submitIn(_EPIntrIn, 8, [&] (VirtualUSBHost::Urb&& urb)
+        {
+            auto l = std::unique_lock(lock);
+            done = true;
+            signal.notify_all();
+        });
+        rig.host.out(_EPOut, _Pattern, 8);
+        
+        auto l = std::unique_lock(lock);
+        while (!done) signal.wait(l);
+        const Clock::time_point end = Clock::now();
+        const Clock::time_point echo(Clock::duration(rig.echoTime.load(std::memory_order_relaxed)));
+        const Clock::time_point poll = frameStart + ((echo-frameStart)/period + 1)*period;
+        us.push_back(_Secs(end-start) * 1e6);
+        pollWaitUs.push_back(_Secs(poll-echo) * 1e6);
+        stackUs.push_back(_Secs((end-start)-(poll-echo)) * 1e6);
+    }
+    rig.echo = false;
+    _PrintLatency("intr_rtt", engine, us);
+    _PrintLatency("intr_poll_wait", engine, pollWaitUs);
+    _PrintLatency("intr_stack", engine, stackUs);
+}
+
+static void _BenchControl(_Rig& rig, const _Engine& engine)
+{
+    const Toastbox::USB::SetupRequest req = {
+        .bmRequestType  = Toastbox::USB::RequestType::DirectionIn|Toastbox::USB::RequestType::TypeStandard|
+                            Toastbox::USB::RequestType::RecipientDevice,
+        .bRequest       = Toastbox::USB::Request::GetDescriptor,
+        .wValue         = (uint16_t)(Toastbox::USB::DescriptorType::Device<<8),
+        .wIndex         = 0,
+        .wLength        = sizeof(Toastbox::USB::DeviceDescriptor),
+    };
+    
+    std::vector<double> us;
+    for (size_t i=0; i<_Args.samples; i++)
+    {
+        const Clock::time_point start = Clock::now();
+        const VirtualUSBHost::Urb urb = rig.host.control(req);
+        if (urb.status) throw RUNTIME_ERROR("GET_DESCRIPTOR failed: %d", urb.status);
+        us.push_back(_Secs(Clock::now()-start) * 1e6);
+    }
+    _PrintLatency("control", engine, us);
+}
+
+static void _BenchEnumerate(const _Engine& engine)
+{
+    std::vector<double> us;
+    const size_t count = std::max((size_t)1, _Args.samples/100);
+    for (size_t i=0; i<count; i++)
+    {
+        const Clock::time_point start = Clock::now();
+        _Rig rig(engine);
+        us.push_back(_Secs(Clock::now()-start) * 1e6);
+    }
+    _PrintLatency("enumerate", engine, us);
+}
+
+static const _Engine& _ParseEngine(const char* name)
+{
+    for (const _Engine& engine : _Engines)
+    {
+        if (!strcmp(name, engine.name)) return engine;
+    }
+    throw RUNTIME_ERROR("invalid engine: %s", name);
+}
+
+int main(int argc, const char* argv[])
+{
+    try
+    {
+        std::vector<const _Engine*> engines;
+        for (const _Engine& engine : _Engines) engines.push_back(&engine);
+        for (int i=1; i<argc; i++)
+        {
+            const std::string arg = argv[i];
+            if (arg=="--engine" && i+1<argc) engines = {&_ParseEngine(argv[++i])};
+            else if (arg=="--secs" && i+1<argc) _Args.secs = atof(argv[++i]);
+            else if (arg=="--samples" && i+1<argc) _Args.samples = strtoul(argv[++i], nullptr, 0);
+            else if (arg == "--quick") _Args.quick = true;
+            else throw RUNTIME_ERROR("invalid argument: %s", arg.c_str());
+        }
+        
+        if (_Args.quick)
+        {
+            _Args.secs = std::min(_Args.secs, .05);
+            _Args.samples = std::min(_Args.samples, (size_t)1000);
+        }
+        
+        // Keep the results on stdout, and send the device's diagnostics to /dev/null
+        const int resultsFD = dup(STDOUT_FILENO);
+        if (resultsFD < 0) throw RUNTIME_ERROR("dup failed: %s", strerror(errno));
+        _Args.out = fdopen(resultsFD, "w");
+        if (!_Args.out) throw RUNTIME_ERROR("fdopen failed: %s", strerror(errno));
+        const int nullFD = open("/dev/null", O_WRONLY|O_CLOEXEC);
+        if (nullFD < 0) throw RUNTIME_ERROR("open failed: %s", strerror(errno));
+        dup2(nullFD, STDOUT_FILENO);
+        close(nullFD);
+        
+        for (size_t i=0; i<sizeof(_Pattern); i++)
+            _Pattern[i] = (uint8_t)i;
+        
+        for (const _Engine* e : engines)
+        {
+            const _Engine& engine = *e;
+            _BenchEnumerate(engine);
+            
+            _Rig rig(engine);
+            _BenchControl(rig, engine);
+            _BenchIntrRTT(rig, engine);
+            _BenchBulkOut(rig, engine);
+            _BenchBulkIn(rig, engine);
+        }
+    
+    }
+    catch (const std::exception& e)
+    {
+        fprintf(stderr, "Error: %s\n", e.what());
+        return 1;
+    }
+    
+    return 0;
+}
@@ -0,0 +1,331 @@
+#include "BufferPool.h"
+#include <cassert>
+#include <algorithm>
+#include <new>
+
+struct Buffer::_Pool
+{
+    std::mutex lock; // Protects the fields below
+    std::vector<_Block*> free;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    
+    // Set under `lock`, but also read without it by the thread caches
+    std::atomic<bool> closed = false;
+    size_t blockLen = 0;
+    size_t idleMax = 0;
+    size_t cacheMax = 0; // Max blocks in each thread's cache
+};
+
+// A thread's cache of blocks, per size class. Allocations and releases take blocks from, and
+// return blocks to, the calling thread's cache, and only take the class's lock to move half a
+// cache's worth of blocks at a time. So a thread that allocates blocks that another thread
+// releases (like a device's read thread and the application) takes the lock once per batch
+// rather than once per block.
+struct Buffer::_ThreadCache
+{
+    struct Entry
+    {
+        std::shared_ptr<_Pool> pool;
+        std::vector<_Block*> blocks;
+        uint64_t hits = 0; // Not yet added to `pool->hits`
+    };
+    
+    // Returns the calling thread's cache, or null if it's been destroyed (because the thread
+    // is exiting)
+    static _ThreadCache* Get();
+    
+    ~_ThreadCache();
+    
+    // Returns the entry for `pool`, creating it if needed
+    Entry& entry(const std::shared_ptr<_Pool>& pool);
+    
+    // Moves up to half of `pool->cacheMax` idle blocks from the pool into `e`, and returns
+    // whether there were any (counting a miss if not)
+    static bool Refill(Entry& e);
+    
+    // Moves the blocks in `e` beyond the first `keep` back to the pool, or frees them if the
+    // pool is closed or full
+    static void Spill(Entry& e, size_t keep);
+    
+    std::vector<Entry> entries;
+};
+
+// Set once the calling thread's cache is destroyed, so that blocks released afterwards (by
+// thread_local destructors that run later) bypass it
+static thread_local bool _ThreadCacheDestroyed = false;
+
+Buffer::_ThreadCache* Buffer::_ThreadCache::Get()
+{
+    if (_ThreadCacheDestroyed) return nullptr;
+    static thread_local _ThreadCache cache;
+    return &cache;
+}
+
+Buffer::_ThreadCache::~_ThreadCache()
+{
+    for (Entry& e : entries)
+        Spill(e, 0);
+    _ThreadCacheDestroyed = true;
+}
+
+Buffer::_ThreadCache::Entry& Buffer::_ThreadCache::entry(const std::shared_ptr<_Pool>& pool)
+{
+    for (Entry& e : entries)
+        if (e.pool == pool) return e;
+    
+    // Drop the entries of pools that were destroyed, so that threads that outlive many pools
+    // don't accumulate them
+    for (Entry& e : entries)
+        if (e.pool->closed.load(std::memory_order_relaxed)) Spill(e, 0);
+    std::erase_if(entries, [] (const Entry& e) { return e.pool->closed.load(std::memory_order_relaxed); });
+    
+    entries.push_back({.pool = pool});
+    entries.back().blocks.reserve(pool->cacheMax);
+    return entries.back();
+}
+
+bool Buffer::_ThreadCache::Refill(Entry& e)
+{
+    _Pool& pool = *e.pool;
+    auto lock = std::unique_lock(pool.lock);
+    pool.hits += e.hits;
+    e.hits = 0;
+    const size_t count = std::min(pool.free.size(), std::max((size_t)1, pool.cacheMax/2));
+    e.blocks.insert(e.blocks.end(), pool.free.end()-count, pool.free.end());
+    pool.free.resize(pool.free.size()-count);
+    if (!count) pool.misses++;
+    return count;
+}
+
+void Buffer::_ThreadCache::Spill(Entry& e, size_t keep)
+{
+    std::vector<_Block*> drop;
+    {
+        _Pool& pool = *e.pool;
+        auto lock = std::unique_lock(pool.lock);
+        pool.hits += e.hits;
+        e.hits = 0;
+        for (size_t i=keep; i<e.blocks.size(); i++)
+        {
+            if (!pool.closed.load(std::memory_order_relaxed) && pool.free.size()<pool.idleMax)
+                pool.free.push_back(e.blocks[i]);
+            else
+                drop.push_back(e.blocks[i]);
+        }
+        e.blocks.resize(keep);
+    }
+    
+    for (_Block* block : drop)
+    {
+        block->pool = nullptr;
+        _BlockFree(block);
+    }
+}
+
+Buffer::_Block* Buffer::_BlockAlloc(size_t cap)
+{
+    // Allocate the block header and its memory in one go
+    void* mem = ::operator new(sizeof(_Block)+cap);
+    _Block* block = new (mem) _Block();
+    block->cap = cap;
+    block->mem = (uint8_t*)mem + sizeof(_Block);
+    return block;
+}
+
+void Buffer::_BlockFree(_Block* block)
+{
+    // Return the block to its pool if the pool still exists, via the thread's cache
+    if (block->pool)
+    {
+        _ThreadCache*const cache = _ThreadCache::Get();
+        if (cache && !block->pool->closed.load(std::memory_order_relaxed))
+        {
+            _ThreadCache::Entry& e = cache->entry(block->pool);
+            if (e.blocks.size() >= block->pool->cacheMax)
+                _ThreadCache::Spill(e, block->pool->cacheMax/2);
+            block->refs.store(1, std::memory_order_relaxed);
+            e.blocks.push_back(block);
+            return;
+        }
+        
+        std::shared_ptr<_Pool> pool = block->pool;
+        auto lock = std::unique_lock(pool->lock);
+        if (!pool->closed && pool->free.size()<pool->idleMax)
+        {
+            block->refs.store(1, std::memory_order_relaxed);
+            pool->free.push_back(block);
+            return;
+        }
+        block->pool = nullptr;
+    }
+    
+    // Hand caller-owned memory back to its owner
+    if (block->release)
+        block->release();
+    
+    block->~_Block();
+    ::operator delete(block);
+}
+
+Buffer& Buffer::operator=(const Buffer& x)
+{
+    if (x._block) x._block->refs.fetch_add(1, std::memory_order_relaxed);
+    reset();
+    _block = x._block;
+    _data = x._data;
+    _len = x._len;
+    return *this;
+}
+
+Buffer& Buffer::operator=(Buffer&& x)
+{
+    if (this == &x) return *this;
+    reset();
+    _block = x._block;
+    _data = x._data;
+    _len = x._len;
+    x._block = nullptr;
+    x._data = nullptr;
+    x._len = 0;
+    return *this;
+}
+
+Buffer Buffer::Alloc(size_t len)
+{
+    _Block* block = _BlockAlloc(len);
+    return Buffer(block, block->mem, len);
+}
+
+Buffer Buffer::Wrap(const void* data, size_t len, std::function<void()> release)
+{
+    _Block* block = _BlockAlloc(0);
+    block->cap = len;
+    block->mem = (uint8_t*)data;
+    block->release = std::move(release);
+    return Buffer(block, block->mem, len);
+}
+
+Buffer Buffer::slice(size_t off, size_t len) const
+{
+    assert(off+len <= _len);
+    Buffer b = *this;
+    b._data += off;
+    b._len = len;
+    return b;
+}
+
+bool Buffer::unique() const
+{
+    return _block && _block->refs.load(std::memory_order_acquire)==1;
+}
+
+void Buffer::reset()
+{
+    if (_block && _block->refs.fetch_sub(1, std::memory_order_acq_rel)==1)
+        _BlockFree(_block);
+    _block = nullptr;
+    _data = nullptr;
+    _len = 0;
+}
+
+BufferPool::BufferPool(const size_t* classLens, size_t classCount)
+{
+    for (size_t i=0; i<classCount; i++)
+    {
+        assert(!i || classLens[i]>classLens[i-1]);
+        auto pool = std::make_shared<Buffer::_Pool>();
+        pool->blockLen = classLens[i];
+        pool->idleMax = std::max((size_t)1, _IdleBytesMax/classLens[i]);
+        pool->cacheMax = std::clamp(_CacheBytesMax/classLens[i], (size_t)1, _CacheBlocksMax);
+        _pools.push_back(std::move(pool));
+    }
+}
+
+BufferPool::~BufferPool()
+{
+    // Free the idle blocks; blocks that are still in use get freed when they're released
+    for (const auto& pool : _pools)
+    {
+        std::vector<Buffer::_Block*> free;
+        {
+            auto lock = std::unique_lock(pool->lock);
+            pool->closed = true;
+            free = std::move(pool->free);
+        }
+        
+        for (Buffer::_Block* block : free)
+        {
+            block->pool = nullptr;
+            Buffer::_BlockFree(block);
+        }
+    }
+}
+
+Buffer BufferPool::alloc(size_t len)
+{
+    // Find the smallest size class that fits
+    auto it = std::find_if(_pools.begin(), _pools.end(),
+        [&](const auto& pool) { return pool->blockLen >= len; });
+    
+    if (it == _pools.end())
+    {
+        _oversize.fetch_add(1, std::memory_order_relaxed);
+        return Buffer::Alloc(len);
+    }
+    
+    Buffer::_Pool& pool = **it;
+    Buffer::_Block* block = nullptr;
+    Buffer::_ThreadCache*const cache = Buffer::_ThreadCache::Get();
+    if (cache)
+    {
+        Buffer::_ThreadCache::Entry& e = cache->entry(*it);
+        if (!e.blocks.empty() || Buffer::_ThreadCache::Refill(e))
+        {
+            block = e.blocks.back();
+            e.blocks.pop_back();
+            e.hits++;
+        }
+    }
+    else
+    {
+        auto lock = std::unique_lock(pool.lock);
+        if (!pool.free.empty())
+        {
+            block = pool.free.back();
+            pool.free.pop_back();
+            pool.hits++;
+        }
+        else
+        {
+            pool.misses++;
+        }
+    }
+    
+    if (!block)
+    {
+        block = Buffer::_BlockAlloc(pool.blockLen);
+        block->pool = *it;
+    }
+    return Buffer(block, block->mem, len);
+}
+
+std::vector<BufferPool::Stats> BufferPool::stats() const
+{
+    std::vector<Stats> r;
+    for (const auto& pool : _pools)
+    {
+        auto lock = std::unique_lock(pool->lock);
+        r.push_back({
+            .classLen   = pool->blockLen,
+            .hits       = pool->hits,
+            .misses     = pool->misses,
+            .idle       = pool->free.size(),
+        });
+    }
+    
+    r.push_back({
+        .misses = _oversize.load(std::memory_order_relaxed),
+    });
+    return r;
+}
@@ -0,0 +1,118 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <functional>
+#include <iterator>
+
+class BufferPool;
+
+// Buffer: a refcounted view into a block of memory. Copying a Buffer (or slicing it) shares
+// the underlying block; the block is freed, returned to the BufferPool that it came from, or
+// handed back to its owner, when the last Buffer referencing it is destroyed.
+class Buffer
+{
+public:
+    Buffer() {}
+    Buffer(const Buffer& x) { *this = x; }
+    Buffer& operator=(const Buffer& x);
+    Buffer(Buffer&& x) { *this = std::move(x); }
+    Buffer& operator=(Buffer&& x);
+    ~Buffer() { reset(); }
+    
+    // Allocates a Buffer from the heap
+    static Buffer Alloc(size_t len);
+    
+    // Wraps caller-owned memory without copying it. `release` is called (from whichever
+    // thread drops the last reference) once the memory is no longer referenced. Consumers
+    // of Buffers created this way must treat them as read-only.
+    static Buffer Wrap(const void* data, size_t len, std::function<void()> release);
+    
+    const uint8_t* data() const { return _data; }
+    uint8_t* data() { return _data; }
+    size_t len() const { return _len; }
+    
+    // Returns a Buffer referencing bytes [off, off+len) of this one
+    Buffer slice(size_t off, size_t len) const;
+    
+    // Whether this is the only Buffer referencing the underlying block
+    bool unique() const;
+    
+    void reset();
+    
+    explicit operator bool() const { return _block; }
+
+private:
+    struct _Pool;
+    struct _ThreadCache;
+    
+    struct _Block
+    {
+        std::atomic<uint32_t> refs = 1;
+        std::shared_ptr<_Pool> pool; // Null if the block came from the heap
+        size_t cap = 0;
+        uint8_t* mem = nullptr;
+        std::function<void()> release; // Set if `mem` is caller-owned
+    };
+    
+    static _Block* _BlockAlloc(size_t cap);
+    static void _BlockFree(_Block* block);
+    
+    Buffer(_Block* block, uint8_t* data, size_t len) : _block(block), _data(data), _len(len) {}
+    
+    _Block* _block = nullptr;
+    uint8_t* _data = nullptr;
+    size_t _len = 0;
+    
+    friend class BufferPool;
+};
+
+// BufferPool: a pool of blocks in a fixed set of size classes. Blocks are recycled instead of
+// being freed, so once the pool is warm, allocations don't touch the heap. Thread-safe;
+// Buffers from a pool may outlive the pool. Each thread caches a few blocks of each class,
+// so that threads sharing a pool rarely contend for its size classes.
+class BufferPool
+{
+public:
+    // Size classes tuned for typical USB transfers: setup/status replies, full-speed and
+    // high-speed max packets, and common bulk URB sizes
+    static constexpr size_t DefaultClassLens[] = { 8, 64, 512, 0x1000, 0x4000, 0x10000 };
+    
+    struct Stats
+    {
+        size_t classLen = 0;    // Block size of this class (0: oversized allocations)
+        uint64_t hits = 0;      // Allocations served by recycling an idle block (the threads'
+                                // caches report theirs when they next take blocks from, or
+                                // return blocks to, the pool)
+        uint64_t misses = 0;    // Allocations that had to allocate a new block
+        size_t idle = 0;        // Blocks currently idle in the pool (excluding the threads'
+                                // caches)
+    };
+    
+    BufferPool(const size_t* classLens=DefaultClassLens, size_t classCount=std::size(DefaultClassLens));
+    ~BufferPool();
+    
+    BufferPool(const BufferPool& x) = delete;
+    BufferPool& operator=(const BufferPool& x) = delete;
+    
+    // Returns a Buffer of `len` bytes, backed by a block from the smallest size class that
+    // fits. Allocations larger than the largest size class come from the heap.
+    Buffer alloc(size_t len);
+    
+    // Returns the stats for each size class, followed by the oversized allocations
+    std::vector<Stats> stats() const;
+
+private:
+    // Upper bound on the bytes of idle blocks retained per size class; blocks released
+    // beyond that are freed
+    static constexpr size_t _IdleBytesMax = 0x100000;
+    // Upper bounds on the blocks that each thread caches per size class
+    static constexpr size_t _CacheBytesMax = 0x8000;
+    static constexpr size_t _CacheBlocksMax = 32;
+    
+    std::vector<std::shared_ptr<Buffer::_Pool>> _pools;
+    std::atomic<uint64_t> _oversize = 0;
+};
@@ -0,0 +1,116 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <array>
+#include <algorithm>
+
+// Histogram: an HDR-style log-linear histogram of non-negative integers (eg latencies in
+// nanoseconds). Each power of 2 is split into SubBucketCount linear sub-buckets, so values
+// are recorded with a relative error of at most 1/SubBucketCount, over the whole range
+// [0, 2^MagnitudeMax). Larger values are clamped into the last bucket.
+//
+// record() is a couple of relaxed atomic increments, so it's cheap enough for the data path
+// and can be called from several threads at once. snapshot() can be called concurrently
+// with record(); it observes each bucket atomically, but not every bucket at the same
+// instant.
+class Histogram
+{
+public:
+    static constexpr unsigned SubBucketBits = 4;
+    static constexpr uint64_t SubBucketCount = 1<<SubBucketBits;
+    static constexpr unsigned MagnitudeMax = 36; // 2^36 ns: ~68 seconds
+    // Values below SubBucketCount get a bucket each; every larger power of 2 gets
+    // SubBucketCount buckets
+    static constexpr size_t BucketCount = SubBucketCount + (MagnitudeMax-SubBucketBits)*SubBucketCount;
+    
+    struct Snapshot
+    {
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        std::array<uint64_t,BucketCount> buckets = {};
+        
+        uint64_t mean() const { return (count ? sum/count : 0); }
+        
+        // Returns the (upper bound of the bucket containing the) value below which `p`
+        // percent of the recorded values fall. Returns 0 if nothing was recorded.
+        uint64_t percentile(double p) const
+        {
+            if (!count) return 0;
+            const uint64_t target = std::max((uint64_t)1, (uint64_t)(p/100*count + .5));
+            uint64_t n = 0;
+            for (size_t i=0; i<BucketCount; i++)
+            {
+                n += buckets[i];
+                if (n >= target) return BucketMax(i);
+            }
+            return BucketMax(BucketCount-1);
+        }
+        
+        uint64_t max() const
+        {
+            for (size_t i=BucketCount; i; i--)
+                if (buckets[i-1]) return BucketMax(i-1);
+            return 0;
+        }
+        
+        Snapshot& operator+=(const Snapshot& x)
+        {
+            count += x.count;
+            sum += x.sum;
+            for (size_t i=0; i<BucketCount; i++)
+                buckets[i] += x.buckets[i];
+            return *this;
+        }
+    };
+    
+    static size_t BucketIdx(uint64_t v)
+    {
+        if (v < SubBucketCount) return v;
+        // Magnitude of `v` (index of its highest set bit), which is >= SubBucketBits here
+        const unsigned mag = 63-__builtin_clzll(v);
+        if (mag >= MagnitudeMax) return BucketCount-1;
+        // The SubBucketBits bits below the highest set bit select the sub-bucket
+        const size_t sub = (v >> (mag-SubBucketBits)) & (SubBucketCount-1);
+        return SubBucketCount + (mag-SubBucketBits)*SubBucketCount + sub;
+    }
+    
+    // Returns the largest value that maps to bucket `idx`
+    static uint64_t BucketMax(size_t idx)
+    {
+        if (idx < SubBucketCount) return idx;
+        const unsigned mag = SubBucketBits + (idx-SubBucketCount)/SubBucketCount;
+        const uint64_t sub = (idx-SubBucketCount) % SubBucketCount;
+        const unsigned shift = mag-SubBucketBits;
+        return ((SubBucketCount+sub+1) << shift) - 1;
+    }
+    
+    void record(uint64_t v)
+    {
+        _buckets[BucketIdx(v)].fetch_add(1, std::memory_order_relaxed);
+        _sum.fetch_add(v, std::memory_order_relaxed);
+    }
+    
+    Snapshot snapshot() const
+    {
+        Snapshot s;
+        for (size_t i=0; i<BucketCount; i++)
+        {
+            s.buckets[i] = _buckets[i].load(std::memory_order_relaxed);
+            s.count += s.buckets[i];
+        }
+        s.sum = _sum.load(std::memory_order_relaxed);
+        return s;
+    }
+    
+    void clear()
+    {
+        for (std::atomic<uint64_t>& b : _buckets)
+            b.store(0, std::memory_order_relaxed);
+        _sum.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    std::array<std::atomic<uint64_t>,BucketCount> _buckets = {};
+    std::atomic<uint64_t> _sum = 0;
+};
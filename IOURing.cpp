@@ -0,0 +1,274 @@
+#include "IOURing.h"
+#include <cerrno>
+#include <cstring>
+#include <cassert>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include "LIB/Toastbox/RuntimeError.h"
+
+// How long the SQ poll thread keeps polling after the last SQE, before it goes to sleep (and
+// has to be woken by io_uring_enter())
+static constexpr unsigned _SQPollIdleMs = 10;
+
+static int _Setup(unsigned entries, io_uring_params& p)
+{
+    return syscall(__NR_io_uring_setup, entries, &p);
+}
+
+static int _Enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0);
+}
+
+static int _Register(int fd, unsigned op, void* arg, unsigned argCount)
+{
+    return syscall(__NR_io_uring_register, fd, op, arg, argCount);
+}
+
+// The ring whose SQ poll thread the sqpoll rings attach to, so that the process has a single
+// poll thread however many rings it has. Never destroyed; -1 if SQPOLL isn't permitted.
+static int _SQPollFD()
+{
+    static const int fd = [] {
+        io_uring_params p = {
+            .flags = IORING_SETUP_SQPOLL,
+            .sq_thread_idle = _SQPollIdleMs,
+        };
+        return _Setup(1, p);
+    }();
+    return fd;
+}
+
+IOURing::IOURing(unsigned entries, bool sqpoll)
+{
+    io_uring_params p = {};
+    if (sqpoll && _SQPollFD()>=0)
+    {
+        p = {
+            .flags = IORING_SETUP_SQPOLL|IORING_SETUP_ATTACH_WQ,
+            .sq_thread_idle = _SQPollIdleMs,
+            .wq_fd = (uint32_t)_SQPollFD(),
+        };
+        _fd = _Setup(entries, p);
+        _sqpoll = (_fd >= 0);
+    }
+    
+    // Fall back to a regular ring
+    if (_fd < 0)
+    {
+        p = {};
+        _fd = _Setup(entries, p);
+    }
+    if (_fd < 0) throw RUNTIME_ERROR("io_uring_setup failed: %s", strerror(errno));
+    
+    try
+    {
+        // Every kernel new enough to support provided-buffer rings maps the SQ and CQ rings
+        // together, so don't bother supporting separate mappings
+        if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+            throw RUNTIME_ERROR("io_uring lacks IORING_FEAT_SINGLE_MMAP");
+        
+        _ringMemLen = std::max(
+            p.sq_off.array + p.sq_entries*sizeof(unsigned),
+            p.cq_off.cqes + p.cq_entries*sizeof(io_uring_cqe)
+        );
+        _ringMem = mmap(nullptr, _ringMemLen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+        if (_ringMem == MAP_FAILED)
+        {
+            _ringMem = nullptr;
+            throw RUNTIME_ERROR("mmap failed: %s", strerror(errno));
+        }
+        
+        _sqesLen = p.sq_entries*sizeof(io_uring_sqe);
+        void* sqes = mmap(nullptr, _sqesLen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, _fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) throw RUNTIME_ERROR("mmap failed: %s", strerror(errno));
+        _sqes = (io_uring_sqe*)sqes;
+        
+        uint8_t*const ring = (uint8_t*)_ringMem;
+        _sqHead = (unsigned*)(ring + p.sq_off.head);
+        _sqTail = (unsigned*)(ring + p.sq_off.tail);
+        _sqArray = (unsigned*)(ring + p.sq_off.array);
+        _sqFlags = (unsigned*)(ring + p.sq_off.flags);
+        _sqMask = *(unsigned*)(ring + p.sq_off.ring_mask);
+        _sqEntries = p.sq_entries;
+        
+        _cqHead = (unsigned*)(ring + p.cq_off.head);
+        _cqTail = (unsigned*)(ring + p.cq_off.tail);
+        _cqes = (io_uring_cqe*)(ring + p.cq_off.cqes);
+        _cqMask = *(unsigned*)(ring + p.cq_off.ring_mask);
+    
+    }
+    catch (...)
+    {
+        _cleanup();
+        throw;
+    }
+}
+
+IOURing::~IOURing()
+{
+    _cleanup();
+}
+
+void IOURing::_cleanup()
+{
+    if (_bufRing) munmap(_bufRing, _bufRingLen);
+    if (_sqes) munmap(_sqes, _sqesLen);
+    if (_ringMem) munmap(_ringMem, _ringMemLen);
+    if (_fd >= 0) close(_fd);
+    _bufRing = nullptr;
+    _sqes = nullptr;
+    _ringMem = nullptr;
+    _fd = -1;
+}
+
+io_uring_sqe& IOURing::sqe()
+{
+    auto full = [&] { return *_sqTail+_sqPending-__atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= _sqEntries; };
+    if (full())
+    {
+        submit();
+        // With SQPOLL, submit() only hands the SQEs to the poll thread, so wait for it to
+        // consume them
+        while (_sqpoll && full())
+        {
+            const int ir = _Enter(_fd, 0, 0, IORING_ENTER_SQ_WAIT);
+            if (ir<0 && errno!=EINTR) throw RUNTIME_ERROR("io_uring_enter failed: %s", strerror(errno));
+        }
+    }
+    
+    const unsigned idx = (*_sqTail+_sqPending) & _sqMask;
+    io_uring_sqe& sqe = _sqes[idx];
+    memset(&sqe, 0, sizeof(sqe));
+    _sqArray[idx] = idx;
+    _sqPending++;
+    return sqe;
+}
+
+void IOURing::submit(unsigned waitCount)
+{
+    // Publish the pending SQEs to the kernel
+    __atomic_store_n(_sqTail, *_sqTail+_sqPending, __ATOMIC_RELEASE);
+    unsigned toSubmit = _sqPending;
+    _sqPending = 0;
+    
+    unsigned flags = (waitCount ? IORING_ENTER_GETEVENTS : 0);
+    if (_sqpoll)
+    {
+        // The poll thread picks up the SQEs by itself, unless it went to sleep after idling.
+        // The fence orders our tail store before the flags load; see io_uring_setup(2).
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(_sqFlags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP)
+            flags |= IORING_ENTER_SQ_WAKEUP;
+        else if (!waitCount)
+            return;
+    }
+    
+    for (;;)
+    {
+        const int ir = _Enter(_fd, toSubmit, waitCount, flags);
+        if (ir >= 0) return;
+        if (errno == EINTR)
+        {
+            // The kernel consumed the SQEs it reported; only retry the wait
+            toSubmit = 0;
+            continue;
+        }
+        throw RUNTIME_ERROR("io_uring_enter failed: %s", strerror(errno));
+    }
+}
+
+const io_uring_cqe* IOURing::cqe()
+{
+    const unsigned head = *_cqHead;
+    if (head == __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE)) return nullptr;
+    return &_cqes[head & _cqMask];
+}
+
+void IOURing::cqeSeen()
+{
+    __atomic_store_n(_cqHead, *_cqHead+1, __ATOMIC_RELEASE);
+}
+
+void IOURing::registerFile(int fd)
+{
+    const int ir = _Register(_fd, IORING_REGISTER_FILES, &fd, 1);
+    if (ir) throw RUNTIME_ERROR("IORING_REGISTER_FILES failed: %s", strerror(errno));
+}
+
+void IOURing::registerBufRing(uint16_t group, uint16_t count)
+{
+    // `count` must be a power of 2
+    assert(count && !(count & (count-1)));
+    assert(!_bufRing);
+    
+    _bufRingLen = count*sizeof(io_uring_buf);
+    void* bufRing = mmap(nullptr, _bufRingLen, PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+    if (bufRing == MAP_FAILED) throw RUNTIME_ERROR("mmap failed: %s", strerror(errno));
+    _bufRing = (io_uring_buf*)bufRing;
+    _bufCount = count;
+    
+    io_uring_buf_reg reg = {
+        .ring_addr = (uint64_t)(uintptr_t)_bufRing,
+        .ring_entries = count,
+        .bgid = group,
+    };
+    const int ir = _Register(_fd, IORING_REGISTER_PBUF_RING, &reg, 1);
+    if (ir) throw RUNTIME_ERROR("IORING_REGISTER_PBUF_RING failed: %s", strerror(errno));
+}
+
+void IOURing::bufProvide(uint16_t bid, void* data, size_t len)
+{
+    assert(bid < _bufCount);
+    // The ring's tail is overlaid on bufs[0].resv. We don't use io_uring_buf_ring to access
+    // it, because its flexible array member has a different layout when compiled as C++.
+    uint16_t*const tailPtr = &_bufRing[0].resv;
+    const uint16_t tail = *tailPtr;
+    // Don't assign the whole struct, to avoid clobbering the tail
+    io_uring_buf& b = _bufRing[tail & (_bufCount-1)];
+    b.addr = (uint64_t)(uintptr_t)data;
+    b.len = (uint32_t)len;
+    b.bid = bid;
+    __atomic_store_n(tailPtr, (uint16_t)(tail+1), __ATOMIC_RELEASE);
+}
+
+bool IOURing::recvMultishotSupported(uint16_t group)
+{
+    // Receive from a socket whose peer has shut down: a kernel that supports multishot
+    // receive completes it right away (with EOF, or ENOBUFS if no buffers have been provided),
+    // while an older one rejects it with EINVAL
+    int sockets[2] = {-1, -1};
+    const int ir = socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, sockets);
+    if (ir) throw RUNTIME_ERROR("socketpair failed: %s", strerror(errno));
+    shutdown(sockets[1], SHUT_WR);
+    
+    io_uring_sqe& s = sqe();
+    s.opcode = IORING_OP_RECV;
+    s.fd = sockets[0];
+    s.ioprio = IORING_RECV_MULTISHOT;
+    s.flags = IOSQE_BUFFER_SELECT;
+    s.buf_group = group;
+    
+    const io_uring_cqe* c = nullptr;
+    try
+    {
+        submit(1);
+        c = cqe();
+    }
+    catch (...)
+    {
+        close(sockets[0]);
+        close(sockets[1]);
+        throw;
+    }
+    close(sockets[0]);
+    close(sockets[1]);
+    
+    assert(c);
+    const int32_t res = c->res;
+    cqeSeen();
+    return res != -EINVAL;
+}
@@ -0,0 +1,81 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <linux/io_uring.h>
+
+// Minimal io_uring wrapper, talking to the kernel directly (no liburing dependency).
+// An IOURing must only be used by one thread at a time.
+class IOURing
+{
+public:
+    // Throws if io_uring is unavailable (old kernel, seccomp, etc). With `sqpoll`, a kernel
+    // thread picks up the ring's SQEs instead of io_uring_enter(), if the kernel permits it
+    // (see sqpoll()). Every such ring in the process shares one poll thread.
+    IOURing(unsigned entries, bool sqpoll=false);
+    
+    ~IOURing();
+    
+    IOURing(const IOURing& x) = delete;
+    IOURing& operator=(const IOURing& x) = delete;
+    
+    // Returns a zeroed SQE, submitting the pending SQEs first if the SQ is full
+    io_uring_sqe& sqe();
+    
+    // Whether a kernel thread polls the SQ, in which case submit() only enters the kernel to
+    // wake that thread, or to wait for CQEs
+    bool sqpoll() const { return _sqpoll; }
+    
+    // Submits the pending SQEs, and waits until at least `waitCount` CQEs are available
+    void submit(unsigned waitCount=0);
+    
+    // Returns the next CQE, or nullptr if there isn't one. Call `cqeSeen()` once the CQE
+    // has been processed.
+    const io_uring_cqe* cqe();
+    
+    void cqeSeen();
+    
+    // Registers `fd` as fixed file 0, for use with IOSQE_FIXED_FILE, so that the kernel
+    // doesn't have to look it up for every SQE. The ring holds a reference to the file until
+    // it's destroyed.
+    void registerFile(int fd);
+    
+    // Registers a provided-buffer ring with `count` entries as group `group`, for use with
+    // IOSQE_BUFFER_SELECT (eg multishot receive). The buffers are supplied by bufProvide().
+    void registerBufRing(uint16_t group, uint16_t count);
+    
+    // Hands buffer `bid` (`len` bytes at `data`) to the provided-buffer ring. The kernel owns
+    // the memory until a CQE returns the buffer.
+    void bufProvide(uint16_t bid, void* data, size_t len);
+    
+    // Whether the kernel supports multishot receive (IORING_RECV_MULTISHOT) into provided-
+    // buffer group `group`. Must be called while no CQEs are pending.
+    bool recvMultishotSupported(uint16_t group);
+
+private:
+    void _cleanup();
+    
+    int _fd = -1;
+    bool _sqpoll = false;
+    
+    void* _ringMem = nullptr;
+    size_t _ringMemLen = 0;
+    io_uring_sqe* _sqes = nullptr;
+    size_t _sqesLen = 0;
+    
+    unsigned* _sqHead = nullptr;
+    unsigned* _sqTail = nullptr;
+    unsigned* _sqArray = nullptr;
+    unsigned* _sqFlags = nullptr;
+    unsigned _sqMask = 0;
+    unsigned _sqEntries = 0;
+    unsigned _sqPending = 0;
+    
+    unsigned* _cqHead = nullptr;
+    unsigned* _cqTail = nullptr;
+    io_uring_cqe* _cqes = nullptr;
+    unsigned _cqMask = 0;
+    
+    io_uring_buf* _bufRing = nullptr;
+    size_t _bufRingLen = 0;
+    uint16_t _bufCount = 0;
+};
@@ -0,0 +1,345 @@
+#include "IOWorkerPool.h"
+#include <cerrno>
+#include <cstring>
+#include <cassert>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "LIB/Toastbox/RuntimeError.h"
+
+IOWorkerPool::IOWorkerPool(size_t workerCount)
+{
+    if (!workerCount) workerCount = std::max(1u, std::thread::hardware_concurrency());
+    
+    try
+    {
+        for (size_t i=0; i<workerCount; i++)
+        {
+            auto w = std::make_unique<_Worker>();
+            _workers.push_back(std::move(w));
+            _Worker& worker = *_workers.back();
+            
+            worker.epollFD = epoll_create1(EPOLL_CLOEXEC);
+            if (worker.epollFD < 0) throw RUNTIME_ERROR("epoll_create1 failed: %s", strerror(errno));
+            
+            worker.eventFD = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+            if (worker.eventFD < 0) throw RUNTIME_ERROR("eventfd failed: %s", strerror(errno));
+            
+            epoll_event ev = {.events = EPOLLIN, .data = {.u64 = 0}};
+            const int ir = epoll_ctl(worker.epollFD, EPOLL_CTL_ADD, worker.eventFD, &ev);
+            if (ir) throw RUNTIME_ERROR("epoll_ctl failed: %s", strerror(errno));
+        }
+        
+        for (auto& w : _workers)
+            w->thread = std::thread([this, &w = *w] { _workerThread(w); });
+    
+    }
+    catch (...)
+    {
+        _cleanup();
+        throw;
+    }
+}
+
+IOWorkerPool::~IOWorkerPool()
+{
+    _cleanup();
+}
+
+void IOWorkerPool::_cleanup()
+{
+    _stop = true;
+    for (auto& w : _workers)
+    {
+        if (w->eventFD >= 0) _Wake(*w);
+    }
+    
+    for (auto& w : _workers)
+    {
+        if (w->thread.joinable()) w->thread.join();
+        assert(w->sources.empty());
+        if (w->epollFD >= 0) close(w->epollFD);
+        if (w->eventFD >= 0) close(w->eventFD);
+    }
+    _workers.clear();
+}
+
+IOWorkerPool::SourceRef IOWorkerPool::add(int fd, uint32_t events, Fn fn)
+{
+    // Assign the source to the worker with the fewest sources
+    _Worker* worker = nullptr;
+    size_t workerLoad = SIZE_MAX;
+    for (auto& w : _workers)
+    {
+        auto lock = std::unique_lock(w->lock);
+        if (w->sources.size() < workerLoad)
+        {
+            worker = w.get();
+            workerLoad = w->sources.size();
+        }
+    }
+    
+    SourceRef src(new Source());
+    src->_id = _sourceID++;
+    src->_fd = fd;
+    src->_fn = std::move(fn);
+    src->_worker = worker;
+    src->_armed = events;
+    
+    {
+        auto lock = std::unique_lock(worker->lock);
+        worker->sources[src->_id] = src;
+    }
+    
+    if (fd < 0) return src;
+    
+    // One-shot, so that only one worker at a time handles the source
+    epoll_event ev = {.events = events|EPOLLONESHOT, .data = {.u64 = src->_id}};
+    const int ir = epoll_ctl(worker->epollFD, EPOLL_CTL_ADD, fd, &ev);
+    if (ir)
+    {
+        auto lock = std::unique_lock(worker->lock);
+        worker->sources.erase(src->_id);
+        throw RUNTIME_ERROR("epoll_ctl failed: %s", strerror(errno));
+    }
+    return src;
+}
+
+void IOWorkerPool::poll(const SourceRef& src, uint32_t events)
+{
+    auto lock = std::unique_lock(src->_lock);
+    if (src->_removed) return;
+    // If the callback is pending, it'll be armed afterwards
+    if (src->_queued || src->_running)
+    {
+        src->_extra |= events;
+        return;
+    }
+    if ((src->_armed|events) != src->_armed)
+        _arm(*src, src->_armed|events);
+}
+
+void IOWorkerPool::kick(const SourceRef& src)
+{
+    {
+        auto lock = std::unique_lock(src->_lock);
+        if (src->_removed || src->_queued) return;
+        if (src->_running)
+        {
+            src->_rerun = true;
+            return;
+        }
+        src->_queued = true;
+    }
+    _enqueue(src);
+}
+
+void IOWorkerPool::remove(const SourceRef& src)
+{
+    _Worker& w = *src->_worker;
+    {
+        auto lock = std::unique_lock(src->_lock);
+        if (!src->_removed)
+        {
+            src->_removed = true;
+            if (src->_fd >= 0) epoll_ctl(w.epollFD, EPOLL_CTL_DEL, src->_fd, nullptr);
+        }
+        
+        // Wait for the callback to return, unless we're being called from it
+        while (src->_running && src->_runner!=std::this_thread::get_id())
+            src->_idle.wait(lock);
+    }
+    
+    auto lock = std::unique_lock(w.lock);
+    w.sources.erase(src->_id);
+}
+
+void IOWorkerPool::_workerThread(_Worker& w)
+{
+    epoll_event events[64];
+    for (;;)
+    {
+        // Run our own work first, then steal work from the other workers
+        if (SourceRef src = _take(w))
+        {
+            _run(src);
+            continue;
+        }
+        
+        // Nothing to do: wait for a source to become ready, or for work to steal
+        const int ir = epoll_wait(w.epollFD, events, std::size(events), -1);
+        // Nothing can fail here short of a bug, and there's nobody to report it to
+        if (ir<0 && errno!=EINTR) abort();
+        
+        {
+            auto lock = std::unique_lock(w.lock);
+            w.idle = false;
+        }
+        
+        if (_stop) return;
+        
+        for (int i=0; i<ir; i++)
+        {
+            const epoll_event& ev = events[i];
+            if (!ev.data.u64)
+            {
+                uint64_t val = 0;
+                (void)!::read(w.eventFD, &val, sizeof(val));
+                continue;
+            }
+            
+            SourceRef src;
+            {
+                auto lock = std::unique_lock(w.lock);
+                auto it = w.sources.find(ev.data.u64);
+                if (it == w.sources.end()) continue; // Removed since the event fired
+                src = it->second;
+            }
+            
+            bool enqueue = false;
+            {
+                auto lock = std::unique_lock(src->_lock);
+                if (src->_removed) continue;
+                // The event disarmed the (one-shot) source
+                src->_armed = 0;
+                src->_fired |= ev.events;
+                if (src->_running) src->_rerun = true;
+                else if (!src->_queued) src->_queued = enqueue = true;
+            }
+            if (enqueue) _enqueue(src);
+        }
+    }
+}
+
+IOWorkerPool::SourceRef IOWorkerPool::_take(_Worker& w)
+{
+    {
+        auto lock = std::unique_lock(w.lock);
+        if (!w.runQueue.empty())
+        {
+            SourceRef src = std::move(w.runQueue.front());
+            w.runQueue.pop_front();
+            return src;
+        }
+    }
+    
+    // Steal from the back of another worker's run queue, since the front is what that worker
+    // will get to first
+    for (auto& v : _workers)
+    {
+        if (v.get() == &w) continue;
+        auto lock = std::unique_lock(v->lock);
+        if (!v->runQueue.empty())
+        {
+            SourceRef src = std::move(v->runQueue.back());
+            v->runQueue.pop_back();
+            return src;
+        }
+    }
+    
+    // Mark ourself idle while holding our lock, so that _enqueue() either sees that we're
+    // idle and wakes us, or we see the work that it enqueued
+    auto lock = std::unique_lock(w.lock);
+    if (!w.runQueue.empty())
+    {
+        SourceRef src = std::move(w.runQueue.front());
+        w.runQueue.pop_front();
+        return src;
+    }
+    w.idle = true;
+    return nullptr;
+}
+
+void IOWorkerPool::_run(const SourceRef& src)
+{
+    uint32_t events = 0;
+    {
+        auto lock = std::unique_lock(src->_lock);
+        src->_queued = false;
+        if (src->_removed) return;
+        src->_running = true;
+        src->_runner = std::this_thread::get_id();
+        events = src->_fired;
+        src->_fired = 0;
+    }
+    
+    const uint32_t next = src->_fn(events);
+    
+    bool enqueue = false;
+    {
+        auto lock = std::unique_lock(src->_lock);
+        src->_running = false;
+        src->_runner = {};
+        src->_idle.notify_all();
+        if (src->_removed) return;
+        
+        const uint32_t want = next|src->_extra;
+        src->_extra = 0;
+        if (src->_rerun)
+        {
+            // Arm the events after the next run instead
+            src->_rerun = false;
+            src->_extra = want;
+            src->_queued = enqueue = true;
+        }
+        else if (want)
+        {
+            _arm(*src, want);
+        }
+    }
+    if (enqueue) _enqueue(src);
+}
+
+void IOWorkerPool::_enqueue(const SourceRef& src)
+{
+    _Worker& w = *src->_worker;
+    bool wake = false;
+    size_t queued = 0;
+    {
+        auto lock = std::unique_lock(w.lock);
+        w.runQueue.push_back(src);
+        wake = w.idle;
+        w.idle = false;
+        queued = w.runQueue.size();
+    }
+    
+    if (wake)
+    {
+        _Wake(w);
+        return;
+    }
+    
+    // The source's worker is busy, so if work is piling up, wake an idle worker to steal it
+    if (queued > 1)
+    {
+        for (auto& v : _workers)
+        {
+            if (v.get() == &w) continue;
+            auto lock = std::unique_lock(v->lock);
+            if (v->idle)
+            {
+                v->idle = false;
+                lock.unlock();
+                _Wake(*v);
+                break;
+            }
+        }
+    }
+}
+    
+    // src->_lock must be held
+void IOWorkerPool::_arm(Source& src, uint32_t events)
+{
+    if (src._fd < 0) return;
+    epoll_event ev = {.events = events|EPOLLONESHOT, .data = {.u64 = src._id}};
+    const int ir = epoll_ctl(src._worker->epollFD, EPOLL_CTL_MOD, src._fd, &ev);
+    // Callers can't do anything sensible about a failure; the source just won't fire
+    if (!ir) src._armed = events;
+}
+
+void IOWorkerPool::_Wake(_Worker& w)
+{
+    const uint64_t val = 1;
+    (void)!::write(w.eventFD, &val, sizeof(val));
+}
@@ -0,0 +1,107 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+
+// IOWorkerPool: a fixed set of worker threads that multiplexes many file descriptors (eg the
+// usbip sockets of many devices), so that the thread count doesn't grow with the number of
+// file descriptors.
+//
+// Each source is assigned to the least-loaded worker, which polls it with epoll. Sources that
+// become ready go on the worker's run queue, and workers with nothing to do steal from the
+// run queues of busy workers.
+class IOWorkerPool
+{
+public:
+    class Source;
+    using SourceRef = std::shared_ptr<Source>;
+    
+    // Called on a worker thread with the epoll events that fired (0 if the source was just
+    // kicked), and returns the events to wait for next (0 to stop polling until poll() or
+    // kick()). Calls for a given source never overlap. Mustn't throw.
+    using Fn = std::function<uint32_t(uint32_t events)>;
+    
+    // workerCount==0: one worker per CPU
+    IOWorkerPool(size_t workerCount=0);
+    
+    // Every source must have been removed
+    ~IOWorkerPool();
+    
+    IOWorkerPool(const IOWorkerPool& x) = delete;
+    IOWorkerPool& operator=(const IOWorkerPool& x) = delete;
+    
+    size_t workerCount() const { return _workers.size(); }
+    
+    // Starts polling `fd` for `events` (EPOLLIN, EPOLLOUT, ...). With fd==-1, the source
+    // has no file descriptor, and only runs when it's kicked; `events` and the callback's
+    // return value are ignored.
+    SourceRef add(int fd, uint32_t events, Fn fn);
+    
+    // Adds `events` to the events that `src` waits for
+    void poll(const SourceRef& src, uint32_t events);
+    
+    // Calls the source's callback soon, whether or not its file descriptor is ready
+    void kick(const SourceRef& src);
+    
+    // Stops polling `src`. Once remove() returns, the callback isn't running and won't be
+    // called again -- unless remove() is called from the callback itself, in which case it
+    // won't be called again after it returns.
+    void remove(const SourceRef& src);
+
+private:
+    struct _Worker
+    {
+        int epollFD = -1;
+        int eventFD = -1; // Wakes the worker from epoll_wait()
+        std::thread thread;
+        
+        std::mutex lock; // Protects the fields below
+        std::unordered_map<uint64_t,SourceRef> sources;
+        std::deque<SourceRef> runQueue;
+        bool idle = false; // Blocked in epoll_wait() (or about to be)
+    };
+    
+    void _cleanup();
+    void _workerThread(_Worker& w);
+    SourceRef _take(_Worker& w);
+    void _run(const SourceRef& src);
+    void _enqueue(const SourceRef& src);
+    void _arm(Source& src, uint32_t events);
+    static void _Wake(_Worker& w);
+    
+    std::vector<std::unique_ptr<_Worker>> _workers;
+    std::atomic<uint64_t> _sourceID = 1; // 0 identifies the eventfd
+    std::atomic<bool> _stop = false;
+};
+
+class IOWorkerPool::Source
+{
+private:
+    Source() {}
+    
+    uint64_t _id = 0;
+    int _fd = -1;
+    Fn _fn;
+    _Worker* _worker = nullptr;
+    
+    std::mutex _lock; // Protects the fields below
+    std::condition_variable _idle; // Signalled when `_running` clears
+    uint32_t _armed = 0; // Events that epoll is waiting for
+    uint32_t _fired = 0; // Events that fired, for the next callback
+    uint32_t _extra = 0; // Events to wait for in addition to the callback's return value
+    bool _queued = false;
+    bool _running = false;
+    bool _rerun = false; // Run the callback again once it returns
+    bool _removed = false;
+    std::thread::id _runner;
+    
+    friend class IOWorkerPool;
+};
@@ -3,7 +3,8 @@
 
 std::runtime_error rt_error(const char * str, ...)
 {
-    static char msg[256];
+    // Not static: errors can be raised on several threads at once (eg one per device)
+    char msg[256];
     va_list args;
     va_start(args, str);
     vsnprintf(msg, sizeof(msg), str, args);
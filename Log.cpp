@@ -0,0 +1,220 @@
+#include "Log.h"
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <ctime>
+#include <memory>
+#include <thread>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+static void _DefaultSink(const Log::Entry& entry)
+{
+    static constexpr char Levels[] = {'D','I','W','E'};
+    const time_t sec = (time_t)(entry.time / 1000000000);
+    const unsigned usec = (unsigned)((entry.time % 1000000000) / 1000);
+    tm t = {};
+    localtime_r(&sec, &t);
+    printf("%02d:%02d:%02d.%06u %c %s\n", t.tm_hour, t.tm_min, t.tm_sec, usec,
+        Levels[(size_t)entry.level & 3], entry.msg);
+    fflush(stdout);
+}
+
+// _Logger: the message queue and the log thread behind Log. The queue is a bounded
+// multi-producer, single-consumer ring: producers claim a slot with a CAS on `_tail`, and each
+// slot's sequence number tells the log thread when its message is complete. The log thread
+// parks on a futex when the queue is empty, and producers only pay for the wake-up syscall
+// when it's actually parked.
+class _Logger
+{
+public:
+    static _Logger& Get()
+    {
+        // Never destroyed, so that threads can keep logging while the process exits
+        static _Logger* logger = new _Logger();
+        return *logger;
+    }
+    
+    Log::_Msg* reserve()
+    {
+        size_t pos = _tail.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            _Slot& slot = _slots[pos & (_Cap-1)];
+            const size_t seq = slot.seq.load(std::memory_order_acquire);
+            const intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (!diff)
+            {
+                if (_tail.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed))
+                {
+                    slot.pos = pos;
+                    return &slot.msg;
+                }
+            }
+            else if (diff < 0)
+            {
+                // Full
+                _dropped.fetch_add(1, std::memory_order_relaxed);
+                return nullptr;
+            }
+            else
+            {
+                pos = _tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+    
+    void commit(Log::_Msg* msg)
+    {
+        // `msg` is the first member of its _Slot
+        _Slot& slot = *(_Slot*)msg;
+        timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        msg->time = (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+        slot.seq.store(slot.pos+1, std::memory_order_release);
+        
+        // Pairs with the fence in _park(): either we see that the log thread is parked, or it
+        // sees our message
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!_parked.load(std::memory_order_relaxed)) return;
+        _wakeSeq.fetch_add(1, std::memory_order_release);
+        _FutexWake(_wakeSeq);
+    }
+    
+    void flush()
+    {
+        const size_t tail = _tail.load(std::memory_order_acquire);
+        while (_head.load(std::memory_order_acquire) < tail)
+            usleep(1000);
+    }
+    
+    uint64_t dropped() const { return _dropped.load(std::memory_order_relaxed); }
+    
+    std::atomic<Log::Sink> sink = &_DefaultSink;
+
+private:
+    static constexpr size_t _Cap = 4096; // Must be a power of 2
+    
+    struct _Slot
+    {
+        Log::_Msg msg; // Must be first; see commit()
+        std::atomic<size_t> seq = 0; // pos: free, pos+1: holds the message at pos
+        size_t pos = 0;
+    };
+    
+    _Logger() : _slots(std::make_unique<_Slot[]>(_Cap))
+    {
+        for (size_t i=0; i<_Cap; i++)
+            _slots[i].seq.store(i, std::memory_order_relaxed);
+        std::thread([this] { _logThread(); }).detach();
+        atexit(Log::Flush);
+    }
+    
+    bool _ready() const
+    {
+        const size_t head = _head.load(std::memory_order_relaxed);
+        return _slots[head & (_Cap-1)].seq.load(std::memory_order_acquire) == head+1;
+    }
+    
+    void _park()
+    {
+        const uint32_t seq = _wakeSeq.load(std::memory_order_acquire);
+        _parked.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!_ready())
+            syscall(SYS_futex, (uint32_t*)&_wakeSeq, FUTEX_WAIT|FUTEX_PRIVATE_FLAG, seq, nullptr, nullptr, 0);
+        _parked.store(false, std::memory_order_relaxed);
+    }
+    
+    static void _FutexWake(std::atomic<uint32_t>& word)
+    {
+        static_assert(sizeof(word) == sizeof(uint32_t));
+        syscall(SYS_futex, (uint32_t*)&word, FUTEX_WAKE|FUTEX_PRIVATE_FLAG, INT_MAX, nullptr, nullptr, 0);
+    }
+    
+    void _logThread()
+    {
+        uint64_t droppedReported = 0;
+        for (;;)
+        {
+            if (!_ready())
+            {
+                _park();
+                continue;
+            }
+            
+            const size_t head = _head.load(std::memory_order_relaxed);
+            _Slot& slot = _slots[head & (_Cap-1)];
+            const Log::_Msg msg = slot.msg;
+            // Free the slot before formatting, to make room for producers sooner
+            slot.seq.store(head+_Cap, std::memory_order_release);
+            
+            char text[Log::_TextMax];
+            msg.format(text, sizeof(text), msg.fmt, msg.args);
+            const Log::Sink s = sink.load(std::memory_order_relaxed);
+            s({.level = msg.level, .time = msg.time, .msg = text});
+            
+            const uint64_t dropped = _dropped.load(std::memory_order_relaxed);
+            if (dropped != droppedReported)
+            {
+                snprintf(text, sizeof(text), "Log: dropped %ju messages", (uintmax_t)(dropped-droppedReported));
+                s({.level = Log::Level::Warn, .time = msg.time, .msg = text});
+                droppedReported = dropped;
+            }
+            
+            // Publish our progress for flush() last, so that it returns after the message is written
+            _head.store(head+1, std::memory_order_release);
+        }
+    }
+    
+    std::unique_ptr<_Slot[]> _slots;
+    std::atomic<uint64_t> _dropped = 0;
+    
+    // Consumer side
+    alignas(64) std::atomic<size_t> _head = 0;
+    std::atomic<uint32_t> _wakeSeq = 0; // Bumped to wake the log thread
+    std::atomic<bool> _parked = false;
+    
+    // Producer side
+    alignas(64) std::atomic<size_t> _tail = 0;
+};
+
+void Log::SetSink(Sink sink)
+{
+    _Logger::Get().sink.store(sink ? sink : &_DefaultSink, std::memory_order_relaxed);
+}
+
+void Log::Flush()
+{
+    _Logger::Get().flush();
+}
+
+uint64_t Log::Dropped()
+{
+    return _Logger::Get().dropped();
+}
+
+Log::_Msg* Log::_Reserve()
+{
+    return _Logger::Get().reserve();
+}
+
+void Log::_Commit(_Msg* msg)
+{
+    _Logger::Get().commit(msg);
+}
+
+Log::_HexText Log::_Text(const _HexData& x)
+{
+    _HexText r;
+    const size_t len = std::min((size_t)x.len, HexMax);
+    size_t off = 0;
+    for (size_t i=0; i<len; i++)
+        off += snprintf(r.s+off, sizeof(r.s)-off, (i ? " %02x" : "%02x"), x.bytes[i]);
+    if (len < x.len)
+        snprintf(r.s+off, sizeof(r.s)-off, " ... (%u bytes)", x.len);
+    else
+        r.s[off] = 0;
+    return r;
+}
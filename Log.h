@@ -0,0 +1,217 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+// Log: asynchronous logging that's cheap enough for the data paths. A LOG_*() call copies its
+// format string pointer and arguments into a lock-free queue and returns; the log thread does
+// the formatting and the stdio. So logging from inside a critical section costs about as much
+// as a memcpy, and never blocks: if the queue is full, the message is dropped (and counted).
+//
+// The format string must be a string literal. String arguments (`const char*` and
+// std::string) are copied, truncated to Log::StrMax bytes. Log::Hex() captures a byte buffer
+// (up to Log::HexMax bytes) that's printed in hex with %s.
+//
+// Messages below VIRTUALUSB_LOG_LEVEL are compiled out, along with the evaluation of their
+// arguments. It defaults to Info with NDEBUG, and Debug otherwise.
+//
+//   LOG_DEBUG("VirtualUSBDevice: SET_CONFIGURATION %u", cfg);
+
+#define VIRTUALUSB_LOG_LEVEL_DEBUG  0
+#define VIRTUALUSB_LOG_LEVEL_INFO   1
+#define VIRTUALUSB_LOG_LEVEL_WARN   2
+#define VIRTUALUSB_LOG_LEVEL_ERROR  3
+#define VIRTUALUSB_LOG_LEVEL_OFF    4
+
+#ifndef VIRTUALUSB_LOG_LEVEL
+#   ifdef NDEBUG
+#       define VIRTUALUSB_LOG_LEVEL VIRTUALUSB_LOG_LEVEL_INFO
+#   else
+#       define VIRTUALUSB_LOG_LEVEL VIRTUALUSB_LOG_LEVEL_DEBUG
+#   endif
+#endif
+
+#define _LOG(level, fmt, ...) do {                                                  \
+    if constexpr ((int)(level) >= VIRTUALUSB_LOG_LEVEL) {                           \
+        Log::Write(level, fmt, ##__VA_ARGS__);                                      \
+    }                                                                               \
+} while (0)
+
+#define LOG_DEBUG(fmt, ...) _LOG(Log::Level::Debug, fmt, ##__VA_ARGS__)
+#define LOG_INFO(fmt, ...)  _LOG(Log::Level::Info,  fmt, ##__VA_ARGS__)
+#define LOG_WARN(fmt, ...)  _LOG(Log::Level::Warn,  fmt, ##__VA_ARGS__)
+#define LOG_ERROR(fmt, ...) _LOG(Log::Level::Error, fmt, ##__VA_ARGS__)
+
+class Log
+{
+public:
+    enum class Level : uint8_t
+    {
+        Debug = VIRTUALUSB_LOG_LEVEL_DEBUG,
+        Info  = VIRTUALUSB_LOG_LEVEL_INFO,
+        Warn  = VIRTUALUSB_LOG_LEVEL_WARN,
+        Error = VIRTUALUSB_LOG_LEVEL_ERROR,
+    };
+    
+    // A formatted message, as handed to the sink
+    struct Entry
+    {
+        Level level = Level::Info;
+        uint64_t time = 0; // Nanoseconds since the epoch, when the message was logged
+        const char* msg = nullptr;
+    };
+    
+    // Called on the log thread for every message. The default sink prints a timestamp, the
+    // level and the message to stdout.
+    using Sink = void(*)(const Entry& entry);
+    
+    static constexpr size_t StrMax = 63;
+    static constexpr size_t HexMax = 64;
+    
+    struct Hex
+    {
+        Hex(const void* data, size_t len) : data((const uint8_t*)data), len(len) {}
+        const uint8_t* data = nullptr;
+        size_t len = 0;
+    };
+    
+    // Replaces the sink. Not synchronized with messages that are being written.
+    static void SetSink(Sink sink);
+    
+    // Waits until the messages logged so far have been written. Called at exit(); call it
+    // before _exit() as well.
+    static void Flush();
+    
+    // The number of messages dropped because the queue was full
+    static uint64_t Dropped();
+    
+    // Arguments are taken by value, since references can't bind to the packed fields of
+    // descriptors and usbip headers
+    template<typename... Args>
+    static void Write(Level level, const char* fmt, Args... args)
+    {
+        using Tuple = std::tuple<typename _Arg<std::decay_t<Args>>::Type...>;
+        static_assert(sizeof(Tuple) <= _ArgsLen, "too many log arguments");
+        static_assert((std::is_trivially_copyable_v<typename _Arg<std::decay_t<Args>>::Type> && ...));
+        
+        _Msg* msg = _Reserve();
+        if (!msg) return;
+        msg->level = level;
+        msg->fmt = fmt;
+        msg->format = &_Format<Tuple>;
+        new (msg->args) Tuple(_Arg<std::decay_t<Args>>::Capture(args)...);
+        _Commit(msg);
+    }
+
+private:
+    static constexpr size_t _ArgsLen = 192;
+    static constexpr size_t _TextMax = 1024;
+    
+    using _FormatFn = int(*)(char* buf, size_t len, const char* fmt, const void* args);
+    
+    struct _Msg
+    {
+        Level level = Level::Info;
+        uint64_t time = 0;
+        const char* fmt = nullptr;
+        _FormatFn format = nullptr;
+        alignas(std::max_align_t) uint8_t args[_ArgsLen];
+    };
+    
+    struct _Str
+    {
+        char s[StrMax+1];
+    };
+    
+    struct _HexData
+    {
+        uint32_t len; // The buffer's full length
+        uint8_t bytes[HexMax];
+    };
+    
+    struct _HexText
+    {
+        char s[3*HexMax+32];
+    };
+    
+    template<typename T, typename=void>
+    struct _Arg
+    {
+        static_assert(std::is_arithmetic_v<T> || std::is_pointer_v<T> || std::is_enum_v<T>,
+            "unsupported log argument type");
+        using Type = T;
+        static T Capture(T x) { return x; }
+    };
+    
+    static _Str _CaptureStr(const char* x, size_t len)
+    {
+        _Str r;
+        len = std::min(len, StrMax);
+        memcpy(r.s, x, len);
+        r.s[len] = 0;
+        return r;
+    }
+    
+    // Values as they're passed to snprintf()
+    template<typename T>
+    static T _Val(const T& x) { return x; }
+    static const char* _Val(const _Str& x) { return x.s; }
+    static const char* _Val(const _HexText& x) { return x.s; }
+    
+    // Stored values -> values that _Val() can pass to snprintf()
+    template<typename T>
+    static const T& _Text(const T& x) { return x; }
+    static _HexText _Text(const _HexData& x);
+    
+    template<typename Tuple>
+    static int _Format(char* buf, size_t len, const char* fmt, const void* args)
+    {
+        return std::apply([&] (const auto&... a) {
+            return std::apply([&] (const auto&... t) {
+                return snprintf(buf, len, fmt, _Val(t)...);
+            }, std::tuple<decltype(_Text(a))...>(_Text(a)...));
+        }, *(const Tuple*)args);
+    }
+    
+    static _Msg* _Reserve();
+    static void _Commit(_Msg* msg);
+    
+    friend class _Logger;
+};
+
+template<>
+struct Log::_Arg<const char*>
+{
+    using Type = _Str;
+    static _Str Capture(const char* x) { return _CaptureStr(x, strlen(x)); }
+};
+
+template<>
+struct Log::_Arg<char*> : Log::_Arg<const char*> {};
+
+template<>
+struct Log::_Arg<std::string>
+{
+    using Type = _Str;
+    static _Str Capture(const std::string& x) { return _CaptureStr(x.data(), x.size()); }
+};
+
+template<>
+struct Log::_Arg<Log::Hex>
+{
+    using Type = _HexData;
+    static _HexData Capture(const Hex& x)
+    {
+        _HexData r = {.len = (uint32_t)x.len};
+        memcpy(r.bytes, x.data, std::min(x.len, HexMax));
+        return r;
+    }
+};
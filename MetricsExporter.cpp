@@ -0,0 +1,332 @@
+#include "MetricsExporter.h"
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <cstdarg>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include "LIB/Toastbox/RuntimeError.h"
+#include "Log.h"
+
+#define USB             Toastbox::USB
+
+// Quantiles exported for each latency stage
+static constexpr double _Quantiles[] = { .5, .9, .99, .999 };
+
+struct _Snapshot
+{
+    std::string label; // `device="..."`, escaped
+    VirtualUSBDevice::Stats stats;
+    std::vector<VirtualUSBDevice::LatencyStats> latency;
+};
+
+// Appends the formatted string to `s`
+static void _Printf(std::string& s, const char* fmt, ...)
+{
+    va_list args, args2;
+    va_start(args, fmt);
+    va_copy(args2, args);
+    const int len = vsnprintf(nullptr, 0, fmt, args);
+    va_end(args);
+    if (len > 0)
+    {
+        const size_t off = s.size();
+        s.resize(off+len+1);
+        vsnprintf(s.data()+off, len+1, fmt, args2);
+        s.resize(off+len);
+    }
+    va_end(args2);
+}
+
+static std::string _Label(const std::string& name)
+{
+    // Label values escape backslashes, quotes and newlines
+    std::string r = "device=\"";
+    for (char c : name)
+    {
+        if (c == '\n') r += "\\n";
+        else if (c=='\\' || c=='"') (r += '\\') += c;
+        else r += c;
+    }
+    return r + "\"";
+}
+
+static const char* _Dir(uint8_t ep)
+{
+    return ((ep & USB::Endpoint::DirectionMask) == USB::Endpoint::DirectionIn ? "in" : "out");
+}
+
+static void _Family(std::string& s, const char* name, const char* type, const char* help)
+{
+    _Printf(s, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+template<typename Fn>
+static void _DeviceMetric(std::string& s, const std::vector<_Snapshot>& snaps,
+    const char* name, const char* type, const char* help, Fn fn)
+{
+    _Family(s, name, type, help);
+    for (const _Snapshot& snap : snaps)
+        _Printf(s, "%s{%s} %ju\n", name, snap.label.c_str(), (uintmax_t)fn(snap.stats));
+}
+
+// inOnly: only list the IN endpoints (for the metrics that only apply to them)
+template<typename Fn>
+static void _EndpointMetric(std::string& s, const std::vector<_Snapshot>& snaps,
+    const char* name, const char* type, const char* help, bool inOnly, Fn fn)
+{
+    _Family(s, name, type, help);
+    for (const _Snapshot& snap : snaps)
+    {
+        for (const VirtualUSBDevice::EndpointStats& eps : snap.stats.eps)
+        {
+            if (inOnly && (eps.ep & USB::Endpoint::DirectionMask)!=USB::Endpoint::DirectionIn)
+                continue;
+            _Printf(s, "%s{%s,ep=\"0x%02x\",dir=\"%s\"} %ju\n", name, snap.label.c_str(),
+                eps.ep, _Dir(eps.ep), (uintmax_t)fn(eps));
+        }
+    }
+}
+
+MetricsExporter::MetricsExporter(const Info& info) : _info(info)
+{
+    assert(!_info.path.empty());
+    for ([[maybe_unused]] const Device& dev : _info.devices)
+        assert(dev.device);
+}
+
+MetricsExporter::~MetricsExporter()
+{
+    stop();
+}
+
+void MetricsExporter::start()
+{
+    assert(!_thread.joinable());
+    try
+    {
+        sockaddr_un addr = {.sun_family = AF_UNIX};
+        if (_info.path.size() >= sizeof(addr.sun_path))
+            throw RUNTIME_ERROR("socket path too long: %s", _info.path.c_str());
+        memcpy(addr.sun_path, _info.path.c_str(), _info.path.size()+1);
+        
+        _listenFD = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+        if (_listenFD < 0) throw RUNTIME_ERROR("socket failed: %s", strerror(errno));
+        
+        // Replace the socket left behind by a previous run
+        unlink(_info.path.c_str());
+        int ir = bind(_listenFD, (const sockaddr*)&addr, sizeof(addr));
+        if (ir) throw RUNTIME_ERROR("bind failed: %s", strerror(errno));
+        
+        ir = listen(_listenFD, 16);
+        if (ir) throw RUNTIME_ERROR("listen failed: %s", strerror(errno));
+        
+        _eventFD = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+        if (_eventFD < 0) throw RUNTIME_ERROR("eventfd failed: %s", strerror(errno));
+        
+        _thread = std::thread([this] { _exporterThread(); });
+    
+    }
+    catch (...)
+    {
+        stop();
+        throw;
+    }
+}
+
+void MetricsExporter::stop()
+{
+    if (_thread.joinable())
+    {
+        const uint64_t val = 1;
+        (void)!::write(_eventFD, &val, sizeof(val));
+        _thread.join();
+    }
+    
+    if (_listenFD >= 0)
+    {
+        close(_listenFD);
+        _listenFD = -1;
+        unlink(_info.path.c_str());
+    }
+    
+    if (_eventFD >= 0)
+    {
+        close(_eventFD);
+        _eventFD = -1;
+    }
+}
+
+std::string MetricsExporter::Format(const std::vector<Device>& devices)
+{
+    // Snapshot every device up front, so that each family lists the devices consistently
+    std::vector<_Snapshot> snaps;
+    for (const Device& dev : devices)
+    {
+        snaps.push_back({
+            .label      = _Label(dev.name),
+            .stats      = dev.device->stats(),
+            .latency    = dev.device->latencyStats(),
+        });
+    }
+    
+    using Stats = VirtualUSBDevice::Stats;
+    using EPStats = VirtualUSBDevice::EndpointStats;
+    std::string s;
+    _DeviceMetric(s, snaps, "virtualusb_errors_total", "counter",
+        "Failures that reset the device",
+        [](const Stats& x) { return x.errors; });
+    _DeviceMetric(s, snaps, "virtualusb_cmds_received_total", "counter",
+        "usbip commands received from the host",
+        [](const Stats& x) { return x.cmdsReceived; });
+    _DeviceMetric(s, snaps, "virtualusb_cmds_queued", "gauge",
+        "usbip commands received but not yet handled by read()",
+        [](const Stats& x) { return x.cmds; });
+    _DeviceMetric(s, snaps, "virtualusb_reps_sent_total", "counter",
+        "usbip replies written to the socket",
+        [](const Stats& x) { return x.repsSent; });
+    _DeviceMetric(s, snaps, "virtualusb_reps_queued", "gauge",
+        "usbip replies not yet written to the socket",
+        [](const Stats& x) { return x.reps; });
+    
+    _EndpointMetric(s, snaps, "virtualusb_urbs_submitted_total", "counter",
+        "URBs handled by read()", false,
+        [](const EPStats& x) { return x.urbsSubmitted; });
+    _EndpointMetric(s, snaps, "virtualusb_urbs_completed_total", "counter",
+        "URBs whose reply was written to the socket", false,
+        [](const EPStats& x) { return x.urbsCompleted; });
+    _EndpointMetric(s, snaps, "virtualusb_urbs_unlinked_total", "counter",
+        "URBs cancelled by the host before they completed", false,
+        [](const EPStats& x) { return x.urbsUnlinked; });
+    _EndpointMetric(s, snaps, "virtualusb_bytes_total", "counter",
+        "Payload bytes transferred by completed URBs", false,
+        [](const EPStats& x) { return x.bytes; });
+    _EndpointMetric(s, snaps, "virtualusb_in_urbs_queued", "gauge",
+        "IN URBs waiting for write()", true,
+        [](const EPStats& x) { return x.inCmds; });
+    _EndpointMetric(s, snaps, "virtualusb_in_writes_queued", "gauge",
+        "write()s waiting for IN URBs", true,
+        [](const EPStats& x) { return x.inData; });
+    _EndpointMetric(s, snaps, "virtualusb_in_bytes_queued", "gauge",
+        "Bytes of queued write()s that haven't been sent", true,
+        [](const EPStats& x) { return x.inDataBytes; });
+    
+    constexpr const char* Latency = "virtualusb_urb_latency_seconds";
+    _Family(s, Latency, "summary", "Latency of completed URBs, by stage");
+    for (const _Snapshot& snap : snaps)
+    {
+        for (const VirtualUSBDevice::LatencyStats& l : snap.latency)
+        {
+            const std::pair<const char*,const Histogram::Snapshot&> stages[] = {
+                {"queue", l.queue}, {"app", l.app}, {"send", l.send}, {"total", l.total},
+            };
+            for (const auto& [stage, h] : stages)
+            {
+                std::string labels;
+                _Printf(labels, "%s,ep=\"0x%02x\",dir=\"%s\",stage=\"%s\"",
+                    snap.label.c_str(), l.ep, _Dir(l.ep), stage);
+                for (double q : _Quantiles)
+                {
+                    _Printf(s, "%s{%s,quantile=\"%g\"} %.9f\n", Latency, labels.c_str(), q,
+                        h.percentile(q*100)/1e9);
+                }
+                _Printf(s, "%s_sum{%s} %.9f\n", Latency, labels.c_str(), h.sum/1e9);
+                _Printf(s, "%s_count{%s} %ju\n", Latency, labels.c_str(), (uintmax_t)h.count);
+            }
+        }
+    }
+    return s;
+}
+
+void MetricsExporter::_exporterThread()
+{
+    for (;;)
+    {
+        pollfd fds[] = {
+            {.fd = _listenFD, .events = POLLIN},
+            {.fd = _eventFD, .events = POLLIN},
+        };
+        const int ir = poll(fds, std::size(fds), -1);
+        if (ir < 0)
+        {
+            if (errno == EINTR) continue;
+            LOG_ERROR("MetricsExporter: poll failed: %s", strerror(errno));
+            return;
+        }
+        if (fds[1].revents) return;
+        if (!fds[0].revents) continue;
+        
+        const int fd = accept4(_listenFD, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno!=EINTR && errno!=ECONNABORTED)
+                LOG_WARN("MetricsExporter: accept4 failed: %s", strerror(errno));
+            continue;
+        }
+        
+        try
+        {
+            _serve(fd);
+        }
+        catch (const std::exception& e)
+        {
+            LOG_WARN("MetricsExporter: dropping client: %s", e.what());
+        }
+        close(fd);
+    }
+}
+
+void MetricsExporter::_serve(int fd)
+{
+    // Don't let a stalled client hold up the thread
+    const timeval timeout = {
+        .tv_sec     = _ClientTimeoutMs/1000,
+        .tv_usec    = (_ClientTimeoutMs%1000)*1000,
+    };
+    for (int opt : {SO_RCVTIMEO, SO_SNDTIMEO})
+    {
+        const int ir = setsockopt(fd, SOL_SOCKET, opt, &timeout, sizeof(timeout));
+        if (ir) throw RUNTIME_ERROR("setsockopt(SO_RCVTIMEO/SO_SNDTIMEO) failed: %s", strerror(errno));
+    }
+    
+    // Every request gets the metrics, so just consume the request's header (up to the blank
+    // line that ends it, or until the client shuts down its side)
+    std::string req;
+    while (req.find("\r\n\r\n") == std::string::npos)
+    {
+        char buf[512];
+        const ssize_t sr = recv(fd, buf, sizeof(buf), 0);
+        if (!sr) break;
+        if (sr < 0)
+        {
+            if (errno == EINTR) continue;
+            throw RUNTIME_ERROR("recv failed: %s", strerror(errno));
+        }
+        req.append(buf, sr);
+        if (req.size() > 0x2000) throw RUNTIME_ERROR("request too long");
+    }
+    
+    const std::string body = Format(_info.devices);
+    std::string rep;
+    _Printf(rep,
+        "HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+        "Content-Length: %zu\r\n"
+        "Connection: close\r\n"
+        "\r\n", body.size());
+    rep += body;
+    
+    for (size_t off=0; off<rep.size();)
+    {
+        const ssize_t sr = send(fd, rep.data()+off, rep.size()-off, MSG_NOSIGNAL);
+        if (sr < 0)
+        {
+            if (errno == EINTR) continue;
+            throw RUNTIME_ERROR("send failed: %s", strerror(errno));
+        }
+        off += sr;
+    }
+}
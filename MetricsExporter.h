@@ -0,0 +1,54 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <thread>
+#include "VirtualUSBDevice.h"
+
+// MetricsExporter: serves the stats of a set of VirtualUSBDevices (VirtualUSBDevice::stats()
+// and latencyStats()) in the Prometheus text format, over HTTP on a local Unix socket:
+//
+//   curl --unix-socket /run/VirtualUSB.sock http://localhost/metrics
+//
+// Every request gets a fresh snapshot. Snapshots don't take the devices' locks, so scraping
+// doesn't disturb their data paths. Requests are served one at a time by the exporter's
+// thread, which is plenty for a scraper.
+class MetricsExporter
+{
+public:
+    struct Device
+    {
+        std::string name; // The value of the `device` label of the device's metrics
+        VirtualUSBDevice* device = nullptr; // Must outlive the exporter
+    };
+    
+    struct Info
+    {
+        std::string path; // Path of the Unix socket (an existing file there is replaced)
+        std::vector<Device> devices;
+    };
+    
+    MetricsExporter(const Info& info);
+    
+    ~MetricsExporter();
+    
+    // Listens and starts the exporter thread
+    void start();
+    
+    // Stops serving requests and removes the socket
+    void stop();
+    
+    // Returns the metrics of `devices` in the Prometheus text format
+    static std::string Format(const std::vector<Device>& devices);
+
+private:
+    // Give up on a client that takes longer than this to send its request or read the reply
+    static constexpr int _ClientTimeoutMs = 1000;
+    
+    void _exporterThread();
+    void _serve(int fd);
+    
+    const Info _info = {};
+    int _listenFD = -1;
+    int _eventFD = -1; // Wakes the exporter thread to stop
+    std::thread _thread;
+};
@@ -0,0 +1,191 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cassert>
+#include <cerrno>
+#include <climits>
+#include <ctime>
+#include <atomic>
+#include <memory>
+#include <chrono>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+// SPSCQueue: a bounded lock-free queue between one producer and one consumer. (Several
+// threads may act as the producer or the consumer, as long as they serialize their accesses
+// externally.) A thread that has to wait parks on a futex, and the other side only pays for
+// the wake-up syscall when somebody is actually parked.
+template<typename T>
+class SPSCQueue
+{
+public:
+    using Deadline = std::chrono::steady_clock::time_point;
+    
+    // `cap` must be a power of 2
+    SPSCQueue(size_t cap) : _slots(std::make_unique<T[]>(cap)), _cap(cap)
+    {
+        assert(cap && !(cap & (cap-1)));
+    }
+    
+    SPSCQueue(const SPSCQueue& x) = delete;
+    SPSCQueue& operator=(const SPSCQueue& x) = delete;
+    
+    // Producer: moves `x` into the queue if there's space, and returns whether it did
+    bool tryPush(T& x)
+    {
+        const size_t tail = _tail.load(std::memory_order_relaxed);
+        if (tail-_headCache == _cap)
+        {
+            _headCache = _head.load(std::memory_order_acquire);
+            if (tail-_headCache == _cap) return false;
+        }
+        
+        _slots[tail & (_cap-1)] = std::move(x);
+        _tail.store(tail+1, std::memory_order_release);
+        _wake(_consumer);
+        return true;
+    }
+    
+    // Producer: waits for space and pushes `x`. Returns false (without pushing) if the queue
+    // is closed.
+    bool push(T&& x)
+    {
+        for (;;)
+        {
+            if (_closed.load(std::memory_order_acquire)) return false;
+            if (tryPush(x)) return true;
+            waitPush();
+        }
+    }
+    
+    // Producer: waits until there's space, or the queue is closed. Returns false on timeout.
+    bool waitPush(Deadline deadline=Deadline::max())
+    {
+        return _park(_producer, deadline, [&] {
+            return _closed.load(std::memory_order_acquire) ||
+                _tail.load(std::memory_order_relaxed)-_head.load(std::memory_order_acquire) < _cap;
+        });
+    }
+    
+    // Consumer: moves the front element into `x` if there is one, and returns whether it did
+    bool tryPop(T& x)
+    {
+        const size_t head = _head.load(std::memory_order_relaxed);
+        if (head == _tailCache)
+        {
+            _tailCache = _tail.load(std::memory_order_acquire);
+            if (head == _tailCache) return false;
+        }
+        
+        x = std::move(_slots[head & (_cap-1)]);
+        _head.store(head+1, std::memory_order_release);
+        _wake(_producer);
+        return true;
+    }
+    
+    // Consumer: waits for an element and pops it into `x`. Returns false on timeout, or if
+    // the queue is closed and empty.
+    bool pop(T& x, Deadline deadline=Deadline::max())
+    {
+        for (;;)
+        {
+            if (tryPop(x)) return true;
+            if (_closed.load(std::memory_order_acquire)) return false;
+            if (!waitPop(deadline)) return false;
+        }
+    }
+    
+    // Consumer: waits until there's an element, or the queue is closed. Returns false on
+    // timeout.
+    bool waitPop(Deadline deadline=Deadline::max())
+    {
+        return _park(_consumer, deadline, [&] {
+            return _closed.load(std::memory_order_acquire) ||
+                _tail.load(std::memory_order_acquire) != _head.load(std::memory_order_relaxed);
+        });
+    }
+    
+    // Fails subsequent pushes, and wakes every parked thread. Safe to call from any thread.
+    void close()
+    {
+        _closed.store(true, std::memory_order_release);
+        for (_Waiter* w : {&_producer, &_consumer})
+        {
+            w->seq.fetch_add(1, std::memory_order_release);
+            _FutexWake(w->seq);
+        }
+    }
+    
+    bool closed() const { return _closed.load(std::memory_order_acquire); }
+
+private:
+    struct alignas(64) _Waiter
+    {
+        std::atomic<uint32_t> seq = 0;      // Bumped to wake the parked threads
+        std::atomic<uint32_t> parked = 0;   // Number of parked threads
+    };
+    
+    template<typename Fn>
+    static bool _park(_Waiter& w, Deadline deadline, Fn ready)
+    {
+        // `ready` is checked after we snapshot `seq`, so a wake-up (including close()'s) that
+        // lands between the two either makes `ready` true, or changes `seq` and fails the wait
+        const uint32_t seq = w.seq.load(std::memory_order_acquire);
+        w.parked.fetch_add(1, std::memory_order_relaxed);
+        // Pairs with the fence in _wake(): either the other side sees that we're parked, or
+        // we see its update
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        bool ok = true;
+        if (!ready()) ok = _FutexWait(w.seq, seq, deadline);
+        w.parked.fetch_sub(1, std::memory_order_relaxed);
+        return ok;
+    }
+    
+    static void _wake(_Waiter& w)
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!w.parked.load(std::memory_order_relaxed)) return;
+        w.seq.fetch_add(1, std::memory_order_release);
+        _FutexWake(w.seq);
+    }
+    
+    // Returns false on timeout
+    static bool _FutexWait(std::atomic<uint32_t>& word, uint32_t val, Deadline deadline)
+    {
+        static_assert(sizeof(word) == sizeof(uint32_t));
+        // steady_clock is CLOCK_MONOTONIC, which is what FUTEX_WAIT_BITSET uses for its
+        // absolute timeout
+        timespec ts = {};
+        const timespec* timeout = nullptr;
+        if (deadline != Deadline::max())
+        {
+            const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch()).count();
+            ts = {.tv_sec = (time_t)(ns/1000000000), .tv_nsec = (long)(ns%1000000000)};
+            timeout = &ts;
+        }
+        
+        const long ir = syscall(SYS_futex, (uint32_t*)&word, FUTEX_WAIT_BITSET|FUTEX_PRIVATE_FLAG,
+            val, timeout, nullptr, FUTEX_BITSET_MATCH_ANY);
+        return !(ir<0 && errno==ETIMEDOUT);
+    }
+    
+    static void _FutexWake(std::atomic<uint32_t>& word)
+    {
+        syscall(SYS_futex, (uint32_t*)&word, FUTEX_WAKE|FUTEX_PRIVATE_FLAG, INT_MAX, nullptr, nullptr, 0);
+    }
+    
+    std::unique_ptr<T[]> _slots;
+    const size_t _cap = 0;
+    std::atomic<bool> _closed = false;
+    
+    // Consumer side
+    alignas(64) std::atomic<size_t> _head = 0;
+    size_t _tailCache = 0;
+    _Waiter _consumer;
+    
+    // Producer side
+    alignas(64) std::atomic<size_t> _tail = 0;
+    size_t _headCache = 0;
+    _Waiter _producer;
+};
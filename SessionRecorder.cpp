@@ -0,0 +1,131 @@
+#include "SessionRecorder.h"
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <ctime>
+#include <cassert>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "LIB/Toastbox/RuntimeError.h"
+#include "Log.h"
+
+SessionRecorder::SessionRecorder(const Info& info) : _info(info), _start(std::chrono::steady_clock::now())
+{
+    assert(_info.maxLen > sizeof(_FileHeader));
+    try
+    {
+        _fd = open(_info.path.c_str(), O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+        if (_fd < 0) throw RUNTIME_ERROR("open failed: %s", strerror(errno));
+        
+        // Extend the file up front, so that the whole mapping is backed by it. It stays sparse
+        // until it's written.
+        int ir = ftruncate(_fd, _info.maxLen);
+        if (ir) throw RUNTIME_ERROR("ftruncate failed: %s", strerror(errno));
+        
+        void* mem = mmap(nullptr, _info.maxLen, PROT_READ|PROT_WRITE, MAP_SHARED, _fd, 0);
+        if (mem == MAP_FAILED) throw RUNTIME_ERROR("mmap failed: %s", strerror(errno));
+        _mem = (uint8_t*)mem;
+        
+        timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        _FileHeader& hdr = *(_FileHeader*)_mem;
+        memcpy(hdr.magic, _Magic, sizeof(hdr.magic));
+        hdr.version = _Version;
+        hdr.recordHeaderLen = sizeof(_RecordHeader);
+        hdr.startTime = (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+        _off = sizeof(_FileHeader);
+    }
+    catch (...)
+    {
+        if (_mem) munmap(_mem, _info.maxLen);
+        if (_fd >= 0) close(_fd);
+        throw;
+    }
+}
+
+SessionRecorder::~SessionRecorder()
+{
+    munmap(_mem, _info.maxLen);
+    // Drop the unused tail of the file. `_off` may have been advanced past the end by a
+    // record that didn't fit.
+    const size_t len = std::min(_off.load(), _info.maxLen);
+    if (ftruncate(_fd, len))
+        LOG_ERROR("SessionRecorder: ftruncate failed: %s", strerror(errno));
+    close(_fd);
+}
+
+void SessionRecorder::record(const USBIP::HEADER& header, const uint8_t* payload, size_t payloadLen,
+    const uint8_t* iso, size_t isoLen)
+{
+    const size_t len = (sizeof(_RecordHeader)+payloadLen+isoLen+_Align-1) & ~(_Align-1);
+    const size_t off = _off.fetch_add(len, std::memory_order_relaxed);
+    if (off+len > _info.maxLen)
+    {
+        _dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    
+    _RecordHeader& rec = *(_RecordHeader*)(_mem+off);
+    rec.payloadLen = (uint32_t)(payloadLen+isoLen);
+    rec.time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-_start).count();
+    rec.header = header;
+    if (payloadLen) memcpy(_mem+off+sizeof(_RecordHeader), payload, payloadLen);
+    if (isoLen) memcpy(_mem+off+sizeof(_RecordHeader)+payloadLen, iso, isoLen);
+    // Publish the record
+    rec.len.store((uint32_t)len, std::memory_order_release);
+}
+
+SessionRecorder::Capture SessionRecorder::Load(const char* path)
+{
+    const int fd = open(path, O_RDONLY|O_CLOEXEC);
+    if (fd < 0) throw RUNTIME_ERROR("open failed: %s", strerror(errno));
+    
+    struct stat st;
+    int ir = fstat(fd, &st);
+    if (ir)
+    {
+        close(fd);
+        throw RUNTIME_ERROR("fstat failed: %s", strerror(errno));
+    }
+    
+    const size_t len = st.st_size;
+    if (len < sizeof(_FileHeader))
+    {
+        close(fd);
+        throw RUNTIME_ERROR("invalid capture file: too short");
+    }
+    
+    void* mem = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) throw RUNTIME_ERROR("mmap failed: %s", strerror(errno));
+    
+    Capture cap = {
+        .mem = std::shared_ptr<const uint8_t>((const uint8_t*)mem, [=] (const uint8_t* p) { munmap((void*)p, len); }),
+    };
+    
+    const _FileHeader& hdr = *(const _FileHeader*)cap.mem.get();
+    if (memcmp(hdr.magic, _Magic, sizeof(hdr.magic)))
+        throw RUNTIME_ERROR("invalid capture file: bad magic");
+    if (hdr.version!=_Version || hdr.recordHeaderLen!=sizeof(_RecordHeader))
+        throw RUNTIME_ERROR("unsupported capture file version: %u", hdr.version);
+    
+    for (size_t off=sizeof(_FileHeader); off+sizeof(_RecordHeader)<=len;)
+    {
+        const _RecordHeader& rec = *(const _RecordHeader*)(cap.mem.get()+off);
+        const size_t recLen = rec.len.load(std::memory_order_acquire);
+        // The recording ends at the first incomplete record
+        if (!recLen || off+recLen>len || sizeof(_RecordHeader)+rec.payloadLen>recLen) break;
+        
+        cap.records.push_back({
+            .time       = rec.time,
+            .header     = rec.header,
+            .payload    = cap.mem.get()+off+sizeof(_RecordHeader),
+            .payloadLen = rec.payloadLen,
+        });
+        off += recLen;
+    }
+    return cap;
+}
@@ -0,0 +1,100 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include "USBIP.h"
+
+// SessionRecorder: records a VirtualUSBDevice's usbip session (every command that it receives
+// and every reply that it sends, with their complete payloads) to a capture file, which
+// SessionReplayer can play back. Set VirtualUSBDevice::Info::recorder to record a device.
+//
+// The capture file is memory-mapped and append-only. record() reserves space with a single
+// atomic increment and copies the record straight into the mapping, so recording doesn't
+// take locks or make syscalls. Each record's length is stored last, so a reader (or a capture
+// that was cut short by a crash) ends cleanly at the first incomplete record.
+//
+// Headers are stored in host endian, so captures aren't portable between hosts of different
+// endianness.
+class SessionRecorder
+{
+public:
+    struct Info
+    {
+        std::string path;
+        // Max size of the capture file. The file is sparse until it's closed, so only the
+        // recorded bytes take up disk space. Records that don't fit are dropped.
+        size_t maxLen = 0x40000000;
+    };
+    
+    struct Record
+    {
+        uint64_t time = 0; // Nanoseconds since the recording started
+        USBIP::HEADER header = {}; // Host endian
+        // Everything that follows the header on the wire: the data, then any isochronous
+        // packet descriptors (big endian)
+        const uint8_t* payload = nullptr;
+        size_t payloadLen = 0;
+    };
+    
+    // A capture file that's been loaded by Load(). The records reference the file's mapping,
+    // which stays alive as long as the Capture (or a copy of it) does.
+    struct Capture
+    {
+        std::shared_ptr<const uint8_t> mem;
+        std::vector<Record> records;
+    };
+    
+    SessionRecorder(const Info& info);
+    
+    // Truncates the capture file to the recorded length
+    ~SessionRecorder();
+    
+    SessionRecorder(const SessionRecorder& x) = delete;
+    SessionRecorder& operator=(const SessionRecorder& x) = delete;
+    
+    // Records `header`, followed by `payload` and the isochronous packet descriptors `iso`.
+    // Thread-safe.
+    void record(const USBIP::HEADER& header, const uint8_t* payload, size_t payloadLen,
+        const uint8_t* iso=nullptr, size_t isoLen=0);
+    
+    // The number of records that were dropped because the capture file was full
+    uint64_t dropped() const { return _dropped.load(std::memory_order_relaxed); }
+    
+    static Capture Load(const char* path);
+
+private:
+    static constexpr char _Magic[8] = {'V','U','S','B','S','E','S','S'};
+    static constexpr uint32_t _Version = 1;
+    
+    struct _FileHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t recordHeaderLen;
+        uint64_t startTime; // Nanoseconds since the epoch
+    };
+    
+    struct _RecordHeader
+    {
+        // Length of the record, including the header and padding. Written last; 0 until the
+        // record is complete.
+        std::atomic<uint32_t> len;
+        uint32_t payloadLen;
+        uint64_t time;
+        USBIP::HEADER header;
+    };
+    
+    // Records are padded so that every record header is aligned
+    static constexpr size_t _Align = alignof(_RecordHeader);
+    
+    const Info _info = {};
+    const std::chrono::steady_clock::time_point _start;
+    int _fd = -1;
+    uint8_t* _mem = nullptr;
+    std::atomic<size_t> _off = 0; // Offset of the next record
+    std::atomic<uint64_t> _dropped = 0;
+};
@@ -0,0 +1,321 @@
+#include "SessionReplayer.h"
+#include <cerrno>
+#include <cstring>
+#include <cstdarg>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "LIB/Toastbox/RuntimeError.h"
+
+#define Endian          Toastbox::Endian
+
+static const std::exception_ptr _ErrStopped = std::make_exception_ptr(std::runtime_error("SessionReplayer stopped"));
+
+static void _Recv(int socket, void* data, size_t len)
+{
+    size_t off = 0;
+    while (off < len)
+    {
+        const ssize_t sr = recv(socket, (uint8_t*)data+off, len-off, 0);
+        if (sr == 0) throw RUNTIME_ERROR("device disconnected");
+        if (sr < 0)
+        {
+            if (errno == EINTR) continue;
+            throw RUNTIME_ERROR("recv failed: %s", strerror(errno));
+        }
+        off += sr;
+    }
+}
+
+// Returns the wire (big endian) form of command header `h`
+static USBIP::HEADER _BFHCmdHeader(const USBIP::HEADER& h)
+{
+    using namespace Endian;
+    USBIP::HEADER r = {};
+    r.base = {
+        .command    = BFH_U32(h.base.command),
+        .seqnum     = BFH_U32(h.base.seqnum),
+        .devid      = BFH_U32(h.base.devid),
+        .direction  = BFH_U32(h.base.direction),
+        .ep         = BFH_U32(h.base.ep),
+    };
+    
+    switch (h.base.command)
+    {
+        case USBIPLib::USBIP_CMD_SUBMIT:
+            r.cmd_submit = {
+                .transfer_flags             = BFH_U32(h.cmd_submit.transfer_flags),
+                .transfer_buffer_length     = BFH_S32(h.cmd_submit.transfer_buffer_length),
+                .start_frame                = BFH_S32(h.cmd_submit.start_frame),
+                .number_of_packets          = BFH_S32(h.cmd_submit.number_of_packets),
+                .interval                   = BFH_S32(h.cmd_submit.interval),
+                .setup                      = {.u64 = h.cmd_submit.setup.u64 }, // stream of bytes -- don't change
+            };
+            break;
+        
+        case USBIPLib::USBIP_CMD_UNLINK:
+            r.cmd_unlink.seqnum = BFH_U32(h.cmd_unlink.seqnum);
+            break;
+        
+        default:
+            throw RUNTIME_ERROR("invalid command: %u", h.base.command);
+    }
+    return r;
+}
+
+static void _Mismatch(SessionReplayer::Result& r, size_t max, const char* fmt, ...)
+{
+    r.mismatchCount++;
+    if (r.mismatches.size() >= max) return;
+    
+    va_list args;
+    va_start(args, fmt);
+    char msg[256];
+    vsnprintf(msg, sizeof(msg), fmt, args);
+    va_end(args);
+    r.mismatches.emplace_back(msg);
+}
+
+SessionReplayer::SessionReplayer(const Info& info) : _info(info)
+{
+    assert(_info.device);
+    assert(_info.speed >= 0);
+}
+
+SessionReplayer::~SessionReplayer()
+{
+    _stop();
+}
+
+SessionReplayer::Result SessionReplayer::run(const SessionRecorder::Capture& capture)
+{
+    using namespace std::chrono;
+    assert(_socket < 0);
+    int sockets[2] = {-1,-1};
+    const int ir = socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, sockets);
+    if (ir) throw RUNTIME_ERROR("socketpair failed: %s", strerror(errno));
+    _socket = sockets[0];
+    
+    // The device owns its end of the socketpair from here on
+    _info.device->start(sockets[1]);
+    _thread = std::thread([this] { _readThread(); });
+    
+    Result r;
+    const steady_clock::time_point start = steady_clock::now();
+    try
+    {
+        for (const SessionRecorder::Record& rec : capture.records)
+        {
+            const USBIP::HEADER& h = rec.header;
+            switch (h.base.command)
+            {
+                case USBIPLib::USBIP_CMD_SUBMIT:
+                case USBIPLib::USBIP_CMD_UNLINK:
+                {
+                    if (_info.speed)
+                        std::this_thread::sleep_until(start + nanoseconds((int64_t)(rec.time/_info.speed)));
+                    
+                    {
+                        auto lock = std::unique_lock(_lock);
+                        _sent[h.base.seqnum] = (h.base.command==USBIPLib::USBIP_CMD_SUBMIT &&
+                            h.base.direction==USBIPLib::USBIP_DIR_IN);
+                    }
+                    _send(_BFHCmdHeader(h), rec.payload, rec.payloadLen);
+                    r.cmds++;
+                    break;
+                }
+                
+                case USBIPLib::USBIP_RET_SUBMIT:
+                case USBIPLib::USBIP_RET_UNLINK:
+                    _Compare(r, _info.mismatchesMax, rec, _waitRep(h.base.seqnum));
+                    r.reps++;
+                    break;
+                
+                default:
+                    throw RUNTIME_ERROR("invalid record command: %u", h.base.command);
+            }
+        }
+    }
+    catch (...)
+    {
+        _stop();
+        throw;
+    }
+    
+    r.duration = steady_clock::now()-start;
+    _stop();
+    return r;
+}
+
+void SessionReplayer::_send(const USBIP::HEADER& header, const uint8_t* payload, size_t payloadLen)
+{
+    iovec iov[] = {
+        {.iov_base = (void*)&header,    .iov_len = sizeof(header)},
+        {.iov_base = (void*)payload,    .iov_len = payloadLen},
+    };
+    msghdr msg = {
+        .msg_iov    = iov,
+        .msg_iovlen = (size_t)(payloadLen ? 2 : 1),
+    };
+    
+    for (;;)
+    {
+        const ssize_t sr = sendmsg(_socket, &msg, MSG_NOSIGNAL);
+        if (sr < 0)
+        {
+            if (errno == EINTR) continue;
+            throw RUNTIME_ERROR("sendmsg failed: %s", strerror(errno));
+        }
+        
+        // Skip the iovecs that were sent completely, and the sent part of the next one
+        size_t len = sr;
+        while (msg.msg_iovlen && len>=msg.msg_iov->iov_len)
+        {
+            len -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (!msg.msg_iovlen) return;
+        msg.msg_iov->iov_base = (uint8_t*)msg.msg_iov->iov_base + len;
+        msg.msg_iov->iov_len -= len;
+    }
+}
+
+void SessionReplayer::_readThread()
+{
+    using namespace Endian;
+    try
+    {
+        for (;;)
+        {
+            USBIP::HEADER header;
+            _Recv(_socket, &header, sizeof(header));
+            
+            _Rep rep;
+            USBIP::HEADER& h = rep.header;
+            h.base = {
+                .command    = HFB_U32(header.base.command),
+                .seqnum     = HFB_U32(header.base.seqnum),
+                .devid      = HFB_U32(header.base.devid),
+                .direction  = HFB_U32(header.base.direction),
+                .ep         = HFB_U32(header.base.ep),
+            };
+            
+            bool in = false;
+            {
+                auto lock = std::unique_lock(_lock);
+                auto it = _sent.find(h.base.seqnum);
+                if (it == _sent.end())
+                    throw RUNTIME_ERROR("reply for unknown seqnum: %u", h.base.seqnum);
+                in = it->second;
+                _sent.erase(it);
+            }
+            
+            switch (h.base.command)
+            {
+                case USBIPLib::USBIP_RET_SUBMIT:
+                {
+                    h.ret_submit = {
+                        .status             = HFB_S32(header.ret_submit.status),
+                        .actual_length      = HFB_S32(header.ret_submit.actual_length),
+                        .start_frame        = HFB_S32(header.ret_submit.start_frame),
+                        .number_of_packets  = HFB_S32(header.ret_submit.number_of_packets),
+                        .error_count        = HFB_S32(header.ret_submit.error_count),
+                    };
+                    if (h.ret_submit.actual_length < 0)
+                        throw RUNTIME_ERROR("invalid actual_length: %d", h.ret_submit.actual_length);
+                    
+                    if (h.ret_submit.number_of_packets<0 || h.ret_submit.number_of_packets>_IsoPacketsMax)
+                        throw RUNTIME_ERROR("invalid number_of_packets: %d", h.ret_submit.number_of_packets);
+                    
+                    // Only IN replies carry data, but either direction can carry isochronous
+                    // packet descriptors, which are compared along with the data
+                    const size_t dataLen = (in ? h.ret_submit.actual_length : 0);
+                    rep.payload.resize(dataLen + h.ret_submit.number_of_packets*sizeof(USBIP::ISO_PACKET_DESCRIPTOR));
+                    if (!rep.payload.empty())
+                        _Recv(_socket, rep.payload.data(), rep.payload.size());
+                    break;
+                }
+                
+                case USBIPLib::USBIP_RET_UNLINK:
+                    h.ret_unlink.status = HFB_S32(header.ret_unlink.status);
+                    break;
+                
+                default:
+                    throw RUNTIME_ERROR("invalid usbip command: %u", h.base.command);
+            }
+            
+            auto lock = std::unique_lock(_lock);
+            _reps[h.base.seqnum] = std::move(rep);
+            _signal.notify_all();
+        }
+    }
+    catch (const std::exception& e)
+    {
+        auto lock = std::unique_lock(_lock);
+        if (!_err) _err = std::current_exception();
+        _signal.notify_all();
+    }
+}
+
+SessionReplayer::_Rep SessionReplayer::_waitRep(uint32_t seqnum)
+{
+    auto lock = std::unique_lock(_lock);
+    const auto deadline = std::chrono::steady_clock::now() + _info.timeout;
+    for (;;)
+    {
+        auto it = _reps.find(seqnum);
+        if (it != _reps.end())
+        {
+            _Rep rep = std::move(it->second);
+            _reps.erase(it);
+            return rep;
+        }
+        if (_err) std::rethrow_exception(_err);
+        if (_signal.wait_until(lock, deadline) == std::cv_status::timeout)
+            throw RUNTIME_ERROR("timed out waiting for the reply to seqnum %u", seqnum);
+    }
+}
+
+void SessionReplayer::_stop()
+{
+    if (_socket < 0) return;
+    {
+        auto lock = std::unique_lock(_lock);
+        if (!_err) _err = _ErrStopped;
+    }
+    shutdown(_socket, SHUT_RDWR);
+    if (_thread.joinable()) _thread.join();
+    close(_socket);
+    _socket = -1;
+}
+
+void SessionReplayer::_Compare(Result& r, size_t max, const SessionRecorder::Record& rec, const _Rep& rep)
+{
+    const USBIP::HEADER& want = rec.header;
+    const USBIP::HEADER& got = rep.header;
+    const uint32_t seqnum = want.base.seqnum;
+    if (got.base.command != want.base.command)
+    {
+        _Mismatch(r, max, "seqnum %u: command %u, expected %u", seqnum, got.base.command, want.base.command);
+        return;
+    }
+    
+    if (want.base.command == USBIPLib::USBIP_RET_UNLINK)
+    {
+        if (got.ret_unlink.status != want.ret_unlink.status)
+            _Mismatch(r, max, "seqnum %u: unlink status %d, expected %d", seqnum, got.ret_unlink.status, want.ret_unlink.status);
+        return;
+    }
+    
+    if (got.ret_submit.status != want.ret_submit.status)
+        _Mismatch(r, max, "seqnum %u: status %d, expected %d", seqnum, got.ret_submit.status, want.ret_submit.status);
+    else if (got.ret_submit.actual_length != want.ret_submit.actual_length)
+        _Mismatch(r, max, "seqnum %u: actual_length %d, expected %d", seqnum, got.ret_submit.actual_length, want.ret_submit.actual_length);
+    else if (rep.payload.size()!=rec.payloadLen || (rec.payloadLen && memcmp(rep.payload.data(), rec.payload, rec.payloadLen)))
+    {
+        size_t i = 0;
+        while (i<rec.payloadLen && i<rep.payload.size() && rep.payload[i]==rec.payload[i]) i++;
+        _Mismatch(r, max, "seqnum %u: data differs at byte %zu", seqnum, i);
+    }
+}
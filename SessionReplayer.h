@@ -0,0 +1,88 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "VirtualUSBDevice.h"
+#include "SessionRecorder.h"
+
+// SessionReplayer: plays a host session that was recorded by SessionRecorder back into a
+// VirtualUSBDevice, and verifies that the device replies as it did when it was recorded. Like
+// VirtualUSBHost, it stands in for the host over a socketpair.
+//
+// Commands are sent in the order they were recorded. Before sending a command, the replayer
+// waits for the replies that were recorded before it, so the device sees the same interleaving
+// of commands and replies that it saw originally. Beyond that, commands are sent as fast as
+// possible, or at the recording's timing (Info::speed).
+//
+// As with VirtualUSBHost, the device's app has to run its usual read() loop.
+class SessionReplayer
+{
+public:
+    struct Info
+    {
+        VirtualUSBDevice* device = nullptr; // Not started; run() starts it
+        // 0: send commands as fast as possible. Otherwise, send each command no earlier than
+        // it was recorded, with the recording sped up by this factor (1: the original timing).
+        double speed = 0;
+        // Fail if a recorded reply doesn't arrive within this time
+        std::chrono::milliseconds timeout = std::chrono::seconds(5);
+        // Max number of mismatches described in Result::mismatches
+        size_t mismatchesMax = 16;
+    };
+    
+    struct Result
+    {
+        size_t cmds = 0; // The number of commands sent
+        size_t reps = 0; // The number of replies verified
+        size_t mismatchCount = 0; // The number of replies that differ from the recording
+        std::vector<std::string> mismatches; // Descriptions of the first mismatches
+        std::chrono::nanoseconds duration = {};
+    };
+    
+    SessionReplayer(const Info& info);
+    
+    ~SessionReplayer();
+    
+    // Connects to the device, starts it, and replays `capture` into it. Returns once every
+    // recorded reply has been received, and disconnects from the device (which resets it).
+    // Throws if the device disconnects, or a reply doesn't arrive in time. A device can only
+    // be replayed into once.
+    Result run(const SessionRecorder::Capture& capture);
+
+private:
+    using _Err = std::exception_ptr;
+    
+    static constexpr int32_t _IsoPacketsMax = 1024;
+    
+    struct _Rep
+    {
+        USBIP::HEADER header = {}; // Host endian
+        std::vector<uint8_t> payload;
+    };
+    
+    void _send(const USBIP::HEADER& header, const uint8_t* payload, size_t payloadLen);
+    
+    void _readThread();
+    
+    _Rep _waitRep(uint32_t seqnum);
+    
+    void _stop();
+    
+    static void _Compare(Result& r, size_t max, const SessionRecorder::Record& rec, const _Rep& rep);
+    
+    const Info _info = {};
+    int _socket = -1;
+    std::thread _thread;
+    
+    std::mutex _lock; // Protects the fields below
+    std::condition_variable _signal; // Signalled when a reply arrives, or the read thread fails
+    _Err _err;
+    std::unordered_map<uint32_t,bool> _sent; // Commands awaiting replies: seqnum -> whether it's an IN URB
+    std::unordered_map<uint32_t,_Rep> _reps; // Replies received, by seqnum
+};
@@ -0,0 +1,141 @@
+#include "TimerWheel.h"
+#include <cassert>
+#include <algorithm>
+
+TimerWheel::TimerWheel() : _epoch(Clock::now())
+{
+    _thread = std::thread([this] { _run(); });
+}
+
+TimerWheel::~TimerWheel()
+{
+    {
+        auto lock = std::unique_lock(_lock);
+        _stop = true;
+        _signal.notify_all();
+    }
+    _thread.join();
+    for ([[maybe_unused]] Timer* t : _slots) assert(!t);
+}
+
+void TimerWheel::schedule(Timer& timer, Clock::time_point deadline)
+{
+    auto lock = std::unique_lock(_lock);
+    if (timer._removed) return;
+    // Ticks that have been processed already are in the past, so use the next one
+    const uint64_t tick = std::max(_tickAt(deadline), _tick+1);
+    if (timer._armed)
+    {
+        if (timer._tick <= tick) return;
+        _unlink(timer);
+    }
+    _link(timer, tick);
+    
+    // Wake the thread if it's sleeping past the timer
+    if (tick < _wakeTick) _signal.notify_one();
+}
+
+void TimerWheel::remove(Timer& timer)
+{
+    auto lock = std::unique_lock(_lock);
+    timer._removed = true;
+    if (timer._armed) _unlink(timer);
+    // Timer functions run on our thread, so if that's who's calling, we'd wait on ourself
+    if (onThread()) return;
+    while (_running == &timer) _ran.wait(lock);
+}
+
+// Returns the first tick that starts at or after `t`
+uint64_t TimerWheel::_tickAt(Clock::time_point t) const
+{
+    if (t <= _epoch) return 0;
+    return (t-_epoch+Tick-std::chrono::nanoseconds(1)) / Tick;
+}
+
+TimerWheel::Clock::time_point TimerWheel::_timeAt(uint64_t tick) const
+{
+    return _epoch + tick*Tick;
+}
+
+// _lock must be held
+void TimerWheel::_link(Timer& timer, uint64_t tick)
+{
+    const size_t slot = tick & (_SlotCount-1);
+    timer._tick = tick;
+    timer._armed = true;
+    timer._prev = nullptr;
+    timer._next = _slots[slot];
+    if (timer._next) timer._next->_prev = &timer;
+    _slots[slot] = &timer;
+    _occupied[slot/64] |= (uint64_t)1 << (slot%64);
+}
+
+// _lock must be held
+void TimerWheel::_unlink(Timer& timer)
+{
+    const size_t slot = timer._tick & (_SlotCount-1);
+    if (timer._prev) timer._prev->_next = timer._next;
+    else             _slots[slot] = timer._next;
+    if (timer._next) timer._next->_prev = timer._prev;
+    if (!_slots[slot]) _occupied[slot/64] &= ~((uint64_t)1 << (slot%64));
+    timer._prev = nullptr;
+    timer._next = nullptr;
+    timer._armed = false;
+}
+
+// Returns the next tick whose slot has timers (which may be due in a later revolution of the
+// wheel), or UINT64_MAX if there aren't any. _lock must be held.
+uint64_t TimerWheel::_nextTick() const
+{
+    for (size_t i=0; i<_SlotCount;)
+    {
+        const size_t slot = (_tick+1+i) & (_SlotCount-1);
+        const uint64_t bits = _occupied[slot/64] >> (slot%64);
+        if (bits) return _tick+1+i+__builtin_ctzll(bits);
+        i += 64 - (slot%64);
+    }
+    return UINT64_MAX;
+}
+
+void TimerWheel::_run()
+{
+    auto lock = std::unique_lock(_lock);
+    while (!_stop)
+    {
+        // Process the ticks that have started since we last looked. If we're more than a
+        // revolution behind, visiting every slot once is enough.
+        const uint64_t now = (Clock::now()-_epoch) / Tick;
+        if (now-_tick > _SlotCount) _tick = now-_SlotCount;
+        while (_tick < now)
+        {
+            _tick++;
+            const size_t slot = _tick & (_SlotCount-1);
+            for (Timer* t=_slots[slot]; t;)
+            {
+                // Skip the timers that are due in a later revolution
+                if (t->_tick > _tick)
+                {
+                    t = t->_next;
+                    continue;
+                }
+                
+                // Call the function without the lock, so that it can schedule timers. The
+                // slot may change meanwhile, so start over once it returns.
+                Timer& timer = *t;
+                _unlink(timer);
+                _running = &timer;
+                lock.unlock();
+                timer._fn();
+                lock.lock();
+                _running = nullptr;
+                _ran.notify_all();
+                t = _slots[slot];
+            }
+        }
+        
+        _wakeTick = _nextTick();
+        if (_wakeTick == UINT64_MAX) _signal.wait(lock);
+        else _signal.wait_until(lock, _timeAt(_wakeTick));
+        _wakeTick = 0;
+    }
+}
@@ -0,0 +1,93 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+
+// TimerWheel: runs many timers (eg the polling of every interrupt endpoint of every device) on
+// a single thread, using a hashed timing wheel. Deadlines are rounded up to a tick of 125us
+// (a USB microframe), so timers that are due in the same tick fire in a single wake-up, and
+// arming or disarming a timer is O(1). The thread sleeps until the next tick that has timers.
+class TimerWheel
+{
+public:
+    using Clock = std::chrono::steady_clock;
+    static constexpr std::chrono::nanoseconds Tick = std::chrono::microseconds(125);
+    
+    // A timer's function is called on the wheel's thread, so it should be quick (it holds up
+    // the wheel's other timers), and mustn't throw. A timer must be removed before it's
+    // destroyed.
+    class Timer
+    {
+    public:
+        Timer(std::function<void()> fn) : _fn(std::move(fn)) {}
+        
+        Timer(const Timer& x) = delete;
+        Timer& operator=(const Timer& x) = delete;
+    
+    private:
+        const std::function<void()> _fn;
+        
+        // Protected by TimerWheel::_lock
+        Timer* _prev = nullptr;
+        Timer* _next = nullptr;
+        uint64_t _tick = 0;
+        bool _armed = false;
+        bool _removed = false;
+        
+        friend class TimerWheel;
+    };
+    
+    TimerWheel();
+    
+    // Every timer must have been removed
+    ~TimerWheel();
+    
+    TimerWheel(const TimerWheel& x) = delete;
+    TimerWheel& operator=(const TimerWheel& x) = delete;
+    
+    // Arms `timer` to fire at `deadline`. If it's already armed, it fires at the earlier of
+    // the two deadlines. Can be called from any thread, including from timer functions.
+    void schedule(Timer& timer, Clock::time_point deadline);
+    
+    // Disarms `timer` for good: schedule() ignores it from then on, and once remove() returns,
+    // its function isn't running -- unless remove() is called from a timer function, in which
+    // case that function may still be running.
+    void remove(Timer& timer);
+    
+    // Whether the caller is the wheel's thread, ie a timer function
+    bool onThread() const { return std::this_thread::get_id() == _thread.get_id(); }
+    
+    // Ticks count from here, so deadlines that are a whole number of ticks after it don't
+    // get rounded
+    Clock::time_point epoch() const { return _epoch; }
+
+private:
+    static constexpr size_t _SlotCount = 4096; // Must be a power of 2, and a multiple of 64
+    
+    uint64_t _tickAt(Clock::time_point t) const;
+    Clock::time_point _timeAt(uint64_t tick) const;
+    void _link(Timer& timer, uint64_t tick);
+    void _unlink(Timer& timer);
+    uint64_t _nextTick() const;
+    void _run();
+    
+    const Clock::time_point _epoch;
+    
+    std::mutex _lock; // Protects the fields below
+    std::condition_variable _signal; // Wakes the thread
+    std::condition_variable _ran; // Signalled when a timer function returns
+    Timer* _slots[_SlotCount] = {}; // Lists of armed timers, by tick
+    uint64_t _occupied[_SlotCount/64] = {}; // Bitmap of the slots that have timers
+    uint64_t _tick = 0; // The last tick that's been processed
+    // The tick that the thread is sleeping until (0 while it's awake, UINT64_MAX if there
+    // aren't any timers), so that schedule() only wakes it if the new timer is due sooner
+    uint64_t _wakeTick = 0;
+    const Timer* _running = nullptr;
+    bool _stop = false;
+    
+    std::thread _thread;
+};
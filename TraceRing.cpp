@@ -0,0 +1,220 @@
+#include "TraceRing.h"
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <ctime>
+#include <cassert>
+#include <unordered_map>
+#include "USBIPLib.h"
+#include "LIB/Toastbox/RuntimeError.h"
+
+// pcap file header (microsecond timestamps)
+struct _PcapHeader
+{
+    uint32_t magic = 0xa1b2c3d4;
+    uint16_t versionMajor = 2;
+    uint16_t versionMinor = 4;
+    int32_t thiszone = 0;
+    uint32_t sigfigs = 0;
+    uint32_t snaplen = 0x40000;
+    uint32_t linktype = 220; // LINKTYPE_USB_LINUX_MMAPPED
+};
+
+struct _PcapRecordHeader
+{
+    uint32_t tsSec = 0;
+    uint32_t tsUsec = 0;
+    uint32_t inclLen = 0;
+    uint32_t origLen = 0;
+};
+
+// The usbmon packet header (struct usbmon_packet in the kernel's
+// Documentation/usb/usbmon.rst), in host byte order
+struct _UsbmonHeader
+{
+    uint64_t id;
+    uint8_t type; // 'S': submission, 'C': completion
+    uint8_t xferType; // 0: isochronous, 1: interrupt, 2: control, 3: bulk
+    uint8_t epnum; // Including the direction bit
+    uint8_t devnum;
+    uint16_t busnum;
+    char flagSetup; // 0: `setup` is valid
+    char flagData; // 0: data follows the header
+    int64_t tsSec;
+    int32_t tsUsec;
+    int32_t status;
+    uint32_t length; // The URB's length
+    uint32_t lenCap; // The number of data bytes that follow the header
+    uint8_t setup[8];
+    int32_t interval;
+    int32_t startFrame;
+    uint32_t xferFlags;
+    uint32_t ndesc;
+} __attribute__((packed));
+static_assert(sizeof(_UsbmonHeader) == 64);
+
+static uint64_t _TimeNs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static uint8_t _UsbmonXferType(uint8_t xferType)
+{
+    // USB's order (control, isochronous, bulk, interrupt) -> usbmon's order
+    constexpr uint8_t Types[] = { 2, 0, 3, 1 };
+    return Types[xferType & 3];
+}
+
+TraceRing::TraceRing(size_t cap, size_t snapLen) :
+_cap(cap), _snapLen(snapLen),
+// Round slots up to a cache line, so that concurrent writers don't share one
+_slotLen((sizeof(_Slot)+snapLen+63) & ~(size_t)63),
+_mem(std::make_unique<uint8_t[]>(_cap*_slotLen))
+{
+    assert(cap && !(cap & (cap-1)));
+    for (size_t i=0; i<_cap; i++)
+        new (&_slot(i)) _Slot();
+}
+
+TraceRing::~TraceRing()
+{
+    for (size_t i=0; i<_cap; i++)
+        _slot(i).~_Slot();
+}
+
+void TraceRing::record(const USBIP::HEADER& header, uint8_t xferType, const uint8_t* payload, size_t payloadLen)
+{
+    const uint64_t idx = _head.fetch_add(1, std::memory_order_relaxed);
+    _Slot& slot = _slot(idx);
+    // Mark the slot as being written before touching it, so that readers discard it
+    slot.seq.store(2*idx+1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    
+    const size_t capLen = std::min(payloadLen, _snapLen);
+    slot.rec = {
+        .time       = _TimeNs(),
+        .header     = header,
+        .payloadLen = (uint32_t)payloadLen,
+        .capLen     = (uint32_t)capLen,
+        .xferType   = xferType,
+    };
+    if (capLen) memcpy((uint8_t*)&slot + sizeof(_Slot), payload, capLen);
+    
+    slot.seq.store(2*idx+2, std::memory_order_release);
+}
+
+std::vector<TraceRing::Entry> TraceRing::snapshot() const
+{
+    const uint64_t head = _head.load(std::memory_order_acquire);
+    const uint64_t begin = (head>_cap ? head-_cap : 0);
+    std::vector<Entry> entries;
+    entries.reserve(head-begin);
+    for (uint64_t idx=begin; idx<head; idx++)
+    {
+        const _Slot& slot = _slot(idx);
+        // Skip the record if it's being written, or if it's been overwritten by a newer one
+        if (slot.seq.load(std::memory_order_acquire) != 2*idx+2) continue;
+        Entry e = {.rec = slot.rec};
+        const size_t capLen = std::min((size_t)e.rec.capLen, _snapLen);
+        const uint8_t* payload = (const uint8_t*)&slot + sizeof(_Slot);
+        e.payload.assign(payload, payload+capLen);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq.load(std::memory_order_relaxed) != 2*idx+2) continue;
+        entries.push_back(std::move(e));
+    }
+    return entries;
+}
+
+void TraceRing::writePcap(const char* path) const
+{
+    WritePcap(path, snapshot());
+}
+
+void TraceRing::WritePcap(const char* path, const std::vector<Entry>& entries)
+{
+    FILE* f = fopen(path, "wb");
+    if (!f) throw RUNTIME_ERROR("fopen failed: %s", strerror(errno));
+    
+    const _PcapHeader hdr;
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+    
+    // CMD_UNLINK seqnum -> the seqnum of the URB that it unlinks
+    std::unordered_map<uint32_t,uint32_t> unlinks;
+    for (const Entry& e : entries)
+    {
+        const USBIP::HEADER& h = e.rec.header;
+        const bool dirIn = h.base.direction == USBIPLib::USBIP_DIR_IN;
+        _UsbmonHeader mon = {
+            .id         = h.base.seqnum,
+            .xferType   = _UsbmonXferType(e.rec.xferType),
+            .epnum      = (uint8_t)((h.base.ep & 0x7F) | (dirIn ? 0x80 : 0)),
+            .devnum     = (uint8_t)(h.base.devid & 0xFFFF),
+            .busnum     = (uint16_t)(h.base.devid >> 16),
+            .flagSetup  = '-',
+            .tsSec      = (int64_t)(e.rec.time / 1000000000),
+            .tsUsec     = (int32_t)((e.rec.time % 1000000000) / 1000),
+            .lenCap     = (uint32_t)e.payload.size(),
+        };
+        
+        switch (h.base.command)
+        {
+            case USBIPLib::USBIP_CMD_SUBMIT:
+                mon.type = 'S';
+                mon.status = -EINPROGRESS;
+                mon.length = h.cmd_submit.transfer_buffer_length;
+                mon.interval = h.cmd_submit.interval;
+                mon.startFrame = h.cmd_submit.start_frame;
+                mon.xferFlags = h.cmd_submit.transfer_flags;
+                if (!h.base.ep)
+                {
+                    mon.flagSetup = 0;
+                    memcpy(mon.setup, h.cmd_submit.setup.u8, sizeof(mon.setup));
+                }
+                break;
+            
+            case USBIPLib::USBIP_RET_SUBMIT:
+                mon.type = 'C';
+                mon.status = h.ret_submit.status;
+                mon.length = h.ret_submit.actual_length;
+                mon.startFrame = h.ret_submit.start_frame;
+                break;
+            
+            case USBIPLib::USBIP_CMD_UNLINK:
+                unlinks[h.base.seqnum] = h.cmd_unlink.seqnum;
+                continue;
+            
+            case USBIPLib::USBIP_RET_UNLINK:
+            {
+                // A successful unlink completes the URB that it unlinked
+                auto it = unlinks.find(h.base.seqnum);
+                if (it==unlinks.end() || h.ret_unlink.status!=-ECONNRESET) continue;
+                mon.type = 'C';
+                mon.id = it->second;
+                mon.status = -ECONNRESET;
+                unlinks.erase(it);
+                break;
+            }
+            
+            default:
+                continue;
+        }
+        
+        // usbmon marks a missing data stage with '<' (IN) or '>' (OUT)
+        mon.flagData = (mon.lenCap ? 0 : (dirIn ? '<' : '>'));
+        
+        const _PcapRecordHeader rec = {
+            .tsSec      = (uint32_t)mon.tsSec,
+            .tsUsec     = (uint32_t)mon.tsUsec,
+            .inclLen    = (uint32_t)(sizeof(mon) + mon.lenCap),
+            .origLen    = (uint32_t)(sizeof(mon) + mon.lenCap),
+        };
+        ok &= fwrite(&rec, sizeof(rec), 1, f) == 1;
+        ok &= fwrite(&mon, sizeof(mon), 1, f) == 1;
+        if (mon.lenCap) ok &= fwrite(e.payload.data(), mon.lenCap, 1, f) == 1;
+    }
+    
+    ok &= !fclose(f);
+    if (!ok) throw RUNTIME_ERROR("failed to write %s", path);
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include "USBIP.h"
+
+// TraceRing: a fixed-size, lock-free flight recorder of usbip traffic. Each record holds a
+// command or reply header, plus up to `snapLen` bytes of its payload. Once the ring is full,
+// new records overwrite the oldest ones.
+//
+// record() claims a slot with a single atomic increment and never blocks or allocates, so
+// tracing can stay on in production. Readers (snapshot(), writePcap()) can run concurrently
+// with record(): each slot carries a sequence number that's odd while the slot is being
+// written, so readers skip records that are torn by a concurrent write.
+class TraceRing
+{
+public:
+    struct Record
+    {
+        uint64_t time = 0; // Nanoseconds since the epoch
+        USBIP::HEADER header = {}; // Host endian
+        uint32_t payloadLen = 0; // The payload's full length
+        uint32_t capLen = 0; // The number of payload bytes captured
+        // The endpoint's transfer type, as in bmAttributes of its descriptor (0: control,
+        // 1: isochronous, 2: bulk, 3: interrupt)
+        uint8_t xferType = 0;
+    };
+    
+    struct Entry
+    {
+        Record rec;
+        std::vector<uint8_t> payload; // The captured payload bytes
+    };
+    
+    // cap: the number of records that the ring holds (a power of 2)
+    // snapLen: the max number of payload bytes captured per record
+    TraceRing(size_t cap, size_t snapLen);
+    ~TraceRing();
+    
+    TraceRing(const TraceRing& x) = delete;
+    TraceRing& operator=(const TraceRing& x) = delete;
+    
+    void record(const USBIP::HEADER& header, uint8_t xferType, const uint8_t* payload, size_t payloadLen);
+    
+    // Returns the records in the ring, oldest first
+    std::vector<Entry> snapshot() const;
+    
+    // Writes the records in the ring to a pcap file, as usbmon packets (the Linux USB capture
+    // format, LINKTYPE_USB_LINUX_MMAPPED), so that Wireshark can decode the USB traffic
+    void writePcap(const char* path) const;
+    
+    // Writes `entries` to a pcap file, as writePcap() does
+    static void WritePcap(const char* path, const std::vector<Entry>& entries);
+
+private:
+    struct _Slot
+    {
+        // 2*n+1 while record n is being written, 2*n+2 once it's complete
+        std::atomic<uint64_t> seq = 0;
+        Record rec;
+        // Followed by `snapLen` bytes of payload
+    };
+    
+    _Slot& _slot(size_t idx) const { return *(_Slot*)(_mem.get() + (idx&(_cap-1))*_slotLen); }
+    
+    const size_t _cap = 0;
+    const size_t _snapLen = 0;
+    const size_t _slotLen = 0;
+    std::unique_ptr<uint8_t[]> _mem;
+    std::atomic<uint64_t> _head = 0; // Index of the next record
+};
@@ -111,6 +111,16 @@ struct HEADER_RET_UNLINK {
     int32_t status;
 } __attribute__((packed));
 
+// usbip_iso_packet_descriptor: follows the payload of isochronous CMD_SUBMITs and
+// RET_SUBMITs, one per packet
+struct ISO_PACKET_DESCRIPTOR {
+    uint32_t offset;
+    uint32_t length;
+    uint32_t actual_length;
+    uint32_t status;
+} __attribute__((packed));
+static_assert(sizeof(ISO_PACKET_DESCRIPTOR) == 16);
+
 // usbip_header
 struct HEADER {
     struct HEADER_BASIC base;
@@ -16,6 +16,19 @@ constexpr uint32_t USBIP_RET_UNLINK = 4;
 constexpr uint32_t USBIP_DIR_OUT    = 0;
 constexpr uint32_t USBIP_DIR_IN     = 1;
 
+// transfer_flags
+constexpr uint32_t USBIP_URB_ISO_ASAP = 0x0002;
+
+// Network protocol (usbip_network.h)
+constexpr uint16_t USBIP_PORT               = 3240;
+constexpr uint16_t USBIP_VERSION            = 0x0111;
+constexpr uint16_t USBIP_OP_REQ_IMPORT      = 0x8003;
+constexpr uint16_t USBIP_OP_REP_IMPORT      = 0x0003;
+constexpr uint16_t USBIP_OP_REQ_DEVLIST     = 0x8005;
+constexpr uint16_t USBIP_OP_REP_DEVLIST     = 0x0005;
+constexpr uint32_t USBIP_ST_OK              = 0x00;
+constexpr uint32_t USBIP_ST_NA              = 0x01;
+
 constexpr size_t SYSFS_PATH_MAX = 256;
 constexpr size_t SYSFS_BUS_ID_SIZE = 32;
 constexpr size_t MAX_STATUS_NAME = 18;
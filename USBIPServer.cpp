@@ -0,0 +1,428 @@
+#include "USBIPServer.h"
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "LIB/Toastbox/RuntimeError.h"
+#include "Log.h"
+
+#define USB             Toastbox::USB
+#define Endian          Toastbox::Endian
+
+// Every exported device appears on this (virtual) bus
+static constexpr uint32_t _BusNum = 1;
+
+// Reply to an import request for a device that doesn't exist or is already imported
+static const USBIP::OP_REP_IMPORT_HEADER _ImportRepNA = {
+    .version    = Endian::BFH_U16(USBIPLib::USBIP_VERSION),
+    .reply      = Endian::BFH_U16(USBIPLib::USBIP_OP_REP_IMPORT),
+    .status     = Endian::BFH_U32(USBIPLib::USBIP_ST_NA),
+};
+
+template<typename T>
+static void _Append(std::vector<uint8_t>& buf, const T& x)
+{
+    const uint8_t* p = (const uint8_t*)&x;
+    buf.insert(buf.end(), p, p+sizeof(x));
+}
+
+// Returns the interfaces (alternate setting 0) of the device's first configuration
+static std::vector<USBIP::OP_REP_DEVLIST_INTERFACE> _Interfaces(const VirtualUSBDevice::Info& info)
+{
+    std::vector<USBIP::OP_REP_DEVLIST_INTERFACE> r;
+    if (!info.configDescsCount) return r;
+    
+    const uint8_t*const desc = (const uint8_t*)info.configDescs[0];
+    const size_t descLen = Endian::HFL_U16(info.configDescs[0]->wTotalLength);
+    // Walk the descriptors that make up the configuration (each starts with bLength)
+    for (size_t off=0; off+2<=descLen && desc[off]>=2; off+=desc[off])
+    {
+        if (desc[off+1]!=USB::DescriptorType::Interface || off+sizeof(USB::InterfaceDescriptor)>descLen)
+            continue;
+        
+        const USB::InterfaceDescriptor& ifDesc = *(const USB::InterfaceDescriptor*)(desc+off);
+        if (Endian::HFL_U8(ifDesc.bAlternateSetting)) continue;
+        r.push_back({
+            .bInterfaceClass    = Endian::HFL_U8(ifDesc.bInterfaceClass),
+            .bInterfaceSubClass = Endian::HFL_U8(ifDesc.bInterfaceSubClass),
+            .bInterfaceProtocol = Endian::HFL_U8(ifDesc.bInterfaceProtocol),
+        });
+    }
+    return r;
+}
+
+// Fills the device record, which OP_REP_DEVLIST_DEVICE and OP_REP_IMPORT_PAYLOAD share
+template<typename T>
+static T _DeviceRecord(const VirtualUSBDevice& dev, const std::string& busid, uint32_t devNum, size_t ifCount)
+{
+    const VirtualUSBDevice::Info& info = dev.info();
+    const USB::DeviceDescriptor& d = *info.deviceDesc;
+    T r = {};
+    snprintf((char*)r.path, sizeof(r.path), "/sys/devices/virtual/VirtualUSB/%s", busid.c_str());
+    snprintf((char*)r.busid, sizeof(r.busid), "%s", busid.c_str());
+    r.busnum                = Endian::BFH_U32(_BusNum);
+    r.devnum                = Endian::BFH_U32(devNum);
+    r.speed                 = Endian::BFH_U32(dev.speed());
+    r.idVendor              = Endian::BFH_U16(Endian::HFL_U16(d.idVendor));
+    r.idProduct             = Endian::BFH_U16(Endian::HFL_U16(d.idProduct));
+    r.bcdDevice             = Endian::BFH_U16(Endian::HFL_U16(d.bcdDevice));
+    r.bDeviceClass          = Endian::HFL_U8(d.bDeviceClass);
+    r.bDeviceSubClass       = Endian::HFL_U8(d.bDeviceSubClass);
+    r.bDeviceProtocol       = Endian::HFL_U8(d.bDeviceProtocol);
+    r.bConfigurationValue   = (info.configDescsCount ? Endian::HFL_U8(info.configDescs[0]->bConfigurationValue) : 0);
+    r.bNumConfigurations    = Endian::HFL_U8(d.bNumConfigurations);
+    r.bNumInterfaces        = (uint8_t)ifCount;
+    return r;
+}
+
+USBIPServer::USBIPServer(const Info& info) : _info(info)
+{
+    for (const Export& exp : _info.exports)
+    {
+        assert(exp.device);
+        assert(!exp.busid.empty() && exp.busid.size()<_BusIDLen);
+        _exports.push_back({exp});
+    }
+}
+
+USBIPServer::~USBIPServer()
+{
+    stop();
+}
+
+void USBIPServer::start()
+{
+    assert(!_thread.joinable());
+    try
+    {
+        _buildReps();
+        
+        _listenFD = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC|SOCK_NONBLOCK, 0);
+        if (_listenFD < 0) throw RUNTIME_ERROR("socket failed: %s", strerror(errno));
+        
+        const int one = 1;
+        int ir = setsockopt(_listenFD, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (ir) throw RUNTIME_ERROR("setsockopt(SO_REUSEADDR) failed: %s", strerror(errno));
+        
+        // Accepted connections inherit the buffer sizes. They have to be set before listen(),
+        // since the TCP window scale is negotiated during the connection's handshake.
+        if (_info.sockBufLen)
+        {
+            for (int opt : {SO_SNDBUF, SO_RCVBUF})
+            {
+                ir = setsockopt(_listenFD, SOL_SOCKET, opt, &_info.sockBufLen, sizeof(_info.sockBufLen));
+                if (ir) throw RUNTIME_ERROR("setsockopt(SO_SNDBUF/SO_RCVBUF) failed: %s", strerror(errno));
+            }
+        }
+        
+        sockaddr_in addr = {
+            .sin_family = AF_INET,
+            .sin_port   = Endian::BFH_U16(_info.port),
+            .sin_addr   = {.s_addr = Endian::BFH_U32(INADDR_ANY)},
+        };
+        if (_info.addr)
+        {
+            ir = inet_pton(AF_INET, _info.addr, &addr.sin_addr);
+            if (ir != 1) throw RUNTIME_ERROR("invalid address: %s", _info.addr);
+        }
+        
+        ir = bind(_listenFD, (const sockaddr*)&addr, sizeof(addr));
+        if (ir) throw RUNTIME_ERROR("bind failed: %s", strerror(errno));
+        
+        ir = listen(_listenFD, _info.backlog);
+        if (ir) throw RUNTIME_ERROR("listen failed: %s", strerror(errno));
+        
+        socklen_t addrLen = sizeof(addr);
+        ir = getsockname(_listenFD, (sockaddr*)&addr, &addrLen);
+        if (ir) throw RUNTIME_ERROR("getsockname failed: %s", strerror(errno));
+        _port = Endian::HFB_U16(addr.sin_port);
+        
+        _epollFD = epoll_create1(EPOLL_CLOEXEC);
+        if (_epollFD < 0) throw RUNTIME_ERROR("epoll_create1 failed: %s", strerror(errno));
+        
+        _eventFD = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+        if (_eventFD < 0) throw RUNTIME_ERROR("eventfd failed: %s", strerror(errno));
+        
+        for (int fd : {_listenFD, _eventFD})
+        {
+            epoll_event ev = {.events = EPOLLIN, .data = {.fd = fd}};
+            ir = epoll_ctl(_epollFD, EPOLL_CTL_ADD, fd, &ev);
+            if (ir) throw RUNTIME_ERROR("epoll_ctl failed: %s", strerror(errno));
+        }
+        
+        _thread = std::thread([this] { _serverThread(); });
+    
+    }
+    catch (...)
+    {
+        stop();
+        throw;
+    }
+}
+
+void USBIPServer::stop()
+{
+    if (_thread.joinable())
+    {
+        const uint64_t val = 1;
+        (void)!::write(_eventFD, &val, sizeof(val));
+        _thread.join();
+    }
+    
+    // Drop the handshakes in progress
+    for (const auto& [fd, conn] : _conns)
+        close(fd);
+    _conns.clear();
+    
+    for (int* fd : {&_listenFD, &_epollFD, &_eventFD})
+    {
+        if (*fd >= 0)
+        {
+            close(*fd);
+            *fd = -1;
+        }
+    }
+}
+
+void USBIPServer::_buildReps()
+{
+    const USBIP::OP_REP_DEVLIST_HEADER devlistHdr = {
+        .version        = Endian::BFH_U16(USBIPLib::USBIP_VERSION),
+        .reply          = Endian::BFH_U16(USBIPLib::USBIP_OP_REP_DEVLIST),
+        .status         = Endian::BFH_U32(USBIPLib::USBIP_ST_OK),
+        .deviceCount    = Endian::BFH_U32((uint32_t)_exports.size()),
+    };
+    
+    const USBIP::OP_REP_IMPORT_HEADER importHdr = {
+        .version        = Endian::BFH_U16(USBIPLib::USBIP_VERSION),
+        .reply          = Endian::BFH_U16(USBIPLib::USBIP_OP_REP_IMPORT),
+        .status         = Endian::BFH_U32(USBIPLib::USBIP_ST_OK),
+    };
+    
+    _devlistRep.clear();
+    _Append(_devlistRep, devlistHdr);
+    for (size_t i=0; i<_exports.size(); i++)
+    {
+        _Export& exp = _exports[i];
+        const uint32_t devNum = (uint32_t)i+1;
+        const auto ifs = _Interfaces(exp.device->info());
+        
+        _Append(_devlistRep, _DeviceRecord<USBIP::OP_REP_DEVLIST_DEVICE>(*exp.device, exp.busid, devNum, ifs.size()));
+        for (const auto& x : ifs)
+            _Append(_devlistRep, x);
+        
+        exp.importRep.clear();
+        _Append(exp.importRep, importHdr);
+        _Append(exp.importRep, _DeviceRecord<USBIP::OP_REP_IMPORT_PAYLOAD>(*exp.device, exp.busid, devNum, ifs.size()));
+    }
+}
+
+void USBIPServer::_serverThread()
+{
+    epoll_event events[64];
+    for (;;)
+    {
+        const int ir = epoll_wait(_epollFD, events, std::size(events), -1);
+        if (ir < 0)
+        {
+            if (errno == EINTR) continue;
+            LOG_ERROR("USBIPServer: epoll_wait failed: %s", strerror(errno));
+            return;
+        }
+        
+        for (int i=0; i<ir; i++)
+        {
+            const int fd = events[i].data.fd;
+            if (fd == _eventFD) return;
+            if (fd == _listenFD)
+            {
+                _accept();
+                continue;
+            }
+            
+            auto it = _conns.find(fd);
+            if (it == _conns.end()) continue; // Closed since the event fired
+            _Conn& conn = *it->second;
+            try
+            {
+                if (conn.rep) _send(conn);
+                else _recv(conn);
+            }
+            catch (const std::exception& e)
+            {
+                LOG_WARN("USBIPServer: dropping connection: %s", e.what());
+                _close(conn);
+            }
+        }
+    }
+}
+
+void USBIPServer::_accept()
+{
+    for (;;)
+    {
+        const int fd = accept4(_listenFD, nullptr, nullptr, SOCK_NONBLOCK|SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno==EINTR || errno==ECONNABORTED) continue;
+            if (errno!=EAGAIN && errno!=EWOULDBLOCK)
+                LOG_WARN("USBIPServer: accept4 failed: %s", strerror(errno));
+            return;
+        }
+        
+        // URBs are small and latency-sensitive, so don't let Nagle hold them back
+        const int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        USBIPLib::usbip_net_set_keepalive(fd);
+        
+        epoll_event ev = {.events = EPOLLIN, .data = {.fd = fd}};
+        const int ir = epoll_ctl(_epollFD, EPOLL_CTL_ADD, fd, &ev);
+        if (ir)
+        {
+            LOG_WARN("USBIPServer: epoll_ctl failed: %s", strerror(errno));
+            close(fd);
+            continue;
+        }
+        
+        auto conn = std::make_unique<_Conn>();
+        conn->fd = fd;
+        _conns[fd] = std::move(conn);
+    }
+}
+
+void USBIPServer::_recv(_Conn& conn)
+{
+    // Every request starts with the same header as OP_REQ_DEVLIST, which tells us how long
+    // the rest of it is
+    constexpr size_t HdrLen = sizeof(USBIP::OP_REQ_DEVLIST);
+    for (;;)
+    {
+        size_t len = HdrLen;
+        if (conn.reqLen >= HdrLen)
+        {
+            const auto& hdr = *(const USBIP::OP_REQ_DEVLIST*)conn.req;
+            if (Endian::HFB_U16(hdr.command) == USBIPLib::USBIP_OP_REQ_IMPORT)
+                len = sizeof(USBIP::OP_REQ_IMPORT);
+        }
+        if (conn.reqLen == len) break;
+        
+        const ssize_t sr = recv(conn.fd, conn.req+conn.reqLen, len-conn.reqLen, 0);
+        if (sr == 0) throw RUNTIME_ERROR("connection closed");
+        if (sr < 0)
+        {
+            if (errno==EAGAIN || errno==EWOULDBLOCK) return;
+            if (errno == EINTR) continue;
+            throw RUNTIME_ERROR("recv failed: %s", strerror(errno));
+        }
+        conn.reqLen += sr;
+    }
+    
+    _handleReq(conn);
+}
+
+void USBIPServer::_handleReq(_Conn& conn)
+{
+    const auto& hdr = *(const USBIP::OP_REQ_DEVLIST*)conn.req;
+    const uint16_t version = Endian::HFB_U16(hdr.version);
+    if (version != USBIPLib::USBIP_VERSION)
+        throw RUNTIME_ERROR("unsupported usbip version: 0x%x", version);
+    
+    const uint16_t cmd = Endian::HFB_U16(hdr.command);
+    switch (cmd)
+    {
+        case USBIPLib::USBIP_OP_REQ_DEVLIST:
+            conn.rep = _devlistRep.data();
+            conn.repLen = _devlistRep.size();
+            break;
+        
+        case USBIPLib::USBIP_OP_REQ_IMPORT:
+        {
+            const auto& req = *(const USBIP::OP_REQ_IMPORT*)conn.req;
+            // The busid isn't necessarily null-terminated
+            const std::string busid((const char*)req.busid, strnlen((const char*)req.busid, _BusIDLen));
+            auto it = std::find_if(_exports.begin(), _exports.end(),
+                [&](const _Export& exp) { return exp.busid == busid; });
+            
+            // Each device can only be imported once, since it can't be restarted
+            if (it!=_exports.end() && !it->imported)
+            {
+                it->imported = true;
+                conn.exp = &*it;
+                conn.rep = it->importRep.data();
+                conn.repLen = it->importRep.size();
+            }
+            else
+            {
+                conn.rep = (const uint8_t*)&_ImportRepNA;
+                conn.repLen = sizeof(_ImportRepNA);
+            }
+            break;
+        }
+        
+        default:
+            throw RUNTIME_ERROR("unknown usbip command: 0x%x", cmd);
+    }
+    
+    _send(conn);
+}
+
+void USBIPServer::_send(_Conn& conn)
+{
+    while (conn.repOff < conn.repLen)
+    {
+        const ssize_t sr = send(conn.fd, conn.rep+conn.repOff, conn.repLen-conn.repOff, MSG_NOSIGNAL);
+        if (sr < 0)
+        {
+            if (errno == EINTR) continue;
+            if (errno!=EAGAIN && errno!=EWOULDBLOCK)
+                throw RUNTIME_ERROR("send failed: %s", strerror(errno));
+            
+            // Finish sending once the socket is writable
+            epoll_event ev = {.events = EPOLLOUT, .data = {.fd = conn.fd}};
+            const int ir = epoll_ctl(_epollFD, EPOLL_CTL_MOD, conn.fd, &ev);
+            if (ir) throw RUNTIME_ERROR("epoll_ctl failed: %s", strerror(errno));
+            return;
+        }
+        conn.repOff += sr;
+    }
+    
+    if (conn.exp) _handOff(conn);
+    else _close(conn);
+}
+
+void USBIPServer::_handOff(_Conn& conn)
+{
+    const int fd = conn.fd;
+    _Export& exp = *conn.exp;
+    epoll_ctl(_epollFD, EPOLL_CTL_DEL, fd, nullptr);
+    _conns.erase(fd);
+    
+    // Engine::Threads expects a blocking socket (the other engines make it non-blocking
+    // themselves)
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    
+    // The device owns the connection from here on, and serves the URB stream over it
+    try
+    {
+        exp.device->start(fd);
+    }
+    catch (const std::exception& e)
+    {
+        LOG_ERROR("USBIPServer: failed to start device %s: %s", exp.busid.c_str(), e.what());
+    }
+}
+
+void USBIPServer::_close(_Conn& conn)
+{
+    const int fd = conn.fd;
+    // Closing the file descriptor removes it from the epoll set
+    close(fd);
+    _conns.erase(fd);
+}
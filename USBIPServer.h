@@ -0,0 +1,98 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <thread>
+#include "VirtualUSBDevice.h"
+
+// USBIPServer: exports VirtualUSBDevices over TCP using the usbip network protocol, so that
+// remote hosts can list and attach them (`usbip list -r <host>`, `usbip attach -r <host> -b
+// <busid>`).
+//
+// The device-list and import replies are built up front, so a request is answered with a single
+// send(). Once a device is imported, the client's connection is handed to the device (via
+// VirtualUSBDevice::start(socket)), which then serves the URB stream over it with its own
+// engine. The server thread therefore only ever handles the (short) handshakes, which it
+// multiplexes with epoll so that many clients can connect at once.
+class USBIPServer
+{
+public:
+    struct Export
+    {
+        std::string busid; // Eg "1-1"
+        VirtualUSBDevice* device = nullptr; // Not started; started by the server when imported
+    };
+    
+    struct Info
+    {
+        const char* addr = nullptr; // IPv4 address to listen on (nullptr: every address)
+        uint16_t port = USBIPLib::USBIP_PORT; // 0: any port (see port())
+        int backlog = 128;
+        // SO_SNDBUF/SO_RCVBUF of client connections (0: the kernel's default). Large buffers
+        // let bulk transfers stream without stalling on the TCP window.
+        int sockBufLen = 0x100000;
+        std::vector<Export> exports;
+    };
+    
+    USBIPServer(const Info& info);
+    
+    ~USBIPServer();
+    
+    // Listens and starts the server thread
+    void start();
+    
+    // Stops accepting connections and drops the handshakes in progress. Devices that were
+    // already imported keep running.
+    void stop();
+    
+    // The port that we're listening on (useful when Info::port==0)
+    uint16_t port() const { return _port; }
+
+private:
+    struct _Export : Export
+    {
+        std::vector<uint8_t> importRep;
+        bool imported = false;
+    };
+    
+    // A connection that hasn't finished its handshake
+    struct _Conn
+    {
+        int fd = -1;
+        // Request that's been partially received (OP_REQ_IMPORT is the longest)
+        uint8_t req[sizeof(USBIP::OP_REQ_IMPORT)] = {};
+        size_t reqLen = 0;
+        // Reply that's being sent
+        const uint8_t* rep = nullptr;
+        size_t repLen = 0;
+        size_t repOff = 0;
+        // Export to hand the connection to once the reply is sent (nullptr: close instead)
+        _Export* exp = nullptr;
+    };
+    
+    static constexpr size_t _BusIDLen = sizeof(USBIP::OP_REQ_IMPORT::busid);
+    
+    void _buildReps();
+    void _serverThread();
+    void _accept();
+    void _recv(_Conn& conn);
+    void _send(_Conn& conn);
+    void _handleReq(_Conn& conn);
+    void _handOff(_Conn& conn);
+    void _close(_Conn& conn);
+    
+    const Info _info = {};
+    std::vector<_Export> _exports;
+    std::vector<uint8_t> _devlistRep;
+    
+    int _listenFD = -1;
+    int _epollFD = -1;
+    int _eventFD = -1; // Wakes the server thread to stop
+    uint16_t _port = 0;
+    std::thread _thread;
+    // Connections by file descriptor. Only touched by the server thread (and by stop(), once
+    // the server thread has exited).
+    std::unordered_map<int,std::unique_ptr<_Conn>> _conns;
+};
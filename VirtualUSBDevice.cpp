@@ -1,4 +1,10 @@
 #include "VirtualUSBDevice.h"
+#include "IOURing.h"
+#include "IOWorkerPool.h"
+#include "TimerWheel.h"
+#include "TraceRing.h"
+#include "SessionRecorder.h"
+#include "Log.h"
 #include "LIB/Toastbox/RuntimeError.h"
 
 #define USB             Toastbox::USB
@@ -6,9 +12,84 @@
 
 struct _Data
 {
-    std::unique_ptr<uint8_t[]> data;
-    size_t len = 0;
+    Buffer data;
     size_t off = 0;
+    // The coroutine that's waiting for the data to be sent, if it's from send()
+    VirtualUSBDevice::_SendAwaiter* sender = nullptr;
+    std::coroutine_handle<> coro;
+};
+
+struct _Endpoint
+{
+    std::mutex lock; // Protects the fields below
+    std::deque<VirtualUSBDevice::_Cmd> inCmds;
+    std::deque<_Data> inData;
+    
+    // The depths of `inCmds` and `inData`, and the bytes in `inData` that haven't been sent,
+    // for stats(). Only written with `lock` held, but read without it.
+    std::atomic<size_t> inCmdsLen = 0;
+    std::atomic<size_t> inDataLen = 0;
+    std::atomic<size_t> inDataBytes = 0;
+    
+    // send() coroutines whose data has been sent, to be resumed once `lock` is released
+    std::vector<std::coroutine_handle<>> ready;
+    
+    // wMaxPacketSize from the endpoint descriptor (see _sendInXfer()). 0 for the default
+    // control endpoint, which sends each write() as a transfer of its own.
+    size_t maxPacketLen = 0;
+    
+    // Interrupt endpoints only send when the host polls them, every `pollInterval` frames,
+    // so `pollTimer` sends a transfer at each poll (null for other endpoints)
+    std::unique_ptr<TimerWheel::Timer> pollTimer;
+    uint32_t pollInterval = 1;
+    
+    // Publishes the depths of `inCmds` and `inData`; `lock` must be held
+    void publish()
+    {
+        inCmdsLen.store(inCmds.size(), std::memory_order_relaxed);
+        inDataLen.store(inData.size(), std::memory_order_relaxed);
+    }
+};
+
+// An isochronous URB that's been scheduled, and completes at `deadline`
+struct VirtualUSBDevice::_IsoUrb
+{
+    _Cmd cmd;
+    uint64_t startFrame = 0; // The frame of the first packet
+    uint32_t interval = 1; // Frames between packets
+    size_t late = 0; // The number of leading packets whose frames had passed when scheduled
+    _Time deadline; // The end of the last packet's frame
+};
+
+// Isochronous endpoint state
+struct _IsoEndpoint
+{
+    uint32_t interval = 1; // The packet interval from the endpoint descriptor, in frames
+    VirtualUSBDevice::IsoSource source; // IN endpoints
+    VirtualUSBDevice::IsoSink sink; // OUT endpoints
+    // Completes `urbs` as they come due. `due` is only touched by the timer's function.
+    std::unique_ptr<TimerWheel::Timer> timer;
+    std::vector<VirtualUSBDevice::_IsoUrb> due;
+    
+    // Protected by _Impl::isoLock
+    uint64_t nextFrame = 0; // The frame after the last one that's been scheduled
+    std::deque<VirtualUSBDevice::_IsoUrb> urbs; // In the order that they complete
+};
+
+// An endpoint's handler (see setHandler())
+struct VirtualUSBDevice::_Handler
+{
+    VirtualUSBDevice::Handler fn;
+    // With a pool, the receiving side queues transfers in `xfers`, and kicks `source`, whose
+    // callback calls `fn` for them. Sources' callbacks don't overlap, so neither do the calls.
+    IOWorkerPool* pool = nullptr;
+    IOWorkerPool::SourceRef source;
+    std::mutex lock; // Protects the fields below
+    std::deque<VirtualUSBDevice::XferRef> xfers;
+    // Without `fn`, the endpoint is awaited by a coroutine (see receive()): `xfers` holds the
+    // transfers that it hasn't received yet, and `waiter` is its receive() while it waits
+    VirtualUSBDevice::_ReceiveAwaiter* waiter = nullptr;
+    std::coroutine_handle<> coro;
 };
 
 struct _State
@@ -20,28 +101,237 @@ struct _State
     static constexpr uint8_t Reset              = 1<<3;
 };
 
-struct
+// Counters and per-URB latency histograms of an endpoint (see VirtualUSBDevice::EndpointStats
+// and VirtualUSBDevice::LatencyStats)
+struct _EPStats
+{
+    std::atomic<uint64_t> urbsSubmitted = 0;
+    std::atomic<uint64_t> urbsCompleted = 0;
+    std::atomic<uint64_t> urbsUnlinked = 0;
+    std::atomic<uint64_t> bytes = 0;
+    
+    Histogram queue;
+    Histogram app;
+    Histogram send;
+    Histogram total;
+};
+
+// Capacity of the queues between the read/write threads and the application
+static constexpr size_t _QueueCap = 256;
+
+// Endpoint transfer types (bmAttributes & 0x03)
+static constexpr uint8_t _XferTypeIsochronous = 0x01;
+static constexpr uint8_t _XferTypeInterrupt   = 0x03;
+
+// Every device in the process allocates its buffers from this pool, so that idle buffers
+// aren't duplicated per device. The pool's per-thread caches keep the devices (and each
+// device's threads) from contending for its size classes.
+static BufferPool& _SharedPool()
+{
+    static BufferPool pool;
+    return pool;
+}
+
+// Every device in the process runs its timers (interrupt endpoint polls, isochronous
+// completions) on this wheel, so that timers that are due together fire in one wake-up,
+// whatever their endpoint or device, without a thread per device
+static TimerWheel& _SharedWheel()
+{
+    // Never destroyed, since its thread can't be joined while timers may still be running
+    static TimerWheel* wheel = new TimerWheel();
+    return *wheel;
+}
+
+// The devices whose I/O the calling thread is doing, innermost first (see _IOScope)
+struct _IOScope;
+static thread_local const _IOScope* _IOScopes = nullptr;
+
+// Marks the calling thread as doing `dev`'s I/O while it exists: in the device's I/O
+// threads, its worker and pool callbacks, its timers, and read() (which holds readLock).
+// The handlers and coroutines that run there mustn't make _reset() wait for the I/O to
+// stop, since it'd be waiting on them.
+struct _IOScope
+{
+    _IOScope(const VirtualUSBDevice* dev) : dev(dev), prev(_IOScopes) { _IOScopes = this; }
+    ~_IOScope() { _IOScopes = prev; }
+    _IOScope(const _IOScope&) = delete;
+    _IOScope& operator=(const _IOScope&) = delete;
+    
+    static bool Contains(const VirtualUSBDevice* dev)
+    {
+        for (const _IOScope* s=_IOScopes; s; s=s->prev)
+            if (s->dev == dev) return true;
+        return false;
+    }
+    
+    const VirtualUSBDevice*const dev;
+    const _IOScope*const prev;
+};
+
+// Per-device state
+// Lock ordering: readLock -> lock -> _Endpoint::lock -> isoLock -> repLock. The data path never
+// takes `lock`, so the error handlers release every other lock before calling _reset() (except
+// `readLock`, which read() holds while its handlers run with Engine::EventLoop).
+struct VirtualUSBDevice::_Impl
 {
-    std::mutex lock; // Struct should only be accessed while holding lock
-    std::condition_variable signal;
+    std::mutex lock; // Protects the lifecycle state: `state`, `err` and the sockets
+    std::condition_variable signal; // Signalled when the read/write threads exit
     uint8_t state = _State::Idle;
     VirtualUSBDevice::Err err;
     int socket = -1;
     int usbipSocket = -1;
+    
+    // Set (after `err`) by _reset(), so that the data path can check for errors without
+    // taking `lock`. `err` doesn't change once this is set.
+    std::atomic<bool> reset = false;
+    
+    // Serializes read() callers; protects `cmdQueue`'s consumer side and the Engine::EventLoop
+    // receive state.
+    // `configDesc` belongs to whichever thread handles commands (_handleCmd()). Without
+    // handlers that's the read() caller, under `readLock`. With handlers it's the receiving
+    // side (see _dispatchCmds()): the read thread with Engine::Threads, the worker callback
+    // with Engine::WorkerPool, and the read() caller driving the loop (under `readLock`)
+    // with Engine::EventLoop.
+    std::mutex readLock;
     const USB::ConfigurationDescriptor* configDesc = nullptr;
     
+    // Serializes the producers of replies; protects `repQueue`'s producer side and the
+    // Engine::EventLoop send state
+    std::mutex repLock;
+    
+    // Engine::Threads handoffs: commands from the read thread to read(), and replies to the
+    // write thread. Each has a single producer and a single consumer at a time, courtesy of
+    // `readLock` and `repLock`.
+    SPSCQueue<VirtualUSBDevice::_Cmd> cmdQueue{_QueueCap};
+    SPSCQueue<VirtualUSBDevice::_Rep> repQueue{_QueueCap};
+    // Replies that the timer wheel's thread couldn't fit in `repQueue`, for the write thread
+    // to collect (see _queueRep()). Protected by `repLock`.
+    std::deque<VirtualUSBDevice::_Rep> repsOverflow;
+    
+    // Rings for the read/write threads, when using io_uring. Each thread takes ownership of
+    // its ring when it starts.
+    std::unique_ptr<IOURing> readRing;
+    std::unique_ptr<IOURing> writeRing;
+    
+    // Engine::EventLoop / Engine::WorkerPool state. The receive state (`cmds`, `recvBuf`) is
+    // protected by `readLock` with the event loop, and only touched by the worker callback
+    // with the worker pool. The send state (`reps`, `repsOff`, `iov`) is protected by
+    // `repLock`.
     std::deque<VirtualUSBDevice::_Cmd> cmds;
-    std::deque<VirtualUSBDevice::_Cmd> reps;
+    std::deque<VirtualUSBDevice::_Rep> reps;
+    int epollFD = -1;
+    bool pollOut = false;
+    VirtualUSBDevice::_RecvBuf recvBuf;
+    size_t repsOff = 0;
+    std::vector<iovec> iov;
+    
+    // Engine::WorkerPool state
+    IOWorkerPool::SourceRef source;
+    // Set by the worker when it stops reading because `cmdQueue` is full; read() clears it
+    // and kicks the worker once there's room
+    std::atomic<bool> readStalled = false;
+    
+    // Pending IN transfers and IN data, per endpoint, so that traffic on one endpoint
+    // doesn't contend with another. Only allocated for the IN endpoints that the device has.
+    std::unique_ptr<_Endpoint> eps[USB::Endpoint::MaxCountIn];
+    
+    // Stats, per endpoint (indexed by _EPAddrIdx()). Only allocated for the endpoints that
+    // the device has.
+    std::unique_ptr<_EPStats> epStats[USB::Endpoint::MaxCount];
+    
+    // Device-wide counters for stats(). Each is only incremented, with relaxed atomics, so
+    // that the data path never takes a lock for them.
+    std::atomic<uint64_t> errors = 0;
+    std::atomic<uint64_t> cmdsReceived = 0;
+    std::atomic<uint64_t> cmdsHandled = 0;
+    std::atomic<uint64_t> repsQueued = 0;
+    std::atomic<uint64_t> repsSent = 0;
     
-    std::deque<VirtualUSBDevice::_Cmd> inCmds[USB::Endpoint::MaxCount];
-    std::deque<_Data> inData[USB::Endpoint::MaxCount];
-} _s = {};
+    // Recent usbip traffic (null if tracing is disabled), and the transfer type of each
+    // endpoint (indexed by _EPAddrIdx()) for its records
+    std::unique_ptr<TraceRing> trace;
+    uint8_t xferTypes[USB::Endpoint::MaxCount] = {};
+    
+    // The frame clock (see frame()), and the schedules of the isochronous endpoints (indexed
+    // by _EPAddrIdx()), which their timers complete in real time
+    _Time frameEpoch;
+    std::chrono::nanoseconds framePeriod;
+    std::unique_ptr<_IsoEndpoint> isoEps[USB::Endpoint::MaxCount];
+    std::mutex isoLock; // Protects the schedules
+    
+    // Endpoint handlers (indexed by _EPAddrIdx()), and whether there are any, so that
+    // devices without handlers skip looking for them
+    std::unique_ptr<_Handler> handlers[USB::Endpoint::MaxCount];
+    bool hasHandlers = false;
+};
 
-VirtualUSBDevice::VirtualUSBDevice(const Info& info) : _info(info) {}
+VirtualUSBDevice::VirtualUSBDevice(const Info& info) : _info(info), _s(std::make_unique<_Impl>())
+{
+    // Allocate the state for the default control endpoint (which carries non-standard IN
+    // requests), and for every IN endpoint in the configuration descriptors. Stats are
+    // allocated for both directions of every endpoint.
+    _s->eps[0] = std::make_unique<_Endpoint>();
+    _s->epStats[_EPAddrIdx(0, USBIPLib::USBIP_DIR_OUT)] = std::make_unique<_EPStats>();
+    _s->epStats[_EPAddrIdx(0, USBIPLib::USBIP_DIR_IN)] = std::make_unique<_EPStats>();
+    if (_info.traceLen)
+        _s->trace = std::make_unique<TraceRing>(_info.traceLen, _info.traceSnapLen);
+    // Frames are 1ms at full speed; they're 125us microframes at high speed and above. Every
+    // device counts them from the timer wheel's epoch, so that their polls share its ticks.
+    _s->frameEpoch = _SharedWheel().epoch();
+    _s->framePeriod = (speed()>=USBIPLib::USB_SPEED_HIGH ? 125us : 1ms);
+    for (size_t i=0; i<_info.configDescsCount; i++)
+    {
+        const USB::ConfigurationDescriptor& configDesc = *_info.configDescs[i];
+        const uint8_t*const desc = (const uint8_t*)&configDesc;
+        const size_t descLen = _DescLen(configDesc);
+        // Walk the descriptors that make up the configuration (each starts with bLength)
+        for (size_t off=0; off+2<=descLen && desc[off]>=2; off+=desc[off])
+        {
+            if (desc[off+1]!=USB::DescriptorType::Endpoint || off+sizeof(USB::EndpointDescriptor)>descLen)
+                continue;
+            
+            const USB::EndpointDescriptor& epDesc = *(const USB::EndpointDescriptor*)(desc+off);
+            const uint8_t ep = Endian::HFL_U8(epDesc.bEndpointAddress);
+            const bool dirIn = (ep & USB::Endpoint::DirectionMask) == USB::Endpoint::DirectionIn;
+            const size_t idx = _EPAddrIdx(ep & USB::Endpoint::IndexMask,
+                (dirIn ? USBIPLib::USBIP_DIR_IN : USBIPLib::USBIP_DIR_OUT));
+            if (!_s->epStats[idx]) _s->epStats[idx] = std::make_unique<_EPStats>();
+            _s->xferTypes[idx] = Endian::HFL_U8(epDesc.bmAttributes) & 0x03;
+            if (_s->xferTypes[idx] == _XferTypeIsochronous)
+            {
+                // Isochronous endpoints are serviced every 2^(bInterval-1) frames
+                std::unique_ptr<_IsoEndpoint>& iso = _s->isoEps[idx];
+                if (!iso) iso = std::make_unique<_IsoEndpoint>();
+                const uint8_t bInterval = std::clamp(Endian::HFL_U8(epDesc.bInterval), (uint8_t)1, (uint8_t)16);
+                iso->interval = 1u << (bInterval-1);
+                if (!iso->timer)
+                    iso->timer = std::make_unique<TimerWheel::Timer>([this, idx] { _isoTimer(idx); });
+            }
+            if (!dirIn) continue;
+            
+            const uint8_t epIdx = ep & USB::Endpoint::IndexMask;
+            std::unique_ptr<_Endpoint>& e = _s->eps[epIdx];
+            if (!e) e = std::make_unique<_Endpoint>();
+            // Bits 11-12 are the high-bandwidth transactions per microframe, not the size
+            e->maxPacketLen = Endian::HFL_U16(epDesc.wMaxPacketSize) & 0x7FF;
+            if (_s->xferTypes[idx] == _XferTypeInterrupt)
+            {
+                // Interrupt endpoints are polled every bInterval frames at full/low speed, and
+                // every 2^(bInterval-1) microframes at high speed and above
+                const uint8_t bInterval = Endian::HFL_U8(epDesc.bInterval);
+                e->pollInterval = (speed()>=USBIPLib::USB_SPEED_HIGH ?
+                    1u << (std::clamp(bInterval, (uint8_t)1, (uint8_t)16)-1) :
+                    std::max(bInterval, (uint8_t)1));
+                if (!e->pollTimer)
+                    e->pollTimer = std::make_unique<TimerWheel::Timer>([this, epIdx] { _pollInEndpoint(epIdx); });
+            }
+        }
+    }
+}
 
 VirtualUSBDevice::~VirtualUSBDevice()
 {
-    auto lock = std::unique_lock(_s.lock);
+    auto lock = std::unique_lock(_s->lock);
     _reset(lock, ErrStopped);
 }
 
@@ -58,50 +348,117 @@ const std::exception& VirtualUSBDevice::ErrExtract(Err err)
     }
 }
 
-void VirtualUSBDevice::start()
+void VirtualUSBDevice::start(int socket)
 {
-    auto lock = std::unique_lock(_s.lock);
+    auto lock = std::unique_lock(_s->lock);
     try
     {
-        assert(_s.state == _State::Idle);
-        _s.state |= _State::Started;
-        
-        const uint32_t speed = _SpeedFromBCDUSB(_info.deviceDesc->bcdDevice);
-        int sockets[2] = {-1,-1};
-        int ir = socketpair(AF_UNIX, SOCK_STREAM, 0, sockets);
-        if (ir) throw RUNTIME_ERROR("socketpair failed: %s", strerror(errno));
-        _s.socket = sockets[0];
-        _s.usbipSocket = sockets[1];
+        assert(_s->state == _State::Idle);
+        _s->state |= _State::Started;
         
-        ir = USBIPLib::usbip_vhci_driver_open();
-        if (ir)
-            throw RUNTIME_ERROR("usbip_vhci_driver_open failed: %s", strerror(errno));
-        
-        for (;;)
+        int ir = 0;
+        if (socket >= 0)
         {
-            int usbipPort = USBIPLib::usbip_vhci_get_free_port(speed);
-            if (usbipPort < 0)
-                throw RUNTIME_ERROR("usbip_vhci_get_free_port failed: %s", strerror(errno));
+            // Serve the device over the caller's connection
+            _s->socket = socket;
+        }
+        else
+        {
+            const uint32_t speed = this->speed();
+            int sockets[2] = {-1,-1};
+            ir = socketpair(AF_UNIX, SOCK_STREAM, 0, sockets);
+            if (ir) throw RUNTIME_ERROR("socketpair failed: %s", strerror(errno));
+            _s->socket = sockets[0];
+            _s->usbipSocket = sockets[1];
+            
+            ir = USBIPLib::usbip_vhci_driver_open();
+            if (ir)
+                throw RUNTIME_ERROR("usbip_vhci_driver_open failed: %s", strerror(errno));
             
-            ir = USBIPLib::usbip_vhci_attach_device2(usbipPort, _s.usbipSocket, _DeviceID, speed);
-            if (ir < 0)
+            for (;;)
             {
-                if (errno == EBUSY)
-                    continue;
-                else
-                    throw RUNTIME_ERROR("usbip_vhci_attach_device2 failed: %s", strerror(errno));
+                int usbipPort = USBIPLib::usbip_vhci_get_free_port(speed);
+                if (usbipPort < 0)
+                    throw RUNTIME_ERROR("usbip_vhci_get_free_port failed: %s", strerror(errno));
+                
+                ir = USBIPLib::usbip_vhci_attach_device2(usbipPort, _s->usbipSocket, _DeviceID, speed);
+                if (ir < 0)
+                {
+                    if (errno == EBUSY)
+                        continue;
+                    else
+                        throw RUNTIME_ERROR("usbip_vhci_attach_device2 failed: %s", strerror(errno));
+                }
+                break;
             }
-            break;
+            
+            USBIPLib::usbip_vhci_driver_close();
+            
+            close(_s->usbipSocket);
+            _s->usbipSocket = -1;
         }
         
-        USBIPLib::usbip_vhci_driver_close();
-        
-        close(_s.usbipSocket);
-        _s.usbipSocket = -1;
-        
-        _s.state |= (_State::ReadThreadRunning|_State::WriteThreadRunning);
-        std::thread([this] { _readThread(); }).detach();
-        std::thread([this] { _writeThread(); }).detach();
+        switch (_info.engine)
+        {
+            case Engine::Threads:
+                if (_info.useIOURing)
+                {
+                    try
+                    {
+                        _s->readRing = std::make_unique<IOURing>(_URingEntries, _info.uringSQPoll);
+                        _s->readRing->registerBufRing(_URingBufGroup, _URingBufCount);
+                        if (!_s->readRing->recvMultishotSupported(_URingBufGroup))
+                            throw RUNTIME_ERROR("multishot receive unsupported");
+                        _s->readRing->registerFile(_s->socket);
+                        _s->writeRing = std::make_unique<IOURing>(_URingEntries, _info.uringSQPoll);
+                        _s->writeRing->registerFile(_s->socket);
+                    }
+                    catch (const std::exception& e)
+                    {
+                        LOG_WARN("VirtualUSBDevice: io_uring unavailable, falling back to syscalls: %s", e.what());
+                        _s->readRing = nullptr;
+                        _s->writeRing = nullptr;
+                    }
+                }
+                
+                _s->state |= (_State::ReadThreadRunning|_State::WriteThreadRunning);
+                std::thread([this] { _readThread(); }).detach();
+                std::thread([this] { _writeThread(); }).detach();
+                break;
+            
+            case Engine::WorkerPool:
+            {
+                assert(_info.workerPool);
+                _s->recvBuf.pool = &_SharedPool();
+                _s->recvBuf.xferTypes = _s->xferTypes;
+                
+                // The socket is shared with the other devices' sockets, so it mustn't block
+                ir = fcntl(_s->socket, F_SETFL, fcntl(_s->socket, F_GETFL)|O_NONBLOCK);
+                if (ir) throw RUNTIME_ERROR("fcntl failed: %s", strerror(errno));
+                
+                _s->source = _info.workerPool->add(_s->socket, EPOLLIN,
+                    [this] (uint32_t events) { return _workerIO(events); });
+                break;
+            }
+            
+            case Engine::EventLoop:
+            {
+                _s->recvBuf.pool = &_SharedPool();
+                _s->recvBuf.xferTypes = _s->xferTypes;
+                
+                // The socket is driven by read(), so it mustn't block
+                ir = fcntl(_s->socket, F_SETFL, fcntl(_s->socket, F_GETFL)|O_NONBLOCK);
+                if (ir) throw RUNTIME_ERROR("fcntl failed: %s", strerror(errno));
+                
+                _s->epollFD = epoll_create1(EPOLL_CLOEXEC);
+                if (_s->epollFD < 0) throw RUNTIME_ERROR("epoll_create1 failed: %s", strerror(errno));
+                
+                epoll_event ev = {.events = EPOLLIN};
+                ir = epoll_ctl(_s->epollFD, EPOLL_CTL_ADD, _s->socket, &ev);
+                if (ir) throw RUNTIME_ERROR("epoll_ctl failed: %s", strerror(errno));
+                break;
+            }
+        }
     
     }
     catch (const std::exception& e)
@@ -109,110 +466,541 @@ void VirtualUSBDevice::start()
         _reset(lock, std::current_exception());
         if (_info.throwOnErr)
         {
-            // Throw `_s.err`, not `e`, so that we throw the original cause (eg ErrStopped)
-            std::rethrow_exception(_s.err);
+            // Throw `_s->err`, not `e`, so that we throw the original cause (eg ErrStopped)
+            std::rethrow_exception(_s->err);
         }
     }
 }
 
+// Copies the payload out of the receive buffer, so that the buffer can be reused
+static VirtualUSBDevice::Xfer _CopyXfer(VirtualUSBDevice::XferRef&& ref)
+{
+    VirtualUSBDevice::Xfer xfer = {
+        .ep         = ref.ep,
+        .setupReq   = ref.setupReq,
+        .len        = ref.data.len(),
+    };
+    if (xfer.len)
+    {
+        xfer.data = std::make_unique<uint8_t[]>(xfer.len);
+        memcpy(xfer.data.get(), ref.data.data(), xfer.len);
+    }
+    return xfer;
+}
+
 std::optional<VirtualUSBDevice::Xfer> VirtualUSBDevice::read(std::chrono::milliseconds timeout)
 {
-    auto lock = std::unique_lock(_s.lock);
+    std::optional<Xfer> xfer;
+    _read(1, timeout, [&] (XferRef&& ref) { xfer = _CopyXfer(std::move(ref)); });
+    return xfer;
+}
+
+std::optional<VirtualUSBDevice::XferRef> VirtualUSBDevice::readRef(std::chrono::milliseconds timeout)
+{
+    std::optional<XferRef> xfer;
+    _read(1, timeout, [&] (XferRef&& ref) { xfer = std::move(ref); });
+    return xfer;
+}
+
+size_t VirtualUSBDevice::readMany(std::span<Xfer> xfers, std::chrono::milliseconds timeout)
+{
+    size_t n = 0;
+    return _read(xfers.size(), timeout, [&] (XferRef&& ref) { xfers[n++] = _CopyXfer(std::move(ref)); });
+}
+
+size_t VirtualUSBDevice::readRefMany(std::span<XferRef> xfers, std::chrono::milliseconds timeout)
+{
+    size_t n = 0;
+    return _read(xfers.size(), timeout, [&] (XferRef&& ref) { xfers[n++] = std::move(ref); });
+}
+
+// Reads up to `cap` transfers (see readMany()), passing each to `fn`, and returns how many
+// there were
+size_t VirtualUSBDevice::_read(size_t cap, std::chrono::milliseconds timeout, const std::function<void(XferRef&& xfer)>& fn)
+{
+    // Nowhere to put a transfer, so don't take one
+    if (!cap) return 0;
+    using Deadline = SPSCQueue<_Cmd>::Deadline;
+    const Deadline deadline = (timeout==std::chrono::milliseconds::max() ? Deadline::max() :
+        std::chrono::steady_clock::now()+timeout);
+    
+    size_t n = 0;
     try
     {
-        for (;;)
+        auto readLock = std::unique_lock(_s->readLock);
+        const _IOScope io(this);
+        while (!n)
         {
             // Wait for a command or an error
+            _Cmd cmd;
             for (;;)
             {
                 // Bail if there's an error (and therefore we're stopped)
-                if(_s.err)
-                    std::rethrow_exception(_s.err);
+                if(_s->reset.load(std::memory_order_acquire))
+                    std::rethrow_exception(_s->err);
                 // Break if a command is available
-                if(!_s.cmds.empty())
+                if (_popCmd(cmd))
                     break;
-                // Otherwise wait to get signalled
-                if(timeout == std::chrono::milliseconds::zero())
+                // With the event loop engine, we drive the socket ourself, for whatever's left
+                // of the timeout (socket activity that doesn't produce a transfer, like IN
+                // URBs, mustn't restart it)
+                if (_info.engine == Engine::EventLoop)
                 {
-                    // Check once, which we already did, so bail
-                    return std::nullopt;
+                    std::chrono::milliseconds rem = std::chrono::milliseconds::max();
+                    if (deadline != Deadline::max())
+                        rem = std::max(std::chrono::ceil<std::chrono::milliseconds>(
+                            deadline-std::chrono::steady_clock::now()), std::chrono::milliseconds::zero());
+                    if (!_runEventLoop(rem))
+                        return 0;
+                    continue;
                 }
-                else if(timeout == std::chrono::milliseconds::max())
+                // Check once, which we already did, so bail
+                if(timeout == std::chrono::milliseconds::zero())
+                    return 0;
+                // Wait for the read thread without holding the lock, so that other read()
+                // callers can proceed. We pop after reacquiring the lock, since they may be
+                // waiting too. _reset() closes the queue to wake us.
+                readLock.unlock();
+                const bool ok = _s->cmdQueue.waitPop(deadline);
+                readLock.lock();
+                if (!ok)
+                    return 0;
+            }
+            
+            // Handle it, and the commands queued behind it, until we have `cap` transfers
+            for (;;)
+            {
+                // The receiving side already handled the command if the device has handlers
+                if (cmd.xfer)
                 {
-                    // Wait forever
-                    _s.signal.wait(lock);
+                    fn(std::move(*cmd.xfer));
+                    n++;
                 }
                 else
                 {
-                    // Wait a specific amount of time
-                    const std::cv_status cr = _s.signal.wait_for(lock, timeout);
-                    if (cr == std::cv_status::timeout)
-                        return std::nullopt;
+                    cmd.dequeueTime = std::chrono::steady_clock::now();
+                    _s->cmdsHandled.fetch_add(1, std::memory_order_relaxed);
+                    std::optional<XferRef> xfer = _handleCmd(cmd);
+                    if (xfer)
+                    {
+                        fn(std::move(*xfer));
+                        n++;
+                    }
                 }
+                if (n==cap || !_popCmd(cmd)) break;
             }
-            
-            _Cmd cmd = std::move(_s.cmds.front());
-            _s.cmds.pop_front();
-            
-            auto xfer = _handleCmd(cmd);
-            if(xfer)
-                return std::move(*xfer);
+            _flushReps();
         }
+        return n;
     
     }
     catch (const std::exception& e)
     {
-        _reset(lock, std::current_exception());
+        // If the device is already stopping, whoever stopped it waits for the I/O to stop.
+        // Otherwise wait for it ourself, unless we're called from it (by a handler or
+        // coroutine on the receiving side), since it'd be waiting on us.
+        if (!_s->reset.load(std::memory_order_acquire))
+        {
+            auto lock = std::unique_lock(_s->lock);
+            _reset(lock, std::current_exception(), !_IOScope::Contains(this));
+        }
+        // Return the transfers that we've read; `reset` is set, so the next call fails
+        if (n)
+            return n;
         if (_info.throwOnErr)
         {
-            // Throw `_s.err`, not `e`, so that we throw the original cause (eg ErrStopped)
-            std::rethrow_exception(_s.err);
+            // Throw `_s->err`, not `e`, so that we throw the original cause (eg ErrStopped)
+            std::rethrow_exception(_s->err);
         }
-        return std::nullopt;
+        return 0;
+    }
+}
+
+// Pops the next command that's been received, if there is one, without waiting.
+// _s->readLock must be held.
+bool VirtualUSBDevice::_popCmd(_Cmd& cmd)
+{
+    if (_info.engine == Engine::EventLoop)
+    {
+        if (_s->cmds.empty())
+            return false;
+        cmd = std::move(_s->cmds.front());
+        _s->cmds.pop_front();
+        return true;
     }
+    
+    if (!_s->cmdQueue.tryPop(cmd))
+        return false;
+    // If the worker stopped reading because the queue was full, there's room now
+    if (_info.engine==Engine::WorkerPool && _s->readStalled.load(std::memory_order_relaxed) &&
+        _s->readStalled.exchange(false))
+        _info.workerPool->kick(_s->source);
+    return true;
 }
 
 void VirtualUSBDevice::write(uint8_t ep, const void* data, size_t len)
+{
+    Buffer buf = _SharedPool().alloc(len);
+    // `data` may be null for a zero-length write
+    if (len) memcpy(buf.data(), data, len);
+    write(ep, std::move(buf));
+}
+
+void VirtualUSBDevice::write(uint8_t ep, Buffer data)
 {
     // Must be an IN endpoint
     assert((ep & USB::Endpoint::DirectionMask) == USB::Endpoint::DirectionIn);
     const uint8_t epIdx = ep&USB::Endpoint::IndexMask;
-    assert(epIdx < std::size(_s.inCmds));
+    // Must be an endpoint from the configuration descriptors
+    assert(_s->eps[epIdx]);
     
-    auto lock = std::unique_lock(_s.lock);
     try
     {
         // Bail if there's an error (and therefore we're stopped)
-        if (_s.err)
-            std::rethrow_exception(_s.err);
-        
-        // Enqueue the data into `epInData`
-        auto& epInData = _s.inData[epIdx];
-        _Data d = {
-            .data = std::make_unique<uint8_t[]>(len),
-            .len = len,
-        };
-        memcpy(d.data.get(), data, len);
-        epInData.push_back(std::move(d));
-        // Send the data if there are existing IN transfers
-        _sendDataForInEndpoint(epIdx);
+        if (_s->reset.load(std::memory_order_acquire))
+            std::rethrow_exception(_s->err);
+        
+        // Only this endpoint's lock is needed, so writes to different endpoints don't contend
+        std::vector<std::coroutine_handle<>> ready;
+        {
+            _Endpoint& e = *_s->eps[epIdx];
+            auto epLock = std::unique_lock(e.lock);
+            // Enqueue the data into the endpoint's `inData`
+            e.inDataBytes.fetch_add(data.len(), std::memory_order_relaxed);
+            e.inData.push_back(_Data{
+                .data = std::move(data),
+            });
+            // Send the data if there are existing IN transfers
+            _sendDataForInEndpoint(epIdx);
+            ready.swap(e.ready);
+        }
+        // Resume the send() coroutines whose data went out ahead of ours (before anything
+        // else can throw, so that they aren't stranded)
+        for (std::coroutine_handle<> coro : ready) coro.resume();
+        _flushReps();
     
     }
     catch (const std::exception& e)
     {
-        _reset(lock, std::current_exception());
+        // Like _read()
+        if (!_s->reset.load(std::memory_order_acquire))
+        {
+            auto lock = std::unique_lock(_s->lock);
+            _reset(lock, std::current_exception(), !_IOScope::Contains(this));
+        }
         if (_info.throwOnErr)
         {
-            // Throw `_s.err`, not `e`, so that we throw the original cause (eg ErrStopped)
-            std::rethrow_exception(_s.err);
+            // Throw `_s->err`, not `e`, so that we throw the original cause (eg ErrStopped)
+            std::rethrow_exception(_s->err);
         }
     }
 }
 
+std::vector<BufferPool::Stats> VirtualUSBDevice::poolStats()
+{
+    return _SharedPool().stats();
+}
+
+std::vector<VirtualUSBDevice::LatencyStats> VirtualUSBDevice::latencyStats()
+{
+    std::vector<LatencyStats> stats;
+    for (size_t i=0; i<std::size(_s->epStats); i++)
+    {
+        const std::unique_ptr<_EPStats>& st = _s->epStats[i];
+        if (!st) continue;
+        LatencyStats s = {
+            .ep     = (uint8_t)((i & USB::Endpoint::IndexMask) |
+                (i>=USB::Endpoint::MaxCountOut ? USB::Endpoint::DirectionIn : 0)),
+            .queue  = st->queue.snapshot(),
+            .app    = st->app.snapshot(),
+            .send   = st->send.snapshot(),
+            .total  = st->total.snapshot(),
+        };
+        if (!s.total.count) continue;
+        stats.push_back(std::move(s));
+    }
+    return stats;
+}
+
+VirtualUSBDevice::Stats VirtualUSBDevice::stats()
+{
+    constexpr auto Relaxed = std::memory_order_relaxed;
+    // Load the consumer side of each queue first, so the depths don't go negative
+    Stats stats;
+    stats.errors = _s->errors.load(Relaxed);
+    const uint64_t cmdsHandled = _s->cmdsHandled.load(Relaxed);
+    stats.cmdsReceived = _s->cmdsReceived.load(Relaxed);
+    stats.cmds = stats.cmdsReceived - std::min(cmdsHandled, stats.cmdsReceived);
+    stats.repsSent = _s->repsSent.load(Relaxed);
+    const uint64_t repsQueued = _s->repsQueued.load(Relaxed);
+    stats.reps = repsQueued - std::min(stats.repsSent, repsQueued);
+    
+    for (size_t i=0; i<std::size(_s->epStats); i++)
+    {
+        const std::unique_ptr<_EPStats>& st = _s->epStats[i];
+        if (!st) continue;
+        const bool dirIn = i>=USB::Endpoint::MaxCountOut;
+        const uint8_t epIdx = i & USB::Endpoint::IndexMask;
+        EndpointStats eps = {
+            .ep             = (uint8_t)(epIdx | (dirIn ? USB::Endpoint::DirectionIn : 0)),
+            .urbsSubmitted  = st->urbsSubmitted.load(Relaxed),
+            .urbsCompleted  = st->urbsCompleted.load(Relaxed),
+            .urbsUnlinked   = st->urbsUnlinked.load(Relaxed),
+            .bytes          = st->bytes.load(Relaxed),
+        };
+        if (dirIn && _s->eps[epIdx])
+        {
+            const _Endpoint& e = *_s->eps[epIdx];
+            eps.inCmds = e.inCmdsLen.load(Relaxed);
+            eps.inData = e.inDataLen.load(Relaxed);
+            eps.inDataBytes = e.inDataBytes.load(Relaxed);
+        }
+        stats.eps.push_back(eps);
+    }
+    return stats;
+}
+
+void VirtualUSBDevice::writeTrace(const char* path)
+{
+    if (!_s->trace) throw RUNTIME_ERROR("tracing is disabled");
+    _s->trace->writePcap(path);
+}
+
+uint64_t VirtualUSBDevice::frame() const
+{
+    return (std::chrono::steady_clock::now()-_s->frameEpoch) / _s->framePeriod;
+}
+
+void VirtualUSBDevice::setIsoSource(uint8_t ep, IsoSource fn)
+{
+    // Must be an isochronous IN endpoint
+    assert((ep & USB::Endpoint::DirectionMask) == USB::Endpoint::DirectionIn);
+    _IsoEndpoint*const e = _s->isoEps[_EPAddrIdx(ep & USB::Endpoint::IndexMask, USBIPLib::USBIP_DIR_IN)].get();
+    assert(e);
+    e->source = std::move(fn);
+}
+
+void VirtualUSBDevice::setIsoSink(uint8_t ep, IsoSink fn)
+{
+    // Must be an isochronous OUT endpoint
+    assert((ep & USB::Endpoint::DirectionMask) == USB::Endpoint::DirectionOut);
+    _IsoEndpoint*const e = _s->isoEps[_EPAddrIdx(ep & USB::Endpoint::IndexMask, USBIPLib::USBIP_DIR_OUT)].get();
+    assert(e);
+    e->sink = std::move(fn);
+}
+
+void VirtualUSBDevice::setHandler(uint8_t ep, Handler fn, IOWorkerPool* pool)
+{
+    // Must be an OUT endpoint from the configuration descriptors
+    assert((ep & USB::Endpoint::DirectionMask) == USB::Endpoint::DirectionOut);
+    const size_t idx = _EPAddrIdx(ep & USB::Endpoint::IndexMask, USBIPLib::USBIP_DIR_OUT);
+    assert(_s->epStats[idx]);
+    
+    std::unique_ptr<_Handler>& h = _s->handlers[idx];
+    if (h && h->source) h->pool->remove(h->source);
+    h = std::make_unique<_Handler>();
+    h->fn = std::move(fn);
+    h->pool = pool;
+    if (pool)
+    {
+        _Handler*const hp = h.get();
+        h->source = pool->add(-1, 0, [this, hp] (uint32_t) { return _drainHandler(*hp); });
+    }
+    _s->hasHandlers = true;
+}
+
+VirtualUSBDevice::_ReceiveAwaiter VirtualUSBDevice::receive(uint8_t ep)
+{
+    // Must be an OUT endpoint from the configuration descriptors
+    assert((ep & USB::Endpoint::DirectionMask) == USB::Endpoint::DirectionOut);
+    const size_t idx = _EPAddrIdx(ep & USB::Endpoint::IndexMask, USBIPLib::USBIP_DIR_OUT);
+    assert(_s->epStats[idx]);
+    
+    // The first receive() for the endpoint installs its handler, which must be before start()
+    std::unique_ptr<_Handler>& h = _s->handlers[idx];
+    if (!h)
+    {
+        assert(_s->state == _State::Idle);
+        h = std::make_unique<_Handler>();
+        _s->hasHandlers = true;
+    }
+    // Must not be an endpoint with a setHandler() handler
+    assert(!h->fn);
+    return _ReceiveAwaiter{
+        .dev    = *this,
+        .h      = *h,
+    };
+}
+
+VirtualUSBDevice::_SendAwaiter VirtualUSBDevice::send(uint8_t ep, Buffer data)
+{
+    return _SendAwaiter{
+        .dev    = *this,
+        .ep     = ep,
+        .data   = std::move(data),
+    };
+}
+
+VirtualUSBDevice::_ReceiveAwaiter VirtualUSBDevice::controlRequest()
+{
+    return receive(USB::Endpoint::DefaultOut);
+}
+
+// Returns whether the receive() coroutine suspends: it doesn't if there's a transfer for it
+// already, or if the device has stopped (in which case await_resume() throws)
+bool VirtualUSBDevice::_receiveSuspend(_ReceiveAwaiter& aw, std::coroutine_handle<> coro)
+{
+    _Handler& h = aw.h;
+    auto lock = std::unique_lock(h.lock);
+    if (_s->reset.load(std::memory_order_acquire))
+        return false;
+    
+    if (!h.xfers.empty())
+    {
+        aw.xfer = std::move(h.xfers.front());
+        aw.ok = true;
+        h.xfers.pop_front();
+        return false;
+    }
+    
+    // Only one coroutine at a time may await an endpoint
+    assert(!h.waiter);
+    h.waiter = &aw;
+    h.coro = coro;
+    return true;
+}
+
+// Queues the send() coroutine's data, and returns whether it suspends: it doesn't if the data
+// was sent right away, or if the device has stopped (in which case await_resume() throws)
+bool VirtualUSBDevice::_sendSuspend(_SendAwaiter& aw, std::coroutine_handle<> coro)
+{
+    // Must be an IN endpoint from the configuration descriptors
+    assert((aw.ep & USB::Endpoint::DirectionMask) == USB::Endpoint::DirectionIn);
+    const uint8_t epIdx = aw.ep&USB::Endpoint::IndexMask;
+    assert(_s->eps[epIdx]);
+    _Endpoint& e = *_s->eps[epIdx];
+    
+    // Once the endpoint's lock is released, the coroutine may be resumed by whoever sends its
+    // data, so `aw` is only touched with the lock held
+    std::vector<std::coroutine_handle<>> ready;
+    bool suspend = true;
+    try
+    {
+        {
+            auto epLock = std::unique_lock(e.lock);
+            if (_s->reset.load(std::memory_order_acquire))
+                return false;
+            
+            e.inDataBytes.fetch_add(aw.data.len(), std::memory_order_relaxed);
+            e.inData.push_back(_Data{
+                .data   = std::move(aw.data),
+                .sender = &aw,
+                .coro   = coro,
+            });
+            _sendDataForInEndpoint(epIdx);
+            ready.swap(e.ready);
+        }
+        
+        // If our own data was sent, carry on rather than resuming ourself from here
+        const auto it = std::find(ready.begin(), ready.end(), coro);
+        if (it != ready.end())
+        {
+            ready.erase(it);
+            suspend = false;
+        }
+        for (std::coroutine_handle<> c : ready) c.resume();
+        _flushReps();
+    
+    }
+    catch (const std::exception& err)
+    {
+        // Carry on (and throw from await_resume()) unless our data was sent, in which case
+        // we've been resumed already, or will be
+        {
+            auto epLock = std::unique_lock(e.lock);
+            for (_Data& d : e.inData)
+            {
+                if (d.sender != &aw) continue;
+                d.sender = nullptr;
+                suspend = false;
+            }
+        }
+        // Don't wait for the I/O to stop, since we may be running on it
+        auto lock = std::unique_lock(_s->lock);
+        _reset(lock, std::current_exception(), false);
+    }
+    return suspend;
+}
+
+// Resumes the coroutines that are waiting in receive() or send(), whose co_await throws the
+// device's error. Called by _reset() once `reset` is set (so no more coroutines wait), without
+// any locks held.
+void VirtualUSBDevice::_wakeCoroutines()
+{
+    std::vector<std::coroutine_handle<>> coros;
+    for (const std::unique_ptr<_Handler>& h : _s->handlers)
+    {
+        if (!h) continue;
+        auto lock = std::unique_lock(h->lock);
+        if (!h->waiter) continue;
+        coros.push_back(h->coro);
+        h->waiter = nullptr;
+    }
+    
+    for (const std::unique_ptr<_Endpoint>& e : _s->eps)
+    {
+        if (!e) continue;
+        auto epLock = std::unique_lock(e->lock);
+        for (_Data& d : e->inData)
+        {
+            if (!d.sender) continue;
+            coros.push_back(d.coro);
+            d.sender = nullptr;
+        }
+        // These were sent, so they carry on normally
+        coros.insert(coros.end(), e->ready.begin(), e->ready.end());
+        e->ready.clear();
+    }
+    
+    for (std::coroutine_handle<> coro : coros) coro.resume();
+}
+
+void VirtualUSBDevice::Task::promise_type::unhandled_exception()
+{
+    // Coroutines waiting on the device end with its error once it resets. Stopping the device
+    // is the expected way for them to end; anything else is a failure worth reporting.
+    try
+    {
+        throw;
+    }
+    catch (const std::exception& e)
+    {
+        if (std::current_exception() == ErrStopped)
+            LOG_DEBUG("VirtualUSBDevice: coroutine ended: %s", e.what());
+        else
+            LOG_ERROR("VirtualUSBDevice: coroutine failed: %s", e.what());
+    }
+    catch (...)
+    {
+        LOG_ERROR("VirtualUSBDevice: coroutine failed: unknown exception");
+    }
+}
+
+void VirtualUSBDevice::_throwErr()
+{
+    // `err` doesn't change once `reset` is set, which it is if a co_await failed
+    std::rethrow_exception(_s->err);
+}
+
+VirtualUSBDevice::_Time VirtualUSBDevice::_frameTime(uint64_t frame) const
+{
+    return _s->frameEpoch + frame*_s->framePeriod;
+}
+
 std::exception_ptr VirtualUSBDevice::err()
 {
-    auto lock = std::unique_lock(_s.lock);
-    return _s.err;
+    auto lock = std::unique_lock(_s->lock);
+    return _s->err;
 }
 
 USB::SetupRequest VirtualUSBDevice::_GetSetupRequest(const _Cmd& cmd) const
@@ -237,22 +1025,23 @@ uint8_t VirtualUSBDevice::_GetEndpointAddr(const _Cmd& cmd)
     return ep;
 }
 
-void VirtualUSBDevice::_Read(int socket, void* data, size_t len)
+ssize_t VirtualUSBDevice::_Recv(int socket, void* data, size_t len)
 {
-    size_t off = 0;
-    while (off < len)
+    for (;;)
     {
-        ssize_t sr = recv(socket, (uint8_t*)data+off, len-off, 0);
+        ssize_t sr = recv(socket, data, len, 0);
         if (!sr)
             throw RUNTIME_ERROR("recv returned 0");
         if (sr < 0)
         {
             if (errno == EINTR)
                 continue;
+            else if (errno==EAGAIN || errno==EWOULDBLOCK)
+                return -1;
             else
                 throw RUNTIME_ERROR("recv failed: %s", strerror(errno));
         }
-        off += sr;
+        return sr;
     }
 }
 
@@ -261,7 +1050,7 @@ void VirtualUSBDevice::_Write(int socket, const void* data, size_t len)
     size_t off = 0;
     while (off < len)
     {
-        ssize_t sr = send(socket, (uint8_t*)data+off, len-off, MSG_NOSIGNAL);
+        ssize_t sr = ::send(socket, (uint8_t*)data+off, len-off, MSG_NOSIGNAL);
         if (!sr)
             throw RUNTIME_ERROR("send returned 0");
         if (sr < 0)
@@ -275,11 +1064,342 @@ void VirtualUSBDevice::_Write(int socket, const void* data, size_t len)
     }
 }
 
-VirtualUSBDevice::_Cmd VirtualUSBDevice::_ReadCmd(int socket)
+void VirtualUSBDevice::_GatherReps(const std::deque<_Rep>& reps, size_t off, std::vector<iovec>& iov)
+{
+    // Gather the headers, payloads and isochronous packet descriptors of as many replies as
+    // fit in one sendmsg(), skipping the first `off` bytes (which were sent previously)
+    iov.clear();
+    for (const _Rep& rep : reps)
+    {
+        if (iov.size()+3 > IOV_MAX) break;
+        const iovec parts[] = {
+            {(void*)&rep.header, sizeof(rep.header)},
+            {(void*)rep.payload.data(), rep.payloadLen},
+            {(void*)rep.iso.data(), rep.iso.len()},
+        };
+        for (iovec part : parts)
+        {
+            if (off >= part.iov_len)
+            {
+                off -= part.iov_len;
+                continue;
+            }
+            part.iov_base = (uint8_t*)part.iov_base + off;
+            part.iov_len -= off;
+            off = 0;
+            iov.push_back(part);
+        }
+    }
+}
+
+void VirtualUSBDevice::_popReps(std::deque<_Rep>& reps, size_t& off, size_t len)
+{
+    // Pop the replies that were sent completely, and remember how much of the next one
+    // was sent
+    const _Time sentTime = std::chrono::steady_clock::now();
+    len += off;
+    while (!reps.empty())
+    {
+        const _Rep& rep = reps.front();
+        const size_t repLen = sizeof(rep.header) + rep.payloadLen + rep.iso.len();
+        if (len < repLen) break;
+        len -= repLen;
+        _recordCompletion(reps.front(), sentTime);
+        _s->repsSent.fetch_add(1, std::memory_order_relaxed);
+        reps.pop_front();
+    }
+    off = len;
+}
+
+bool VirtualUSBDevice::_sendReps(int socket, std::deque<_Rep>& reps, size_t& off, std::vector<iovec>& iov)
+{
+    while (!reps.empty())
+    {
+        _GatherReps(reps, off, iov);
+        msghdr msg = {
+            .msg_iov = iov.data(),
+            .msg_iovlen = iov.size(),
+        };
+        ssize_t sr = sendmsg(socket, &msg, MSG_NOSIGNAL);
+        if (!sr)
+            throw RUNTIME_ERROR("sendmsg returned 0");
+        if (sr < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            else if (errno==EAGAIN || errno==EWOULDBLOCK)
+                return false;
+            else
+                throw RUNTIME_ERROR("sendmsg failed: %s", strerror(errno));
+        }
+        _popReps(reps, off, sr);
+    }
+    return true;
+}
+
+// io_uring counterpart of _sendReps(), which doesn't wait for the kernel unless `wait` is set:
+// it reaps the in-flight SENDMSG if it's complete, and issues the next one for the replies that
+// remain. Only one SENDMSG is in flight at a time, since the kernel may reorder concurrent sends
+// to a stream socket. Returns whether one is in flight.
+bool VirtualUSBDevice::_sendReps(IOURing& ring, std::deque<_Rep>& reps, size_t& off, _URingSend& send, bool wait)
+{
+    for (;;)
+    {
+        if (send.inFlight)
+        {
+            const io_uring_cqe* cqe = ring.cqe();
+            if (!cqe)
+            {
+                if (!wait) return true;
+                ring.submit(1);
+                continue;
+            }
+            
+            const int32_t res = cqe->res;
+            ring.cqeSeen();
+            send.inFlight = false;
+            if (!res)
+                throw RUNTIME_ERROR("IORING_OP_SENDMSG returned 0");
+            if (res<0 && res!=-EINTR)
+                throw RUNTIME_ERROR("IORING_OP_SENDMSG failed: %s", strerror(-res));
+            if (res > 0)
+                _popReps(reps, off, res);
+        }
+        
+        if (reps.empty()) return false;
+        
+        _GatherReps(reps, off, send.iov);
+        send.msg = {
+            .msg_iov = send.iov.data(),
+            .msg_iovlen = send.iov.size(),
+        };
+        io_uring_sqe& sqe = ring.sqe();
+        sqe.opcode = IORING_OP_SENDMSG;
+        sqe.fd = _URingSocket;
+        sqe.flags = IOSQE_FIXED_FILE;
+        sqe.addr = (uint64_t)(uintptr_t)&send.msg;
+        sqe.msg_flags = MSG_NOSIGNAL|MSG_WAITALL;
+        send.inFlight = true;
+        // The SQ poll thread picks up the SQE without a syscall. Otherwise submit it and reap
+        // its completion with a single io_uring_enter().
+        ring.submit(ring.sqpoll() ? 0 : 1);
+    }
+}
+
+// Moves the replies that are ready into `reps`, without waiting. Returns whether there were any.
+bool VirtualUSBDevice::_collectReps(std::deque<_Rep>& reps)
+{
+    const size_t count = reps.size();
+    _Rep rep;
+    while (_s->repQueue.tryPop(rep)) reps.push_back(std::move(rep));
+    // Then the replies that overflowed the queue (see _queueRep()), which follow those in it
+    auto repLock = std::unique_lock(_s->repLock);
+    for (_Rep& r : _s->repsOverflow) reps.push_back(std::move(r));
+    _s->repsOverflow.clear();
+    return reps.size() != count;
+}
+
+size_t VirtualUSBDevice::_EPAddrIdx(uint32_t ep, uint32_t dir)
+{
+    // OUT endpoints first, then IN endpoints
+    return (dir==USBIPLib::USBIP_DIR_IN ? USB::Endpoint::MaxCountOut : 0) + ep;
+}
+
+USBIP::HEADER VirtualUSBDevice::_BFHHeader(const USBIP::HEADER& h)
+{
+    using namespace Endian;
+    USBIP::HEADER r = {};
+    r.base = {
+        .command    = BFH_U32(h.base.command),
+        .seqnum     = BFH_U32(h.base.seqnum),
+        .devid      = BFH_U32(h.base.devid),
+        .direction  = BFH_U32(h.base.direction),
+        .ep         = BFH_U32(h.base.ep),
+    };
+    
+    switch (h.base.command)
+    {
+        case USBIPLib::USBIP_RET_SUBMIT:
+            r.ret_submit = {
+                .status             = BFH_S32(h.ret_submit.status),
+                .actual_length      = BFH_S32(h.ret_submit.actual_length),
+                .start_frame        = BFH_S32(h.ret_submit.start_frame),
+                .number_of_packets  = BFH_S32(h.ret_submit.number_of_packets),
+                .error_count        = BFH_S32(h.ret_submit.error_count),
+            };
+            break;
+        
+        case USBIPLib::USBIP_RET_UNLINK:
+            r.ret_unlink.status = BFH_S32(h.ret_unlink.status);
+            break;
+        
+        default:
+            throw RUNTIME_ERROR("invalid reply command: %u", h.base.command);
+    }
+    return r;
+}
+
+void VirtualUSBDevice::_trace(const USBIP::HEADER& header, const uint8_t* payload, size_t payloadLen,
+    const uint8_t* iso, size_t isoLen)
+{
+    if (_info.recorder) _info.recorder->record(header, payload, payloadLen, iso, isoLen);
+    if (!_s->trace) return;
+    const uint8_t xferType = (header.base.ep<=USB::Endpoint::IndexMask ?
+        _s->xferTypes[_EPAddrIdx(header.base.ep, header.base.direction)] : 0);
+    _s->trace->record(header, xferType, payload, payloadLen);
+}
+    
+    // Called by whoever receives commands, for the commands in `cmds` from index `off` on
+void VirtualUSBDevice::_cmdsReceived(std::deque<_Cmd>& cmds, size_t off)
+{
+    _s->cmdsReceived.fetch_add(cmds.size()-off, std::memory_order_relaxed);
+    for (size_t i=off; i<cmds.size(); i++)
+    {
+        _Cmd& cmd = cmds[i];
+        // The payload was received along with the isochronous packet descriptors that
+        // follow it, so split them off
+        if (cmd.header.base.command==USBIPLib::USBIP_CMD_SUBMIT && cmd.header.cmd_submit.number_of_packets)
+        {
+            const size_t isoLen = cmd.header.cmd_submit.number_of_packets * sizeof(USBIP::ISO_PACKET_DESCRIPTOR);
+            cmd.payloadLen -= isoLen;
+            cmd.iso = cmd.payload.slice(cmd.payloadLen, isoLen);
+            cmd.payload = (cmd.payloadLen ? cmd.payload.slice(0, cmd.payloadLen) : Buffer());
+        }
+        _trace(cmd.header, cmd.payload.data(), cmd.payloadLen, cmd.iso.data(), cmd.iso.len());
+    }
+}
+
+// Handles the commands in `cmds` (from `off` onward), handing their transfers to their
+// endpoints' handlers, and leaves the transfers to endpoints without handlers in `cmds` for
+// read(). Called on the receiving side, right after _cmdsReceived(). Handling every command
+// here (not just those with handlers) means that a device whose endpoints all have handlers
+// doesn't depend on read() being called.
+void VirtualUSBDevice::_dispatchCmds(std::deque<_Cmd>& cmds, size_t off)
+{
+    if (!_s->hasHandlers) return;
+    
+    size_t keep = off;
+    for (size_t i=off; i<cmds.size(); i++)
+    {
+        _Cmd& cmd = cmds[i];
+        cmd.dequeueTime = std::chrono::steady_clock::now();
+        _s->cmdsHandled.fetch_add(1, std::memory_order_relaxed);
+        std::optional<XferRef> xfer = _handleCmd(cmd);
+        if (!xfer) continue;
+        
+        // Transfers to the default control endpoint are requests, in either direction
+        const bool dirOut = !(xfer->ep & USB::Endpoint::DirectionMask);
+        _Handler*const h = (dirOut ?
+            _s->handlers[_EPAddrIdx(xfer->ep & USB::Endpoint::IndexMask, USBIPLib::USBIP_DIR_OUT)].get() :
+            nullptr);
+        if (!h)
+        {
+            cmd.xfer = std::move(xfer);
+            if (i != keep) cmds[keep] = std::move(cmd);
+            keep++;
+            continue;
+        }
+        _deliver(*h, std::move(*xfer));
+    }
+    cmds.erase(cmds.begin()+keep, cmds.end());
+    _flushReps();
+}
+
+// Hands `xfer` to handler `h`: calls it, queues it for the handler's pool, or resumes the
+// coroutine that's awaiting it
+void VirtualUSBDevice::_deliver(_Handler& h, XferRef&& xfer)
+{
+    if (h.fn && !h.pool)
+    {
+        h.fn(std::move(xfer));
+        return;
+    }
+    
+    auto lock = std::unique_lock(h.lock);
+    if (h.pool)
+    {
+        h.xfers.push_back(std::move(xfer));
+        lock.unlock();
+        h.pool->kick(h.source);
+        return;
+    }
+    
+    if (!h.waiter)
+    {
+        h.xfers.push_back(std::move(xfer));
+        return;
+    }
+    _ReceiveAwaiter& aw = *h.waiter;
+    const std::coroutine_handle<> coro = h.coro;
+    h.waiter = nullptr;
+    aw.xfer = std::move(xfer);
+    aw.ok = true;
+    lock.unlock();
+    coro.resume();
+}
+
+// The pool source callback of handler `h`: calls it for the queued transfers
+uint32_t VirtualUSBDevice::_drainHandler(_Handler& h)
+{
+    const _IOScope io(this);
+    try
+    {
+        for (size_t i=0; i<_WorkerReadsMax; i++)
+        {
+            if (_s->reset.load(std::memory_order_acquire))
+                return 0;
+            
+            XferRef xfer;
+            {
+                auto lock = std::unique_lock(h.lock);
+                if (h.xfers.empty()) return 0;
+                xfer = std::move(h.xfers.front());
+                h.xfers.pop_front();
+            }
+            h.fn(std::move(xfer));
+        }
+        
+        // Let the pool's other sources have a turn
+        h.pool->kick(h.source);
+        return 0;
+    
+    }
+    catch (const std::exception& e)
+    {
+        // Don't wait for the I/O to stop, since remove() would wait on us
+        auto lock = std::unique_lock(_s->lock);
+        _reset(lock, std::current_exception(), false);
+        return 0;
+    }
+}
+
+void VirtualUSBDevice::_recordCompletion(const _Rep& rep, _Time sentTime)
+{
+    using namespace Endian;
+    // Only URBs are counted (the reply's header is already big endian)
+    if (HFB_U32(rep.header.base.command) != USBIPLib::USBIP_RET_SUBMIT) return;
+    const uint32_t ep = HFB_U32(rep.header.base.ep);
+    if (ep > USB::Endpoint::IndexMask) return;
+    _EPStats*const st = _s->epStats[_EPAddrIdx(ep, HFB_U32(rep.header.base.direction))].get();
+    if (!st) return;
+    
+    st->urbsCompleted.fetch_add(1, std::memory_order_relaxed);
+    st->bytes.fetch_add(HFB_S32(rep.header.ret_submit.actual_length), std::memory_order_relaxed);
+    
+    auto ns = [](_Time a, _Time b) {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(b-a).count();
+    };
+    st->queue.record(ns(rep.recvTime, rep.dequeueTime));
+    st->app.record(ns(rep.dequeueTime, rep.replyTime));
+    st->send.record(ns(rep.replyTime, sentTime));
+    st->total.record(ns(rep.recvTime, sentTime));
+}
+
+VirtualUSBDevice::_Cmd VirtualUSBDevice::_ParseCmd(const void* data, const uint8_t* xferTypes)
 {
     using namespace Endian;
     _Cmd cmd;
-    _Read(socket, &cmd.header, sizeof(cmd.header));
+    memcpy(&cmd.header, data, sizeof(cmd.header));
     
     // Big endian -> host endian
     cmd.header.base = {
@@ -302,11 +1422,11 @@ VirtualUSBDevice::_Cmd VirtualUSBDevice::_ReadCmd(int socket)
                 .setup                      = {.u64 = cmd.header.cmd_submit.setup.u64 }, // stream of bytes -- don't change
             };
             break;
-    
+        
         case USBIPLib::USBIP_CMD_UNLINK:
             cmd.header.cmd_unlink.seqnum = HFB_U32(cmd.header.cmd_unlink.seqnum);
             break;
-    
+        
         default:
             throw RUNTIME_ERROR("unknown USBIP command: %u", (uint32_t)cmd.header.base.command);
     }
@@ -318,13 +1438,219 @@ VirtualUSBDevice::_Cmd VirtualUSBDevice::_ReadCmd(int socket)
         cmd.payloadLen = cmd.header.cmd_submit.transfer_buffer_length;
     }
     
-    if (cmd.payloadLen)
+    if (cmd.header.base.command == USBIPLib::USBIP_CMD_SUBMIT)
+    {
+        // Only isochronous URBs carry packet descriptors; Linux sends number_of_packets=-1
+        // (or 0) for the others, so normalize it to 0 for everyone downstream
+        const uint32_t ep = cmd.header.base.ep;
+        const bool iso = (ep<=USB::Endpoint::IndexMask &&
+            xferTypes[_EPAddrIdx(ep, cmd.header.base.direction)]==_XferTypeIsochronous);
+        int32_t packets = cmd.header.cmd_submit.number_of_packets;
+        if (!iso || packets==-1) packets = 0;
+        if (packets<0 || (size_t)packets>_IsoPacketsMax)
+            throw RUNTIME_ERROR("invalid number_of_packets: %d", packets);
+        cmd.header.cmd_submit.number_of_packets = packets;
+        // Isochronous packet descriptors follow the payload. They're received as part of the
+        // payload, and split off by _cmdsReceived().
+        cmd.payloadLen += packets * sizeof(USBIP::ISO_PACKET_DESCRIPTOR);
+    }
+    
+    return cmd;
+}
+
+void VirtualUSBDevice::_ParseCmds(_RecvBuf& rb, const uint8_t* data, size_t len, const Buffer& src, std::deque<_Cmd>& cmds)
+{
+    // Commands are timestamped once they've been received completely
+    const _Time recvTime = std::chrono::steady_clock::now();
+    while (len)
+    {
+        // Finish the pending command's payload
+        if (rb.cmd)
+        {
+            _Cmd& cmd = *rb.cmd;
+            const size_t l = std::min(len, cmd.payloadLen-rb.payloadOff);
+            memcpy(cmd.payload.data()+rb.payloadOff, data, l);
+            rb.payloadOff += l;
+            data += l;
+            len -= l;
+            // Bail if we ran out of data before the payload was complete
+            if (rb.payloadOff < cmd.payloadLen) break;
+            cmd.recvTime = recvTime;
+            cmds.push_back(std::move(cmd));
+            rb.cmd = std::nullopt;
+            continue;
+        }
+        
+        // Parse the header in place if it's complete, otherwise accumulate it in `rb.hdr`
+        const uint8_t* hdr = data;
+        if (rb.hdrLen || len<sizeof(rb.hdr))
+        {
+            const size_t l = std::min(len, sizeof(rb.hdr)-rb.hdrLen);
+            memcpy(&rb.hdr[rb.hdrLen], data, l);
+            rb.hdrLen += l;
+            data += l;
+            len -= l;
+            // Bail if we ran out of data before the header was complete
+            if (rb.hdrLen < sizeof(rb.hdr)) break;
+            hdr = rb.hdr;
+            rb.hdrLen = 0;
+        }
+        else
+        {
+            data += sizeof(rb.hdr);
+            len -= sizeof(rb.hdr);
+        }
+        
+        _Cmd cmd = _ParseCmd(hdr, rb.xferTypes);
+        cmd.recvTime = recvTime;
+        if (cmd.payloadLen && src && len>=cmd.payloadLen)
+        {
+            // The payload was received in its entirety into `src`: reference it directly
+            cmd.payload = src.slice(data-src.data(), cmd.payloadLen);
+            data += cmd.payloadLen;
+            len -= cmd.payloadLen;
+            cmds.push_back(std::move(cmd));
+        }
+        else if (cmd.payloadLen)
+        {
+            // The payload is incomplete (or we can't reference `data`), so copy it into its
+            // own buffer as it arrives
+            cmd.payload = rb.pool->alloc(cmd.payloadLen);
+            rb.cmd = std::move(cmd);
+            rb.payloadOff = 0;
+        }
+        else
+        {
+            cmds.push_back(std::move(cmd));
+        }
+    }
+}
+
+bool VirtualUSBDevice::_ReadCmds(int socket, _RecvBuf& rb, std::deque<_Cmd>& cmds)
+{
+    // If we're in the middle of a large payload, receive the rest of it directly into the
+    // payload buffer instead of bouncing it through `rb.block`
+    if (rb.cmd)
+    {
+        _Cmd& cmd = *rb.cmd;
+        const size_t rem = cmd.payloadLen-rb.payloadOff;
+        if (rem >= _RecvBuf::DirectLen)
+        {
+            const ssize_t sr = _Recv(socket, cmd.payload.data()+rb.payloadOff, rem);
+            if (sr < 0) return false;
+            rb.payloadOff += sr;
+            if (rb.payloadOff == cmd.payloadLen)
+            {
+                cmd.recvTime = std::chrono::steady_clock::now();
+                cmds.push_back(std::move(cmd));
+                rb.cmd = std::nullopt;
+            }
+            return true;
+        }
+    }
+    
+    // Payloads that we parse reference `rb.block`, so it can only be reused once every
+    // payload referencing it has been released. Otherwise switch to a fresh block from the
+    // pool once there isn't much space left in the current one.
+    if (rb.block.unique())
     {
-        cmd.payload = std::make_unique<uint8_t[]>(cmd.payloadLen);
-        _Read(socket, cmd.payload.get(), cmd.payloadLen);
+        rb.blockOff = 0;
+    }
+    else if (!rb.block || rb.block.len()-rb.blockOff<_RecvBuf::MinRecvLen)
+    {
+        rb.block = rb.pool->alloc(_RecvBuf::Cap);
+        rb.blockOff = 0;
+    }
+    
+    // Receive whatever the socket has available, and parse as many commands as we can
+    uint8_t*const data = rb.block.data()+rb.blockOff;
+    const ssize_t sr = _Recv(socket, data, rb.block.len()-rb.blockOff);
+    if (sr < 0) return false;
+    rb.blockOff += sr;
+    _ParseCmds(rb, data, sr, rb.block, cmds);
+    return true;
+}
+
+void VirtualUSBDevice::_ReadCmds(IOURing& ring, _RecvBuf& rb, std::deque<_Cmd>& cmds)
+{
+    // Provide our buffers the first time around
+    if (rb.ringBufs.empty())
+    {
+        rb.ringBufs.resize(_URingBufCount);
+        for (uint16_t bid=0; bid<_URingBufCount; bid++)
+        {
+            rb.ringBufs[bid] = rb.pool->alloc(_URingBufLen);
+            ring.bufProvide(bid, rb.ringBufs[bid].data(), rb.ringBufs[bid].len());
+        }
+    }
+    
+    // Arm the multishot receive. It stays armed (generating a CQE whenever data arrives,
+    // using our provided buffers) until the kernel reports otherwise.
+    if (!rb.recvArmed)
+    {
+        io_uring_sqe& sqe = ring.sqe();
+        sqe.opcode = IORING_OP_RECV;
+        sqe.fd = _URingSocket;
+        sqe.ioprio = IORING_RECV_MULTISHOT;
+        sqe.flags = IOSQE_FIXED_FILE|IOSQE_BUFFER_SELECT;
+        sqe.buf_group = _URingBufGroup;
+        rb.recvArmed = true;
+    }
+    
+    // Only enter the kernel if there aren't any completions already
+    if (!ring.cqe())
+        ring.submit(1);
+    
+    while (const io_uring_cqe* cqe = ring.cqe())
+    {
+        const int32_t res = cqe->res;
+        const uint32_t flags = cqe->flags;
+        ring.cqeSeen();
+        
+        if (!(flags & IORING_CQE_F_MORE))
+            rb.recvArmed = false;
+        
+        if (!res)
+            throw RUNTIME_ERROR("recv returned 0");
+        if (res < 0)
+        {
+            // ENOBUFS: we ran out of provided buffers; they're recycled below, so just re-arm
+            if (res==-ENOBUFS || res==-EINTR)
+                continue;
+            else
+                throw RUNTIME_ERROR("recv failed: %s", strerror(-res));
+        }
+        
+        // Payloads that arrived in one piece reference the buffer instead of being copied out
+        // of it. Give the buffer back to the kernel if nothing references it, and a fresh one
+        // in its place otherwise.
+        const uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        Buffer& buf = rb.ringBufs[bid];
+        _ParseCmds(rb, buf.data(), res, buf, cmds);
+        if (!buf.unique()) buf = rb.pool->alloc(_URingBufLen);
+        ring.bufProvide(bid, buf.data(), buf.len());
+    }
+}
+
+// Waits for the multishot receive to end, since the kernel may write to the provided buffers
+// until it does. _reset() ends it by shutting down the socket.
+void VirtualUSBDevice::_ReadCmdsEnd(IOURing& ring, _RecvBuf& rb)
+{
+    while (rb.recvArmed)
+    {
+        if (!ring.cqe()) ring.submit(1);
+        while (const io_uring_cqe* cqe = ring.cqe())
+        {
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+                rb.recvArmed = false;
+            ring.cqeSeen();
+        }
     }
-    
-    return cmd;
+}
+
+uint32_t VirtualUSBDevice::speed() const
+{
+    return _SpeedFromBCDUSB(_info.deviceDesc->bcdDevice);
 }
 
 uint32_t VirtualUSBDevice::_SpeedFromBCDUSB(uint16_t bcdUSB)
@@ -381,180 +1707,480 @@ bool VirtualUSBDevice::_SelfPowered(const USB::ConfigurationDescriptor& d)
 
 void VirtualUSBDevice::_readThread()
 {
+    const _IOScope io(this);
     int socket = -1;
     // Copy the socket so we can reference it without the lock.
     // The _reset() logic ensures that the socket won't be closed until this thread exits.
-    auto lock = std::unique_lock(_s.lock);
-    socket = _s.socket;
+    auto lock = std::unique_lock(_s->lock);
+    socket = _s->socket;
+    std::unique_ptr<IOURing> ring = std::move(_s->readRing);
     lock.unlock();
     
+    _RecvBuf rb = {.pool = &_SharedPool(), .xferTypes = _s->xferTypes};
+    std::deque<_Cmd> cmds;
+    
     try
     {
-        for (;;)
+        for (bool closed=false; !closed;)
         {
-            _Cmd cmd = _ReadCmd(socket);
+            if (ring) _ReadCmds(*ring, rb, cmds);
+            else      _ReadCmds(socket, rb, cmds);
+            _cmdsReceived(cmds, 0);
+            _dispatchCmds(cmds, 0);
             
-            lock.lock();
-            _s.cmds.push_back(std::move(cmd));
-            _s.signal.notify_all();
-            lock.unlock();
+            // Hand off the commands without taking the lock. If the queue is full, this
+            // waits for read() to catch up. The queue is closed by _reset().
+            for (_Cmd& cmd : cmds)
+            {
+                closed = !_s->cmdQueue.push(std::move(cmd));
+                if (closed) break;
+            }
+            cmds.clear();
         }
     
     }
     catch (const std::exception& e)
     {
+        // Don't wait for the I/O to stop, since we're part of it
         lock.lock();
-        _reset(lock, std::current_exception());
+        _reset(lock, std::current_exception(), false);
         lock.unlock();
     }
     
+    if (ring)
+    {
+        try
+        {
+            _ReadCmdsEnd(*ring, rb);
+        }
+        catch (const std::exception& e)
+        {
+            // The kernel may still write to the provided buffers, so leak them rather than
+            // letting them be reused
+            LOG_ERROR("VirtualUSBDevice: failed to end io_uring receive: %s", e.what());
+            new std::vector<Buffer>(std::move(rb.ringBufs));
+        }
+    }
+    
+    // `this` may be destroyed as soon as we clear our flag and release the lock
     lock.lock();
-    _s.state &= ~_State::ReadThreadRunning;
-    _s.signal.notify_all();
+    _s->state &= ~_State::ReadThreadRunning;
+    _s->signal.notify_all();
     lock.unlock();
     
-    printf("VirtualUSBDevice: _readThread() exiting\n");
+    LOG_DEBUG("VirtualUSBDevice: _readThread() exiting");
 }
 
 void VirtualUSBDevice::_writeThread()
 {
+    const _IOScope io(this);
     int socket = -1;
     // Copy the socket so we can reference it without the lock.
     // The _reset() logic ensures that the socket won't be closed until this thread exits.
-    auto lock = std::unique_lock(_s.lock);
-    socket = _s.socket;
+    auto lock = std::unique_lock(_s->lock);
+    socket = _s->socket;
+    std::unique_ptr<IOURing> ring = std::move(_s->writeRing);
     lock.unlock();
     
+    // Kept across iterations so their storage gets reused
+    std::deque<_Rep> reps;
+    std::vector<iovec> iov;
+    _URingSend send;
+    
     try
     {
-        for (;;)
+        // Wait for a reply; the queue is closed by _reset()
+        _Rep rep;
+        while (_s->repQueue.pop(rep))
         {
-            auto lock = std::unique_lock(_s.lock);
-            for (;;)
+            // Dequeue every available reply in one go
+            reps.push_back(std::move(rep));
+            _collectReps(reps);
+            
+            // Send all the replies with as few syscalls as possible
+            size_t off = 0;
+            if (ring)
             {
-                // Bail if there's an error (and therefore we're stopped)
-                if (_s.err) std::rethrow_exception(_s.err);
-                // Break if a reply is available
-                if (!_s.reps.empty()) break;
-                // Otherwise wait to get signalled
-                _s.signal.wait(lock);
+                // Keep issuing the replies as they arrive, without waiting for the kernel to
+                // send them. Only wait once there are no more, before waiting for the next.
+                bool more = true;
+                while (_sendReps(*ring, reps, off, send, !more))
+                    more = _collectReps(reps);
+            }
+            else
+            {
+                _sendReps(socket, reps, off, iov);
             }
-            
-            // Dequeue the reply
-            _Rep rep = std::move(_s.reps.front());
-            _s.reps.pop_front();
-            lock.unlock();
-            
-            _Write(socket, &rep.header, sizeof(rep.header));
-            _Write(socket, rep.payload.get(), rep.payloadLen);
         }
     
     }
     catch (const std::exception& e)
     {
+        // Unblock a _reply() that's waiting for us to make room in the queue
+        _s->repQueue.close();
+        // Don't wait for the I/O to stop, since we're part of it
         lock.lock();
-        _reset(lock, std::current_exception());
+        _reset(lock, std::current_exception(), false);
         lock.unlock();
     }
     
+    // `this` may be destroyed as soon as we clear our flag and release the lock
     lock.lock();
-    _s.state &= ~_State::WriteThreadRunning;
-    _s.signal.notify_all();
+    _s->state &= ~_State::WriteThreadRunning;
+    _s->signal.notify_all();
     lock.unlock();
     
-    printf("VirtualUSBDevice: _writeThread() exiting\n");
+    LOG_DEBUG("VirtualUSBDevice: _writeThread() exiting");
+}
+
+// Completes the URBs of isochronous endpoint `idx` whose last frame has passed, and re-arms
+// its timer for the next one. Called on the timer wheel's thread.
+void VirtualUSBDevice::_isoTimer(size_t idx)
+{
+    const _IOScope io(this);
+    _IsoEndpoint& e = *_s->isoEps[idx];
+    try
+    {
+        if (_s->reset.load(std::memory_order_acquire)) return;
+        
+        {
+            auto isoLock = std::unique_lock(_s->isoLock);
+            const _Time now = std::chrono::steady_clock::now();
+            while (!e.urbs.empty() && e.urbs.front().deadline<=now)
+            {
+                e.due.push_back(std::move(e.urbs.front()));
+                e.urbs.pop_front();
+            }
+            if (!e.urbs.empty()) _SharedWheel().schedule(*e.timer, e.urbs.front().deadline);
+        }
+        
+        // Complete the URBs without the lock, since the app's stream functions run here
+        for (const _IsoUrb& urb : e.due)
+            _completeIso(urb);
+        e.due.clear();
+        _flushReps();
+    
+    }
+    catch (const std::exception& err)
+    {
+        e.due.clear();
+        // Don't wait for the I/O to stop, since the wheel would be waiting on itself
+        auto lock = std::unique_lock(_s->lock);
+        _reset(lock, std::current_exception(), false);
+    }
+}
+
+// Sends a transfer from interrupt IN endpoint `epIdx`, for the host's poll that's due now, and
+// re-arms its timer if there's more to send. Called on the timer wheel's thread.
+void VirtualUSBDevice::_pollInEndpoint(uint8_t epIdx)
+{
+    const _IOScope io(this);
+    _Endpoint& e = *_s->eps[epIdx];
+    try
+    {
+        if (_s->reset.load(std::memory_order_acquire)) return;
+        
+        std::vector<std::coroutine_handle<>> ready;
+        {
+            auto epLock = std::unique_lock(e.lock);
+            // One transaction per poll
+            if (!e.inCmds.empty() && !e.inData.empty()) _sendInXfer(epIdx);
+            _schedulePoll(epIdx);
+            e.publish();
+            ready.swap(e.ready);
+        }
+        // Resume the send() coroutines whose data was sent
+        for (std::coroutine_handle<> coro : ready) coro.resume();
+        _flushReps();
+    
+    }
+    catch (const std::exception& err)
+    {
+        auto lock = std::unique_lock(_s->lock);
+        _reset(lock, std::current_exception(), false);
+    }
+}
+    
+    // _s->readLock must be held
+bool VirtualUSBDevice::_runEventLoop(std::chrono::milliseconds timeout)
+{
+    const int timeoutMs = (timeout==std::chrono::milliseconds::max() ? -1 :
+        (int)std::min(timeout.count(), (std::chrono::milliseconds::rep)INT_MAX));
+    
+    // Wait for socket activity. write() doesn't need `readLock`, so it can proceed meanwhile.
+    // _reset() shuts the socket down to wake us, and takes `readLock` before closing the
+    // file descriptors.
+    epoll_event ev = {};
+    const int ir = epoll_wait(_s->epollFD, &ev, 1, timeoutMs);
+    const int epollErrno = errno;
+    // If _reset() woke us, our caller observes `_s->err`
+    if (_s->reset.load(std::memory_order_acquire))
+        return true;
+    
+    if (ir < 0)
+    {
+        if (epollErrno == EINTR) return true;
+        throw RUNTIME_ERROR("epoll_wait failed: %s", strerror(epollErrno));
+    }
+    if (!ir) return false;
+    
+    // Read every command the socket has available
+    if (ev.events & (EPOLLIN|EPOLLHUP|EPOLLERR))
+    {
+        const size_t count = _s->cmds.size();
+        while (_ReadCmds(_s->socket, _s->recvBuf, _s->cmds));
+        _cmdsReceived(_s->cmds, count);
+        _dispatchCmds(_s->cmds, count);
+    }
+    // Send the replies that previously couldn't be sent
+    if (ev.events & EPOLLOUT)
+        _flushReps();
+    return true;
+}
+
+uint32_t VirtualUSBDevice::_workerIO(uint32_t events)
+{
+    const _IOScope io(this);
+    try
+    {
+        if (_s->reset.load(std::memory_order_acquire))
+            return 0;
+        
+        // Send the replies that previously couldn't be sent
+        if (events & EPOLLOUT)
+            _flushReps();
+        
+        for (size_t i=0;; i++)
+        {
+            // Hand off the commands that we've parsed (including those that didn't fit in the
+            // queue last time)
+            while (!_s->cmds.empty() && _s->cmdQueue.tryPush(_s->cmds.front()))
+                _s->cmds.pop_front();
+            
+            if (!_s->cmds.empty())
+            {
+                // The queue is full, so stop reading until read() makes room and kicks us.
+                // Check again after setting `readStalled`, in case read() made room before
+                // it could see it.
+                _s->readStalled.store(true);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (!_s->cmdQueue.tryPush(_s->cmds.front()))
+                    return 0;
+                _s->cmds.pop_front();
+                // If read() already claimed `readStalled`, it's kicking us
+                if (!_s->readStalled.exchange(false))
+                    return 0;
+                continue;
+            }
+            
+            // Let other devices on this worker have a turn (and let idle workers steal us)
+            // if this one is busy
+            if (i == _WorkerReadsMax)
+            {
+                _info.workerPool->kick(_s->source);
+                return 0;
+            }
+            
+            // `cmds` is empty here, since we handed them all off above
+            const bool more = _ReadCmds(_s->socket, _s->recvBuf, _s->cmds);
+            _cmdsReceived(_s->cmds, 0);
+            _dispatchCmds(_s->cmds, 0);
+            if (!more)
+                return EPOLLIN;
+        }
+    
+    }
+    catch (const std::exception& e)
+    {
+        // Don't wait for the I/O to stop, since we're part of it
+        auto lock = std::unique_lock(_s->lock);
+        _reset(lock, std::current_exception(), false);
+        return 0;
+    }
+}
+
+void VirtualUSBDevice::_flushReps()
+{
+    if (_info.engine == Engine::Threads) return;
+    
+    auto repLock = std::unique_lock(_s->repLock);
+    // The socket is closed once we're reset
+    if (_s->reset.load(std::memory_order_acquire))
+        std::rethrow_exception(_s->err);
+    
+    const bool flushed = _sendReps(_s->socket, _s->reps, _s->repsOff, _s->iov);
+    // Have the worker finish sending once the socket is writable
+    if (_info.engine == Engine::WorkerPool)
+    {
+        if (!flushed) _info.workerPool->poll(_s->source, EPOLLOUT);
+        return;
+    }
+    
+    // Only poll for writability while we have replies that the socket couldn't accept.
+    // epoll_ctl() is safe to call while another thread sits in epoll_wait().
+    if (_s->pollOut == flushed)
+    {
+        epoll_event ev = {.events = EPOLLIN | (flushed ? 0 : (uint32_t)EPOLLOUT)};
+        const int ir = epoll_ctl(_s->epollFD, EPOLL_CTL_MOD, _s->socket, &ev);
+        if (ir) throw RUNTIME_ERROR("epoll_ctl failed: %s", strerror(errno));
+        _s->pollOut = !flushed;
+    }
 }
 
-    // _s.lock must be held
 void VirtualUSBDevice::_reply(const _Cmd& cmd, const void* data, size_t len, int32_t status=0)
 {
-    using namespace Endian;
+    // Validate our arguments for SUBMIT replies:
+    //   - For IN transfers, either we're sending data (len>0) and have a valid data pointer
+    //     (data!=null), or we're not sending data (len==0)
+    //   - For OUT transfers, we can't respond with any data, but the `len` argument is used
+    //     to populate `actual_length` -- the amount of data sent to the device
+    assert(
+        cmd.header.base.command!=USBIPLib::USBIP_CMD_SUBMIT ||
+        (cmd.header.base.direction==USBIPLib::USBIP_DIR_IN && ((len && data) || !len)) ||
+        (cmd.header.base.direction==USBIPLib::USBIP_DIR_OUT && !data)
+    );
     
+    // Copy the data, since it typically doesn't outlive this call
+    Buffer payload;
+    if (data && len)
+    {
+        payload = _SharedPool().alloc(len);
+        memcpy(payload.data(), data, len);
+    }
+    _reply(cmd, std::move(payload), len, status);
+}
+
+void VirtualUSBDevice::_reply(const _Cmd& cmd, Buffer payload, size_t len, int32_t status=0)
+{
+    // Build the header in host endian (for the trace), and convert it once it's complete
+    USBIP::HEADER hdr = {};
     _Rep rep;
     switch (cmd.header.base.command)
     {
         case USBIPLib::USBIP_CMD_SUBMIT:
         {
-            // Validate our arguments for SUBMIT replies:
-            //   - For IN transfers, either we're sending data (len>0) and have a valid data pointer
-            //     (data!=null), or we're not sending data (len==0)
-            //   - For OUT transfers, we can't respond with any data, but the `len` argument is used
-            //     to populate `actual_length` -- the amount of data sent to the device
+            // For IN transfers the payload is the data being sent, so its length must match.
+            // For OUT transfers there's no payload; `len` is the amount of data the device
+            // received.
             assert(
-                (cmd.header.base.direction==USBIPLib::USBIP_DIR_IN && ((len && data) || !len)) ||
-                (cmd.header.base.direction==USBIPLib::USBIP_DIR_OUT && !data)
+                (cmd.header.base.direction==USBIPLib::USBIP_DIR_IN && payload.len()==len) ||
+                (cmd.header.base.direction==USBIPLib::USBIP_DIR_OUT && !payload)
             );
+            const size_t payloadLen = payload.len();
             
-            std::unique_ptr<uint8_t[]> payload;
-            size_t payloadLen = 0;
-            if (cmd.header.base.direction==USBIPLib::USBIP_DIR_IN && len)
-            {
-                payloadLen = len;
-                payload = std::make_unique<uint8_t[]>(payloadLen);
-                memcpy(payload.get(), data, payloadLen);
-            }
+            hdr.base = {
+                .command    = USBIPLib::USBIP_RET_SUBMIT,
+                .seqnum     = cmd.header.base.seqnum,
+                .devid      = cmd.header.base.devid,
+                .direction  = cmd.header.base.direction,
+                .ep         = cmd.header.base.ep,
+            };
+            hdr.ret_submit = {
+                .status             = status,
+                .actual_length      = (int32_t)len,
+                .start_frame        = 0,
+                .number_of_packets  = 0,
+                .error_count        = 0,
+            };
             
-            rep.header.base.command = BFH_U32(USBIPLib::USBIP_RET_SUBMIT);
-            rep.header.base.seqnum = BFH_U32(cmd.header.base.seqnum);
-            rep.header.base.devid = BFH_U32(cmd.header.base.devid);
-            rep.header.base.direction = BFH_U32(cmd.header.base.direction);
-            rep.header.base.ep = BFH_U32(cmd.header.base.ep);
-
-            rep.header.ret_submit.status = BFH_S32(0);
-            rep.header.ret_submit.actual_length = BFH_S32(len);
-            rep.header.ret_submit.start_frame = BFH_S32(0);
-            rep.header.ret_submit.number_of_packets = BFH_S32(0);
-            rep.header.ret_submit.error_count = BFH_S32(0);
-                
             rep.payload = std::move(payload);
             rep.payloadLen = payloadLen;
             
+            rep.recvTime = cmd.recvTime;
+            rep.dequeueTime = cmd.dequeueTime;
+            rep.replyTime = std::chrono::steady_clock::now();
             break;
         }
-    
+        
         case USBIPLib::USBIP_CMD_UNLINK:
         {
-
-            rep.header.base.command      = BFH_U32(USBIPLib::USBIP_RET_UNLINK);
-            rep.header.base.seqnum       = BFH_U32(cmd.header.base.seqnum);
-            rep.header.base.devid        = BFH_U32(cmd.header.base.devid);
-            rep.header.base.direction    = BFH_U32(cmd.header.base.direction);
-            rep.header.base.ep           = BFH_U32(cmd.header.base.ep);
-
-            rep.header.ret_unlink.status = BFH_S32(status);
+            hdr.base = {
+                .command    = USBIPLib::USBIP_RET_UNLINK,
+                .seqnum     = cmd.header.base.seqnum,
+                .devid      = cmd.header.base.devid,
+                .direction  = cmd.header.base.direction,
+                .ep         = cmd.header.base.ep,
+            };
+            hdr.ret_unlink.status = status;
             break;
         }
-    
+        
         default:
             throw RUNTIME_ERROR("invalid cmd.header.base.command: %u", cmd.header.base.command);
     }
     
-    _s.reps.push_back(std::move(rep));
-    _s.signal.notify_all();
+    _queueRep(hdr, std::move(rep));
+}
+
+// Queues reply `rep` for sending, given its header in host endian
+void VirtualUSBDevice::_queueRep(const USBIP::HEADER& header, _Rep&& rep)
+{
+    _trace(header, rep.payload.data(), rep.payloadLen, rep.iso.data(), rep.iso.len());
+    rep.header = _BFHHeader(header);
+    
+    _s->repsQueued.fetch_add(1, std::memory_order_relaxed);
+    auto repLock = std::unique_lock(_s->repLock);
+    // Without the write thread, the caller sends the reply via _flushReps()
+    if (_info.engine != Engine::Threads)
+    {
+        _s->reps.push_back(std::move(rep));
+        return;
+    }
+    
+    // Hand the reply to the write thread, waiting for room if it's fallen behind. If the
+    // queue is closed, we're being reset and the reply is moot.
+    //
+    // The timer wheel's thread is shared by every device, so it mustn't wait on any one
+    // device's socket: if the queue is full, it leaves the reply in `repsOverflow` for the
+    // write thread to collect. Until it does, the other replies wait behind those, to stay in
+    // order.
+    for (;;)
+    {
+        if (_s->repsOverflow.empty() && _s->repQueue.tryPush(rep)) return;
+        if (_SharedWheel().onThread())
+        {
+            _s->repsOverflow.push_back(std::move(rep));
+            return;
+        }
+        if (_s->repQueue.closed()) return;
+        
+        const bool overflowed = !_s->repsOverflow.empty();
+        repLock.unlock();
+        _s->repQueue.waitPush();
+        // The write thread collects the overflow right after it empties the queue
+        if (overflowed) std::this_thread::yield();
+        repLock.lock();
+    }
 }
 
-std::optional<VirtualUSBDevice::Xfer> VirtualUSBDevice::_handleCmd(_Cmd& cmd)
+std::optional<VirtualUSBDevice::XferRef> VirtualUSBDevice::_handleCmd(_Cmd& cmd)
 {
     switch (cmd.header.base.command)
     {
         case USBIPLib::USBIP_CMD_SUBMIT:
+            if (cmd.header.base.ep <= USB::Endpoint::IndexMask)
+            {
+                const size_t idx = _EPAddrIdx(cmd.header.base.ep, cmd.header.base.direction);
+                if (_s->epStats[idx])
+                    _s->epStats[idx]->urbsSubmitted.fetch_add(1, std::memory_order_relaxed);
+            }
+            
             if (cmd.header.base.ep == 0)
                 return _handleCmdSubmitEP0(cmd);
             else
                 return _handleCmdSubmitEPX(cmd);
-    
+        
         case USBIPLib::USBIP_CMD_UNLINK:
             _handleCmdUnlink(cmd);
             return std::nullopt;
-    
+        
         default:
             throw RUNTIME_ERROR("invalid USBIP command: %u", (uint32_t)cmd.header.base.command);
     }
 }
 
-std::optional<VirtualUSBDevice::Xfer> VirtualUSBDevice::_handleCmdSubmitEP0(_Cmd& cmd)
+std::optional<VirtualUSBDevice::XferRef> VirtualUSBDevice::_handleCmdSubmitEP0(_Cmd& cmd)
 {
-    printf("_handleCmdSubmitOut\n");
     const USB::SetupRequest setupReq = _GetSetupRequest(cmd);
     const bool standardType =
         (setupReq.bmRequestType & USB::RequestType::TypeMask) == USB::RequestType::TypeStandard;
@@ -569,16 +2195,25 @@ std::optional<VirtualUSBDevice::Xfer> VirtualUSBDevice::_handleCmdSubmitEP0(_Cmd
     }
     else
     {
+        // The request is returned in either direction, so that it can be answered: an IN
+        // request's URB waits for a write() to the default control endpoint
         auto xfer = _handleCmdSubmitEPX(cmd);
+        if (!xfer)
+            xfer = XferRef{};
         // Populate the setupReq member, since it's always expected for ep==0
-        if (xfer)
-            xfer->setupReq = setupReq;
+        xfer->ep = 0;
+        xfer->setupReq = setupReq;
         return xfer;
     }
 }
 
-std::optional<VirtualUSBDevice::Xfer> VirtualUSBDevice::_handleCmdSubmitEPX(_Cmd& cmd)
+std::optional<VirtualUSBDevice::XferRef> VirtualUSBDevice::_handleCmdSubmitEPX(_Cmd& cmd)
 {
+    // Isochronous URBs are scheduled against the frame clock, in either direction
+    if (cmd.header.base.ep<=USB::Endpoint::IndexMask &&
+        _s->isoEps[_EPAddrIdx(cmd.header.base.ep, cmd.header.base.direction)])
+        return _handleCmdSubmitIso(cmd);
+    
     switch (cmd.header.base.direction)
     {
         // OUT command (data from host->device)
@@ -595,76 +2230,314 @@ std::optional<VirtualUSBDevice::Xfer> VirtualUSBDevice::_handleCmdSubmitEPX(_Cmd
     }
 }
 
-VirtualUSBDevice::Xfer VirtualUSBDevice::_handleCmdSubmitEPXOut(_Cmd& cmd)
+VirtualUSBDevice::XferRef VirtualUSBDevice::_handleCmdSubmitEPXOut(_Cmd& cmd)
 {
-//        printf("_handleCmdSubmitEPXOut\n");
     const uint8_t epIdx = cmd.header.base.ep;
     if (epIdx >= USB::Endpoint::MaxCount)
         throw RUNTIME_ERROR("invalid epIdx");
     
     // Let host know that we received the data
     _reply(cmd, nullptr, cmd.payloadLen);
-    return Xfer{
+    return XferRef{
         .ep     = _GetEndpointAddr(cmd),
         .data   = std::move(cmd.payload),
-        .len    = cmd.payloadLen,
     };
 }
 
 void VirtualUSBDevice::_handleCmdSubmitEPXIn(_Cmd& cmd)
 {
-//        printf("_handleCmdSubmitEPXIn\n");
-    const uint8_t epIdx = cmd.header.base.ep;
-    if (epIdx >= USB::Endpoint::MaxCount)
-        throw RUNTIME_ERROR("invalid epIdx");
-    auto& epInCmds = _s.inCmds[epIdx];
-    epInCmds.push_back(std::move(cmd));
-    _sendDataForInEndpoint(epIdx);
+    // Stall IN requests to endpoints that the configuration doesn't declare, like a real
+    // device would, rather than treating them as a fatal protocol error
+    const uint32_t epIdx = cmd.header.base.ep;
+    if (epIdx>=std::size(_s->eps) || !_s->eps[epIdx])
+    {
+        LOG_DEBUG("VirtualUSBDevice: stalling IN request to undeclared endpoint %u", epIdx);
+        _reply(cmd, nullptr, 0, -EPIPE);
+        return;
+    }
+    _Endpoint& e = *_s->eps[epIdx];
+    std::vector<std::coroutine_handle<>> ready;
+    {
+        auto epLock = std::unique_lock(e.lock);
+        e.inCmds.push_back(std::move(cmd));
+        _sendDataForInEndpoint(epIdx);
+        ready.swap(e.ready);
+    }
+    // Resume the send() coroutines whose data was sent
+    for (std::coroutine_handle<> coro : ready) coro.resume();
 }
-
+    
+    // The endpoint's lock must be held
 void VirtualUSBDevice::_sendDataForInEndpoint(uint8_t epIdx)
 {
-    auto& epInCmds = _s.inCmds[epIdx];
-    auto& epInData = _s.inData[epIdx];
-    
-    // Send data while there's data requested and data available
-    while (!epInCmds.empty() && !epInData.empty())
-    {
-        const _Cmd& cmd = epInCmds.front();
-        _Data& d = epInData.front();
-        // Limit the length of data to send by the length requested (transfer_buffer_length),
-        // or the length available, whichever is smaller
-        const size_t len = std::min((size_t)cmd.header.cmd_submit.transfer_buffer_length, d.len-d.off);
-        // printf("_sendDataForInEndpoint for seqnum=%u\n", cmd.header.base.seqnum);
-        _reply(cmd, &d.data[d.off], len);
-        d.off += len;
-        // Pop the command unconditionally
-        epInCmds.pop_front();
+    _Endpoint& e = *_s->eps[epIdx];
+    // Interrupt endpoints send at the host's next poll
+    if (e.pollTimer)
+    {
+        _schedulePoll(epIdx);
+    }
+    else
+    {
+        // Send data while there's data requested and data available
+        while (!e.inCmds.empty() && !e.inData.empty())
+            _sendInXfer(epIdx);
+    }
+    e.publish();
+}
+
+// Pops the first pending write of endpoint `e`, which has been sent. If it's from send(), its
+// coroutine is resumed once the endpoint's lock is released. The endpoint's lock must be held.
+static void _PopInData(_Endpoint& e)
+{
+    _Data& d = e.inData.front();
+    if (d.sender)
+    {
+        d.sender->ok = true;
+        e.ready.push_back(d.coro);
+    }
+    e.inData.pop_front();
+}
+
+// Completes the first pending transfer of IN endpoint `epIdx` from the pending data. There
+// must be both. The endpoint's lock must be held.
+//
+// Like a device's FIFO, the pending writes are a stream of bytes that's sent in packets of
+// `maxPacketLen`: a transfer takes whole packets until the URB is full, or until the data
+// runs out, which ends it with a short packet (or a zero-length one, on a packet boundary).
+// So consecutive writes are merged into one URB. A zero-length write() ends the transfer
+// explicitly; if it's the first thing that the transfer sees (eg because the previous URB
+// was filled exactly), it's sent as a zero-length packet that completes the URB empty.
+void VirtualUSBDevice::_sendInXfer(uint8_t epIdx)
+{
+    _Endpoint& e = *_s->eps[epIdx];
+    const _Cmd& cmd = e.inCmds.front();
+    size_t cap = std::max(cmd.header.cmd_submit.transfer_buffer_length, 0);
+    // Packets can't be split across URBs, so only take whole packets, unless the URB is
+    // shorter than a packet
+    if (e.maxPacketLen && cap>e.maxPacketLen) cap -= cap % e.maxPacketLen;
+    
+    // Find how much data the transfer takes
+    size_t len = 0;
+    bool zlp = false;
+    for (const _Data& d : e.inData)
+    {
+        if (len == cap) break;
+        const size_t rem = d.data.len()-d.off;
+        if (!rem)
+        {
+            zlp = true;
+            break;
+        }
+        len += std::min(rem, cap-len);
+        // The default control endpoint sends one write per transfer
+        if (!e.maxPacketLen) break;
+    }
+    
+    // Reply with a slice of the data if it's all from one write, rather than a copy
+    _Data& front = e.inData.front();
+    Buffer payload;
+    const bool copy = (len > front.data.len()-front.off);
+    if (copy) payload = _SharedPool().alloc(len);
+    else      payload = front.data.slice(front.off, len);
+    
+    for (size_t off=0; off<len;)
+    {
+        _Data& d = e.inData.front();
+        const size_t n = std::min(len-off, d.data.len()-d.off);
+        if (copy) memcpy(payload.data()+off, d.data.data()+d.off, n);
+        d.off += n;
+        off += n;
         // Pop the data if we sent it all
-        if (d.off == d.len)
+        if (d.off == d.data.len()) _PopInData(e);
+    }
+    // Pop the zero-length write that ended the transfer
+    if (zlp) _PopInData(e);
+    
+    _reply(cmd, std::move(payload), len);
+    e.inDataBytes.fetch_sub(len, std::memory_order_relaxed);
+    e.inCmds.pop_front();
+}
+
+// If interrupt IN endpoint `epIdx` has data requested and data available, arms its timer for
+// the host's next poll. Polls are every `pollInterval` frames, counting from frame 0, and the
+// current frame's poll has already happened. The endpoint's lock must be held.
+void VirtualUSBDevice::_schedulePoll(uint8_t epIdx)
+{
+    _Endpoint& e = *_s->eps[epIdx];
+    if (e.inCmds.empty() || e.inData.empty()) return;
+    const uint64_t poll = (frame()/e.pollInterval + 1) * e.pollInterval;
+    _SharedWheel().schedule(*e.pollTimer, _frameTime(poll));
+}
+
+std::optional<VirtualUSBDevice::XferRef> VirtualUSBDevice::_handleCmdSubmitIso(_Cmd& cmd)
+{
+    using namespace Endian;
+    const USBIP::HEADER_CMD_SUBMIT& submit = cmd.header.cmd_submit;
+    const size_t count = submit.number_of_packets;
+    if (!count)
+        throw RUNTIME_ERROR("isochronous URB without packets");
+    
+    const USBIP::ISO_PACKET_DESCRIPTOR* descs = (const USBIP::ISO_PACKET_DESCRIPTOR*)cmd.iso.data();
+    for (size_t i=0; i<count; i++)
+    {
+        const uint32_t off = HFB_U32(descs[i].offset);
+        const uint32_t len = HFB_U32(descs[i].length);
+        if ((uint64_t)off+len > (uint64_t)std::max(submit.transfer_buffer_length, 0))
+            throw RUNTIME_ERROR("invalid isochronous packet: offset %u, length %u", off, len);
+    }
+    
+    _IsoEndpoint& e = *_s->isoEps[_EPAddrIdx(cmd.header.base.ep, cmd.header.base.direction)];
+    // Without a sink, OUT data goes to read() right away
+    std::optional<XferRef> xfer;
+    if (cmd.header.base.direction==USBIPLib::USBIP_DIR_OUT && !e.sink)
+    {
+        xfer = XferRef{
+            .ep     = _GetEndpointAddr(cmd),
+            .data   = std::move(cmd.payload),
+        };
+    }
+    
+    _IsoUrb urb = {
+        .interval = (submit.interval>0 ? (uint32_t)submit.interval : e.interval),
+    };
+    
+    auto isoLock = std::unique_lock(_s->isoLock);
+    const uint64_t now = frame();
+    // The current frame is already underway, so the earliest we can schedule is the next one.
+    // With URB_ISO_ASAP, the URB continues the endpoint's stream; otherwise it starts in
+    // the frame that the host chose, whose number is the low 32 bits of ours. Either way it
+    // can't overlap the URBs already scheduled.
+    uint64_t start = now+1;
+    if (!(submit.transfer_flags & USBIPLib::USBIP_URB_ISO_ASAP))
+        start = now + (int32_t)((uint32_t)submit.start_frame - (uint32_t)now);
+    start = std::max(start, e.nextFrame);
+    
+    urb.startFrame = start;
+    // The packets in frames that have already passed miss their slots
+    urb.late = (start>now ? 0 : std::min(count, (size_t)((now-start)/urb.interval + 1)));
+    const uint64_t lastFrame = start + (count-1)*urb.interval;
+    urb.deadline = _frameTime(lastFrame+1);
+    urb.cmd = std::move(cmd);
+    e.nextFrame = lastFrame+1;
+    
+    // URBs complete in order, so the timer only needs arming for the first one (arming an
+    // armed timer keeps its earlier deadline)
+    _SharedWheel().schedule(*e.timer, urb.deadline);
+    e.urbs.push_back(std::move(urb));
+    return xfer;
+}
+
+// Completes isochronous URB `urb`, calling the endpoint's stream function for each packet.
+// Called on the timer wheel's thread, without any locks held.
+void VirtualUSBDevice::_completeIso(const _IsoUrb& urb)
+{
+    using namespace Endian;
+    const _Cmd& cmd = urb.cmd;
+    const bool dirIn = cmd.header.base.direction==USBIPLib::USBIP_DIR_IN;
+    const _IsoEndpoint& e = *_s->isoEps[_EPAddrIdx(cmd.header.base.ep, cmd.header.base.direction)];
+    const size_t count = cmd.header.cmd_submit.number_of_packets;
+    const USBIP::ISO_PACKET_DESCRIPTOR* descs = (const USBIP::ISO_PACKET_DESCRIPTOR*)cmd.iso.data();
+    
+    // IN packets are sent back to back, without the gaps between their buffers, so the
+    // payload can be as long as all of them
+    Buffer payload;
+    if (dirIn)
+    {
+        size_t cap = 0;
+        for (size_t i=0; i<count; i++) cap += HFB_U32(descs[i].length);
+        if (cap) payload = _SharedPool().alloc(cap);
+    }
+    
+    Buffer iso = _SharedPool().alloc(cmd.iso.len());
+    USBIP::ISO_PACKET_DESCRIPTOR* isoDescs = (USBIP::ISO_PACKET_DESCRIPTOR*)iso.data();
+    size_t payloadLen = 0;
+    size_t len = 0;
+    int32_t errorCount = 0;
+    for (size_t i=0; i<count; i++)
+    {
+        const uint32_t off = HFB_U32(descs[i].offset);
+        const uint32_t pktLen = HFB_U32(descs[i].length);
+        const uint64_t frame = urb.startFrame + i*urb.interval;
+        int32_t status = 0;
+        size_t actualLen = 0;
+        if (i < urb.late)
+        {
+            // Missed its frame
+            status = -EXDEV;
+            errorCount++;
+        }
+        else if (dirIn)
+        {
+            if (e.source && pktLen)
+                actualLen = std::min(e.source(frame, payload.data()+payloadLen, pktLen), (size_t)pktLen);
+            payloadLen += actualLen;
+        }
+        else
         {
-            epInData.pop_front();
+            // Without a sink, read() already returned the data
+            if (e.sink) e.sink(frame, cmd.payload.data()+off, pktLen);
+            actualLen = pktLen;
         }
+        
+        isoDescs[i] = {
+            .offset         = BFH_U32(off),
+            .length         = BFH_U32(pktLen),
+            .actual_length  = BFH_U32((uint32_t)actualLen),
+            .status         = BFH_U32((uint32_t)status),
+        };
+        len += actualLen;
     }
+    
+    USBIP::HEADER hdr = {};
+    hdr.base = {
+        .command    = USBIPLib::USBIP_RET_SUBMIT,
+        .seqnum     = cmd.header.base.seqnum,
+        .devid      = cmd.header.base.devid,
+        .direction  = cmd.header.base.direction,
+        .ep         = cmd.header.base.ep,
+    };
+    hdr.ret_submit = {
+        .status             = 0,
+        .actual_length      = (int32_t)len,
+        .start_frame        = (int32_t)(uint32_t)urb.startFrame,
+        .number_of_packets  = (int32_t)count,
+        .error_count        = errorCount,
+    };
+    
+    _Rep rep = {
+        .payload        = (payloadLen ? payload.slice(0, payloadLen) : Buffer()),
+        .payloadLen     = payloadLen,
+        .iso            = std::move(iso),
+        .recvTime       = cmd.recvTime,
+        .dequeueTime    = cmd.dequeueTime,
+        .replyTime      = std::chrono::steady_clock::now(),
+    };
+    _queueRep(hdr, std::move(rep));
 }
 
 void VirtualUSBDevice::_handleCmdUnlink(const _Cmd& cmd)
 {
-    printf("_handleCmdUnlink\n");
     const uint8_t epIdx = cmd.header.base.ep;
     if (epIdx >= USB::Endpoint::MaxCount)
         throw RUNTIME_ERROR("invalid epIdx");
     
     // Remove the IN cmd from the endpoint's inCmds deque
     bool found = false;
-    for (std::deque<_Cmd>& deq : _s.inCmds)
+    for (const std::unique_ptr<_Endpoint>& e : _s->eps)
     {
+        if (!e) continue;
+        auto epLock = std::unique_lock(e->lock);
+        std::deque<_Cmd>& deq = e->inCmds;
         for (auto it=deq.begin(); it!=deq.end(); it++)
         {
             const _Cmd& inCmd = *it;
             if (inCmd.header.base.seqnum == cmd.header.cmd_unlink.seqnum)
             {
+                const size_t idx = _EPAddrIdx(inCmd.header.base.ep, inCmd.header.base.direction);
+                if (_s->epStats[idx])
+                    _s->epStats[idx]->urbsUnlinked.fetch_add(1, std::memory_order_relaxed);
                 deq.erase(it);
+                e->publish();
                 found = true;
                 break;
             }
@@ -673,18 +2546,42 @@ void VirtualUSBDevice::_handleCmdUnlink(const _Cmd& cmd)
             break;
     }
     
-    // printf("UNLINK seqnum=%u: %d\n", cmd.header.cmd_unlink.seqnum, found);
+    // Otherwise look for a scheduled isochronous URB
+    if (!found)
+    {
+        auto isoLock = std::unique_lock(_s->isoLock);
+        for (size_t idx=0; idx<std::size(_s->isoEps) && !found; idx++)
+        {
+            if (!_s->isoEps[idx]) continue;
+            std::deque<_IsoUrb>& urbs = _s->isoEps[idx]->urbs;
+            for (auto it=urbs.begin(); it!=urbs.end(); it++)
+            {
+                if (it->cmd.header.base.seqnum == cmd.header.cmd_unlink.seqnum)
+                {
+                    if (_s->epStats[idx])
+                        _s->epStats[idx]->urbsUnlinked.fetch_add(1, std::memory_order_relaxed);
+                    urbs.erase(it);
+                    found = true;
+                    break;
+                }
+            }
+        }
+    }
+    
+    LOG_DEBUG("VirtualUSBDevice: UNLINK seqnum=%u: found=%d", cmd.header.cmd_unlink.seqnum, found);
     
     // status = -ECONNRESET on success
     const int32_t status = (found ? -ECONNRESET : 0);
     _reply(cmd, nullptr, 0, status);
 }
-
-    // _s.lock must be held
+    
+    // Must be called by the thread that handles commands, which owns `configDesc` (see
+    // _Impl::readLock)
 void VirtualUSBDevice::_handleCmdSubmitEP0StandardRequest(const _Cmd& cmd, const USB::SetupRequest& req)
 {
     using namespace Endian;
-    printf("_handleCmdSubmitEP0StandardRequest\n");
+    LOG_DEBUG("VirtualUSBDevice: EP0 standard request: bmRequestType=0x%02x bRequest=0x%02x wValue=0x%04x wIndex=0x%04x wLength=%u",
+        req.bmRequestType, req.bRequest, req.wValue, req.wIndex, req.wLength);
     
     // We only support requests to the device for now
     const uint8_t recipient = req.bmRequestType & USB::RequestType::RecipientMask;
@@ -700,12 +2597,12 @@ void VirtualUSBDevice::_handleCmdSubmitEP0StandardRequest(const _Cmd& cmd, const
         {
             case USB::Request::GetStatus:
             {
-                printf("USB::Request::GetStatus\n");
-                if (!_s.configDesc)
+                LOG_DEBUG("VirtualUSBDevice: GET_STATUS");
+                if (!_s->configDesc)
                     throw RUNTIME_ERROR("no active configuration");
                 uint16_t reply = 0;
                 // If self-powered, bit 0 is 1
-                if (_SelfPowered(*_s.configDesc))
+                if (_SelfPowered(*_s->configDesc))
                     reply |= 1;
                 reply = LFH_U16(reply);
                 _reply(cmd, &reply, sizeof(reply));
@@ -722,13 +2619,13 @@ void VirtualUSBDevice::_handleCmdSubmitEP0StandardRequest(const _Cmd& cmd, const
                 switch (descType)
                 {
                     case USB::DescriptorType::Device:
-                        printf("USB::Request::GetDescriptor::Device\n");
+                        LOG_DEBUG("VirtualUSBDevice: GET_DESCRIPTOR(Device)");
                         replyData = _info.deviceDesc;
                         replyDataLen = _DescLen(*_info.configDescs[descIdx]);
                         break;
                     
                     case USB::DescriptorType::Configuration:
-                        printf("USB::Request::GetDescriptor::Configuration\n");
+                        LOG_DEBUG("VirtualUSBDevice: GET_DESCRIPTOR(Configuration %u)", descIdx);
                         if (descIdx >= _info.configDescsCount)
                             throw RUNTIME_ERROR("invalid Configuration descriptor index: %u", descIdx);
                         replyData = _info.configDescs[descIdx];
@@ -736,7 +2633,7 @@ void VirtualUSBDevice::_handleCmdSubmitEP0StandardRequest(const _Cmd& cmd, const
                         break;
                     
                     case USB::DescriptorType::String:
-                        printf("USB::Request::GetDescriptor::String\n");
+                        LOG_DEBUG("VirtualUSBDevice: GET_DESCRIPTOR(String %u)", descIdx);
                         if (_info.stringDescs)
                         {
                             if (descIdx >= _info.stringDescsCount)
@@ -747,7 +2644,7 @@ void VirtualUSBDevice::_handleCmdSubmitEP0StandardRequest(const _Cmd& cmd, const
                         break;
                     
                     case USB::DescriptorType::DeviceQualifier:
-                        printf("USB::Request::GetDescriptor::DeviceQualifier\n");
+                        LOG_DEBUG("VirtualUSBDevice: GET_DESCRIPTOR(DeviceQualifier)");
                         if (_info.deviceQualifierDesc)
                         {
                             replyData = _info.deviceQualifierDesc;
@@ -760,7 +2657,8 @@ void VirtualUSBDevice::_handleCmdSubmitEP0StandardRequest(const _Cmd& cmd, const
                         break;
                 }
                 
-                const int32_t status = (replyData ? 0 : 1);
+                // Stall requests for descriptors that we don't have
+                const int32_t status = (replyData ? 0 : -EPIPE);
                 // Cap reply length to `wLength` in the original request
                 replyDataLen = std::min(replyDataLen, (size_t)req.wLength);
                 _reply(cmd, replyData, replyDataLen, status);
@@ -769,8 +2667,8 @@ void VirtualUSBDevice::_handleCmdSubmitEP0StandardRequest(const _Cmd& cmd, const
             
             case USB::Request::SetConfiguration:
             {
-                printf("USB::Request::SetConfiguration\n");
                 const uint8_t configVal = (req.wValue&0x00FF)>>0;
+                LOG_DEBUG("VirtualUSBDevice: SET_CONFIGURATION %u", configVal);
                 
                 bool ok = false;
                 for (size_t i=0; i<_info.configDescsCount && !ok; i++)
@@ -778,7 +2676,7 @@ void VirtualUSBDevice::_handleCmdSubmitEP0StandardRequest(const _Cmd& cmd, const
                     const USB::ConfigurationDescriptor& configDesc = *_info.configDescs[i];
                     if (_ConfigVal(configDesc) == configVal)
                     {
-                        _s.configDesc = &configDesc;
+                        _s->configDesc = &configDesc;
                         ok = true;
                     }
                 }
@@ -805,8 +2703,8 @@ void VirtualUSBDevice::_handleCmdSubmitEP0StandardRequest(const _Cmd& cmd, const
         {
             case USB::Request::SetConfiguration:
             {
-                printf("USB::Request::SetConfiguration\n");
                 const uint8_t configVal = (req.wValue&0x00FF)>>0;
+                LOG_DEBUG("VirtualUSBDevice: SET_CONFIGURATION %u", configVal);
                 
                 bool ok = false;
                 for (size_t i=0; i<_info.configDescsCount && !ok; i++)
@@ -814,7 +2712,7 @@ void VirtualUSBDevice::_handleCmdSubmitEP0StandardRequest(const _Cmd& cmd, const
                     const USB::ConfigurationDescriptor& configDesc = *_info.configDescs[i];
                     if (_ConfigVal(configDesc) == configVal)
                     {
-                        _s.configDesc = &configDesc;
+                        _s->configDesc = &configDesc;
                         ok = true;
                     }
                 }
@@ -834,34 +2732,88 @@ void VirtualUSBDevice::_handleCmdSubmitEP0StandardRequest(const _Cmd& cmd, const
         throw RUNTIME_ERROR("invalid Cmd direction");
     }
 }
-
-    // _s.lock must be held
-void VirtualUSBDevice::_reset(std::unique_lock<std::mutex>& lock, Err err)
-{
-    // Short-circuit if we've already been reset
-    if (_s.state & _State::Reset)
-        return;
-    _s.state |= _State::Reset;
-    _s.err = err;
-    _s.signal.notify_all(); // Wake threads so they can observe `_s.err`
     
-    auto sockets = {std::ref(_s.socket), std::ref(_s.usbipSocket)};
+    // _s->lock must be held
+void VirtualUSBDevice::_reset(std::unique_lock<std::mutex>& lock, Err err, bool wait)
+{
+    auto sockets = {std::ref(_s->socket), std::ref(_s->usbipSocket)};
     
-    // Shutdown sockets
-    // read() will exit when it sees that the socket is shutdown
-    for (const int& s : sockets)
+    // Only the first reset stops the device; later ones just wait for it to finish stopping
+    if (!(_s->state & _State::Reset))
     {
-        if (s >= 0)
+        _s->state |= _State::Reset;
+        _s->err = err;
+        if (err != ErrStopped)
+            _s->errors.fetch_add(1, std::memory_order_relaxed);
+        _s->reset.store(true, std::memory_order_release);
+        // Wake the threads waiting on the queues
+        _s->cmdQueue.close();
+        _s->repQueue.close();
+        
+        // Shutdown sockets
+        // read() will exit when it sees that the socket is shutdown
+        for (const int& s : sockets)
         {
-            shutdown(s, SHUT_RDWR);
+            if (s >= 0)
+            {
+                shutdown(s, SHUT_RDWR);
+            }
         }
+        
+        // Without the lock, since the coroutines may call back into the device
+        lock.unlock();
+        _wakeCoroutines();
+        lock.lock();
     }
     
+    // The I/O threads and the worker callback reset the device without waiting, since they'd
+    // be waiting on themselves. The sockets are closed by a later reset (at the latest by the
+    // destructor).
+    if (!wait)
+        return;
+    
     // Wait until the threads exit
-    while (_s.state & (_State::ReadThreadRunning|_State::WriteThreadRunning))
+    while (_s->state & (_State::ReadThreadRunning|_State::WriteThreadRunning))
+    {
+        _s->signal.wait(lock);
+    }
+    
+    // Wait until the worker callback returns. Don't hold the lock meanwhile, since the
+    // callback takes it when it fails.
+    if (_s->source)
     {
-        _s.signal.wait(lock);
+        lock.unlock();
+        _info.workerPool->remove(_s->source);
+        lock.lock();
+    }
+    
+    // Likewise for the handlers' pool callbacks
+    lock.unlock();
+    for (const std::unique_ptr<_Handler>& h : _s->handlers)
+        if (h && h->source) h->pool->remove(h->source);
+    lock.lock();
+    
+    // Likewise for the timers' functions. Removing the timers also keeps them from being
+    // armed again.
+    lock.unlock();
+    for (const std::unique_ptr<_Endpoint>& e : _s->eps)
+        if (e && e->pollTimer) _SharedWheel().remove(*e->pollTimer);
+    for (const std::unique_ptr<_IsoEndpoint>& e : _s->isoEps)
+        if (e) _SharedWheel().remove(*e->timer);
+    lock.lock();
+    
+    // Without the threads, read() and write() use the socket directly, so wait for them to
+    // finish with it. Don't hold the lock while waiting for `readLock`, since the read()
+    // caller's handlers take the lock when they fail.
+    std::unique_lock<std::mutex> readLock, repLock;
+    if (_info.engine == Engine::EventLoop)
+    {
+        lock.unlock();
+        readLock = std::unique_lock(_s->readLock);
+        lock.lock();
     }
+    if (_info.engine != Engine::Threads)
+        repLock = std::unique_lock(_s->repLock);
     
     // Close sockets now that the thread has exited
     for (int& s : sockets)
@@ -872,11 +2824,17 @@ void VirtualUSBDevice::_reset(std::unique_lock<std::mutex>& lock, Err err)
             s = -1;
         }
     }
+    
+    if (_s->epollFD >= 0)
+    {
+        close(_s->epollFD);
+        _s->epollFD = -1;
+    }
 }
 
 
 void VirtualUSBDevice::stop()
 {
-    auto lock = std::unique_lock(_s.lock);
+    auto lock = std::unique_lock(_s->lock);
     _reset(lock, ErrStopped);
 }
\ No newline at end of file
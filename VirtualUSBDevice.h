@@ -8,10 +8,20 @@
 #include <condition_variable>
 #include <deque>
 #include <set>
+#include <vector>
 #include <chrono>
+#include <climits>
+#include <coroutine>
+#include <span>
+#include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
 #include "USBIP.h"
 #include "USBIPLib.h"
+#include "BufferPool.h"
+#include "SPSCQueue.h"
+#include "Histogram.h"
 #include "LIB/Toastbox/Endian.h"
 #include "LIB/Toastbox/USB.h"
 #include "LIB/Toastbox/RuntimeError.h"
@@ -22,10 +32,29 @@ using namespace std::chrono_literals;
 #define RuntimeError    Toastbox::RuntimeError
 #define Endian          Toastbox::Endian
 
+class IOURing;
+class IOWorkerPool;
+class TraceRing;
+class SessionRecorder;
+
 class VirtualUSBDevice
 {
 
 public:
+    enum class Engine
+    {
+        // Dedicated read and write threads service the usbip socket
+        Threads,
+        // No threads: read() drives the usbip socket from a non-blocking epoll loop, and
+        // replies are sent directly from read()/write(). read() must be called continuously,
+        // from one thread at a time.
+        EventLoop,
+        // No threads of our own: the usbip socket is serviced by a shared IOWorkerPool
+        // (Info::workerPool), which multiplexes the sockets of many devices. Replies are sent
+        // directly from read()/write().
+        WorkerPool,
+    };
+    
     struct Info
     {
         const USB::DeviceDescriptor* deviceDesc = nullptr;
@@ -35,6 +64,27 @@ public:
         const USB::StringDescriptor*const* stringDescs = nullptr;
         size_t stringDescsCount = 0;
         bool throwOnErr = false;
+        Engine engine = Engine::Threads;
+        // Use io_uring for the usbip socket I/O (Engine::Threads only): multishot receive into
+        // provided buffers, and a registered socket. Falls back to recv()/sendmsg() if
+        // io_uring or multishot receive isn't available.
+        bool useIOURing = false;
+        // With `useIOURing`, have a kernel thread (shared by every device) poll for the
+        // submissions, so that a busy device needs no syscalls, and sends aren't waited for.
+        // The thread spins for a few ms after each submission, so this only pays off with
+        // cores to spare. Ignored if the kernel doesn't permit it.
+        bool uringSQPoll = false;
+        // The workers that service the usbip socket (Engine::WorkerPool only). Must outlive
+        // the device.
+        IOWorkerPool* workerPool = nullptr;
+        // Number of usbip commands and replies kept in the trace ring (a power of 2; 0
+        // disables tracing), and the max number of payload bytes captured per record. See
+        // writeTrace().
+        size_t traceLen = 1024;
+        size_t traceSnapLen = 32;
+        // Records every usbip command and reply, with its full payload, for SessionReplayer.
+        // Must outlive the device.
+        SessionRecorder* recorder = nullptr;
     };
     
     using Err = std::exception_ptr;
@@ -48,43 +98,363 @@ public:
         size_t len = 0;
     };
     
+    // Like Xfer, but without copying the payload: `data` references the buffer that the payload
+    // was received into. That buffer is recycled once every XferRef referencing it is destroyed.
+    struct XferRef
+    {
+        uint8_t ep = 0;
+        USB::SetupRequest setupReq = {};
+        Buffer data;
+    };
+    
+    // Latency stats of an endpoint's URBs, in nanoseconds. Each URB is timestamped when it's
+    // received from the socket, dequeued by read(), replied to, and written to the socket;
+    // the stages are the intervals between those points. Only completed URBs are recorded.
+    struct LatencyStats
+    {
+        uint8_t ep = 0; // Endpoint address, including the direction bit
+        Histogram::Snapshot queue; // Received -> dequeued: waiting in our queues for read()
+        Histogram::Snapshot app; // Dequeued -> replied: IN URBs wait here for write()
+        Histogram::Snapshot send; // Replied -> written: waiting for, and writing to, the socket
+        Histogram::Snapshot total; // Received -> written
+    };
+    
+    // Counters of an endpoint's traffic. Direction-specific fields are 0 for the other
+    // direction.
+    struct EndpointStats
+    {
+        uint8_t ep = 0; // Endpoint address, including the direction bit
+        uint64_t urbsSubmitted = 0; // URBs handled by read() or a handler
+        uint64_t urbsCompleted = 0; // URBs whose reply was written to the socket
+        uint64_t urbsUnlinked = 0; // URBs cancelled by the host before they completed
+        uint64_t bytes = 0; // Payload bytes transferred by completed URBs
+        size_t inCmds = 0; // IN URBs waiting for write()
+        size_t inData = 0; // write()s waiting for IN URBs
+        size_t inDataBytes = 0; // Bytes of those write()s that haven't been sent
+    };
+    
+    struct Stats
+    {
+        uint64_t errors = 0; // Failures that reset the device (stop() doesn't count)
+        uint64_t cmdsReceived = 0;
+        size_t cmds = 0; // Commands received but not yet handled by read() or a handler
+        uint64_t repsSent = 0;
+        size_t reps = 0; // Replies that haven't been written to the socket yet
+        std::vector<EndpointStats> eps; // Every endpoint that the device has
+    };
+    
+    // Produces the data of an isochronous IN packet that's scheduled in (micro)frame `frame`:
+    // writes up to `cap` bytes to `data`, and returns the number of bytes written (0 sends an
+    // empty packet)
+    using IsoSource = std::function<size_t(uint64_t frame, uint8_t* data, size_t cap)>;
+    
+    // Consumes the data of an isochronous OUT packet that was scheduled in (micro)frame `frame`
+    using IsoSink = std::function<void(uint64_t frame, const uint8_t* data, size_t len)>;
+    
+    // Consumes a transfer to an endpoint, in place of read() returning it (see setHandler())
+    using Handler = std::function<void(XferRef&& xfer)>;
+    
+    // A coroutine that awaits the device (see receive()). It runs as soon as it's called, until
+    // its first co_await, and its frame is destroyed when it finishes. An exception ends it
+    // (and is logged), so a coroutine that's waiting when the device stops ends there.
+    struct Task
+    {
+        struct promise_type
+        {
+            Task get_return_object() { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception();
+        };
+    };
+    
+    using _Time = std::chrono::steady_clock::time_point;
+    
     struct _Cmd
     {
         USBIP::HEADER header = {};
-        std::unique_ptr<uint8_t[]> payload = {};
+        Buffer payload = {};
         size_t payloadLen = 0;
+        // Isochronous packet descriptors (USBIP::ISO_PACKET_DESCRIPTOR, big endian), which
+        // follow the payload on the wire
+        Buffer iso = {};
+        // The transfer for read(), if the receiving side handled the command already (see
+        // _dispatchCmds())
+        std::optional<XferRef> xfer;
+        // Lifecycle timestamps, for latencyStats()
+        _Time recvTime;
+        _Time dequeueTime;
+        _Time replyTime;
     };
     
     using _Rep = _Cmd;
     
+    // Receive buffer for the usbip socket, so that we can parse many commands per recv()
+    struct _RecvBuf
+    {
+        static constexpr size_t Cap = 0x10000;
+        // Payloads with at least this many bytes remaining are received directly into the
+        // payload's buffer, instead of being copied out of `block`
+        static constexpr size_t DirectLen = Cap/4;
+        // Switch to a fresh block when the current one has less than this much space left
+        static constexpr size_t MinRecvLen = 0x1000;
+        
+        // Pool that we allocate receive blocks and payloads from
+        BufferPool* pool = nullptr;
+        // The device's endpoint transfer types (indexed by _EPAddrIdx()), since only
+        // isochronous URBs carry packet descriptors
+        const uint8_t* xferTypes = nullptr;
+        Buffer block;
+        size_t blockOff = 0;
+        
+        // Header that's been partially received
+        uint8_t hdr[sizeof(USBIP::HEADER)] = {};
+        size_t hdrLen = 0;
+        
+        // Command whose payload is still being received
+        std::optional<_Cmd> cmd;
+        size_t payloadOff = 0;
+        
+        // Whether the io_uring multishot receive is armed
+        bool recvArmed = false;
+        // The io_uring provided buffers, by buffer ID. Payloads reference them directly, so a
+        // buffer that's still referenced is replaced by a fresh one when it's recycled.
+        std::vector<Buffer> ringBufs;
+    };
+    
+    // The write thread's in-flight io_uring SENDMSG. The kernel may read `msg`, `iov` and the
+    // replies that they reference until it completes.
+    struct _URingSend
+    {
+        msghdr msg = {};
+        std::vector<iovec> iov;
+        bool inFlight = false;
+    };
+    
+    struct _IsoUrb;
+    struct _Handler;
+    
+    struct _ReceiveAwaiter
+    {
+        VirtualUSBDevice& dev;
+        _Handler& h;
+        XferRef xfer;
+        bool ok = false;
+        
+        bool await_ready() { return false; }
+        bool await_suspend(std::coroutine_handle<> coro) { return dev._receiveSuspend(*this, coro); }
+        XferRef await_resume()
+        {
+            if (!ok) dev._throwErr();
+            return std::move(xfer);
+        }
+    };
+    
+    struct _SendAwaiter
+    {
+        VirtualUSBDevice& dev;
+        uint8_t ep = 0;
+        Buffer data;
+        bool ok = false;
+        
+        bool await_ready() { return false; }
+        bool await_suspend(std::coroutine_handle<> coro) { return dev._sendSuspend(*this, coro); }
+        void await_resume() { if (!ok) dev._throwErr(); }
+    };
+    
     static const std::exception& ErrExtract(Err err);
-
+    
     VirtualUSBDevice(const Info& info);
     
     ~VirtualUSBDevice();
     
-    void start();
+    // socket: an established usbip connection to serve the device over (eg one imported via
+    // USBIPServer), instead of attaching the device to the local vhci-hcd. The device takes
+    // ownership of the socket.
+    void start(int socket=-1);
     
     void stop();
     
     std::optional<Xfer> read(std::chrono::milliseconds timeout=std::chrono::milliseconds::max());
     
+    std::optional<XferRef> readRef(std::chrono::milliseconds timeout=std::chrono::milliseconds::max());
+    
+    // Batched read(): waits (up to `timeout`) for a transfer, then handles every command that's
+    // already queued, without waiting for more, until `xfers` is full. Returns the number of
+    // transfers stored at the start of `xfers` (0 if the timeout expired, or right away if
+    // `xfers` is empty). The batch takes the read lock once, and flushes its replies once, so
+    // a burst of OUT URBs costs a call rather than a call per URB. If the device fails partway
+    // through a batch, the transfers that were read are returned, and the next call reports
+    // the error.
+    size_t readMany(std::span<Xfer> xfers, std::chrono::milliseconds timeout=std::chrono::milliseconds::max());
+    
+    size_t readRefMany(std::span<XferRef> xfers, std::chrono::milliseconds timeout=std::chrono::milliseconds::max());
+    
+    // Queues `data` for IN endpoint `ep`, to be sent as the host requests it. Writes are a
+    // stream: they're sent in wMaxPacketSize packets, and consecutive writes fill a URB until
+    // it's full or the queued data runs out. A zero-length write ends the transfer (sending a
+    // zero-length packet if nothing precedes it). Writes to the default control endpoint are
+    // sent as transfers of their own. Interrupt endpoints send one transfer per poll: at most
+    // one every bInterval frames (full/low speed), or 2^(bInterval-1) microframes (high speed
+    // and above).
     void write(uint8_t ep, const void* data, size_t len);
     
+    // Like write(), but sends `data` without copying it. Use Buffer::Wrap() to send from
+    // caller-owned memory and be notified (via the release function) once it's been sent.
+    // The release function may be called with the device's lock held, so it mustn't call
+    // back into the device.
+    void write(uint8_t ep, Buffer data);
+    
     Err err();
     
+    const Info& info() const { return _info; }
+    
+    // The usbip speed (USBIPLib::usb_device_speed) that the device attaches with
+    uint32_t speed() const;
+    
+    // Hit/miss statistics of the buffer pool backing command and reply payloads. The pool is
+    // shared by every device in the process.
+    std::vector<BufferPool::Stats> poolStats();
+    
+    // Snapshots the latency stats of every endpoint that has completed a URB. Can be called
+    // at any time, from any thread.
+    std::vector<LatencyStats> latencyStats();
+    
+    // Writes the recent usbip traffic in the trace ring to a pcap file (as usbmon packets,
+    // which Wireshark decodes). Can be called at any time, from any thread.
+    void writeTrace(const char* path);
+    
+    // Snapshots the device's counters. Doesn't take any locks, so it can be called at any
+    // time, from any thread (eg a metrics exporter), without disturbing the data path.
+    Stats stats();
+    
+    // The device's frame clock: the number of frames (1ms, at full speed) or microframes
+    // (125us, at high speed and above) since a process-wide epoch, which every device shares.
+    // Isochronous packets and interrupt endpoint polls are scheduled against it.
+    uint64_t frame() const;
+    
+    // Streams the packets of isochronous IN endpoint `ep` from `fn`. The host's URBs are
+    // scheduled one packet per endpoint interval, and complete in real time: once the frame
+    // of their last packet has passed. `fn` is called for each of their packets at that point,
+    // on the timer thread that every device in the process shares, so it should be quick.
+    // Without a source, the packets are empty. Must be called before start().
+    void setIsoSource(uint8_t ep, IsoSource fn);
+    
+    // Streams the packets of isochronous OUT endpoint `ep` to `fn`, which is called as their
+    // URBs complete (see setIsoSource()). Without a sink, isochronous OUT URBs are returned by
+    // read() as they arrive, like any other. Must be called before start().
+    void setIsoSink(uint8_t ep, IsoSink fn);
+    
+    // Hands the transfers to OUT endpoint `ep` (0 for the default control endpoint's
+    // non-standard requests, in either direction) to `fn`, instead of read() returning them.
+    // `fn` is called on the thread that receives the transfers from the socket (the read
+    // thread, the worker, or the read() caller, depending on the engine), which saves the
+    // handoff to read(), but holds up the device's other traffic while it runs. Pass `pool`
+    // to run heavy handlers on its workers instead. Either way, calls for an endpoint don't
+    // overlap, and are in the order that the host submitted the transfers. If `fn` throws,
+    // the device is reset. Once a device has handlers, the receiving side handles every
+    // command, and read() only returns the transfers to endpoints without handlers; so if
+    // every endpoint that the host sends to has one, read() needn't be called (except to
+    // drive Engine::EventLoop). Must be called before start(); `pool` must outlive the
+    // device.
+    void setHandler(uint8_t ep, Handler fn, IOWorkerPool* pool=nullptr);
+    
+    // Awaitable I/O, for devices whose endpoints run sequential protocols as coroutines (see
+    // Task), without a thread each. Coroutines are resumed by the device's own threads as the
+    // host makes progress: usually the thread that receives from the socket (as with
+    // setHandler()), which with Engine::EventLoop is the read() caller. So they should be
+    // quick, and mustn't call read() or stop(). If the device stops or fails, the co_await
+    // throws its error; coroutines that are waiting at that point are resumed by whoever
+    // stops the device (eg stop(), or the I/O thread that hit the failure).
+    //
+    // `co_await receive(ep)` returns the next transfer to OUT endpoint `ep`. It's a handler
+    // (see setHandler()), so the first receive() for an endpoint must be before start(), and
+    // only one coroutine at a time may await an endpoint.
+    _ReceiveAwaiter receive(uint8_t ep);
+    
+    // `co_await send(ep, data)` queues `data` for IN endpoint `ep` (as write() does), and
+    // resumes once the host has taken all of it
+    _SendAwaiter send(uint8_t ep, Buffer data);
+    
+    // `co_await controlRequest()` returns the next non-standard request to the default
+    // control endpoint (`setupReq`), with its data stage if it's host->device. Answer
+    // device->host requests with send(USB::Endpoint::DefaultIn, ...).
+    _ReceiveAwaiter controlRequest();
+
 private:
     static constexpr uint8_t _DeviceID = 1;
     
+    static constexpr unsigned _URingEntries = 16;
+    static constexpr uint16_t _URingBufGroup = 0;
+    static constexpr uint16_t _URingBufCount = 16;
+    static constexpr size_t _URingBufLen = 0x4000;
+    // Fixed file index of the usbip socket in the read/write rings
+    static constexpr int _URingSocket = 0;
+    
+    // Max recv() calls per worker callback (Engine::WorkerPool), so that a busy device doesn't
+    // monopolize its worker
+    static constexpr size_t _WorkerReadsMax = 16;
+    
+    // Max packets per isochronous URB
+    static constexpr size_t _IsoPacketsMax = 1024;
+    
     USB::SetupRequest _GetSetupRequest(const _Cmd& cmd) const;
     
     uint8_t _GetEndpointAddr(const _Cmd& cmd);
     
-    static void _Read(int socket, void* data, size_t len);
+    static ssize_t _Recv(int socket, void* data, size_t len);
     
     static void _Write(int socket, const void* data, size_t len);
     
-    static _Cmd _ReadCmd(int socket);
+    static void _GatherReps(const std::deque<_Rep>& reps, size_t off, std::vector<iovec>& iov);
+    
+    void _popReps(std::deque<_Rep>& reps, size_t& off, size_t len);
+    
+    bool _sendReps(int socket, std::deque<_Rep>& reps, size_t& off, std::vector<iovec>& iov);
+    
+    bool _sendReps(IOURing& ring, std::deque<_Rep>& reps, size_t& off, _URingSend& send, bool wait);
+    
+    bool _collectReps(std::deque<_Rep>& reps);
+    
+    static size_t _EPAddrIdx(uint32_t ep, uint32_t dir);
+    
+    static USBIP::HEADER _BFHHeader(const USBIP::HEADER& h);
+    
+    void _trace(const USBIP::HEADER& header, const uint8_t* payload, size_t payloadLen,
+        const uint8_t* iso=nullptr, size_t isoLen=0);
+    
+    size_t _read(size_t cap, std::chrono::milliseconds timeout, const std::function<void(XferRef&& xfer)>& fn);
+    
+    bool _popCmd(_Cmd& cmd);
+    
+    void _cmdsReceived(std::deque<_Cmd>& cmds, size_t off);
+    
+    void _dispatchCmds(std::deque<_Cmd>& cmds, size_t off);
+    
+    void _deliver(_Handler& h, XferRef&& xfer);
+    
+    uint32_t _drainHandler(_Handler& h);
+    
+    bool _receiveSuspend(_ReceiveAwaiter& aw, std::coroutine_handle<> coro);
+    
+    bool _sendSuspend(_SendAwaiter& aw, std::coroutine_handle<> coro);
+    
+    void _wakeCoroutines();
+    
+    void _throwErr();
+    
+    void _recordCompletion(const _Rep& rep, _Time sentTime);
+    
+    static _Cmd _ParseCmd(const void* data, const uint8_t* xferTypes);
+    
+    static void _ParseCmds(_RecvBuf& rb, const uint8_t* data, size_t len, const Buffer& src, std::deque<_Cmd>& cmds);
+    
+    static bool _ReadCmds(int socket, _RecvBuf& rb, std::deque<_Cmd>& cmds);
+    
+    static void _ReadCmds(IOURing& ring, _RecvBuf& rb, std::deque<_Cmd>& cmds);
+    
+    static void _ReadCmdsEnd(IOURing& ring, _RecvBuf& rb);
     
     static uint32_t _SpeedFromBCDUSB(uint16_t bcdUSB);
     
@@ -104,28 +474,55 @@ private:
     
     void _writeThread();
     
+    void _isoTimer(size_t idx);
+    
+    void _pollInEndpoint(uint8_t epIdx);
+    
+    bool _runEventLoop(std::chrono::milliseconds timeout);
+    
+    uint32_t _workerIO(uint32_t events);
+    
+    void _flushReps();
+    
     void _reply(const _Cmd& cmd, const void* data, size_t len, int32_t status);
     
-    std::optional<Xfer> _handleCmd(_Cmd& cmd);
+    void _reply(const _Cmd& cmd, Buffer payload, size_t len, int32_t status);
+    
+    void _queueRep(const USBIP::HEADER& header, _Rep&& rep);
     
-    std::optional<Xfer> _handleCmdSubmitEP0(_Cmd& cmd);
+    std::optional<XferRef> _handleCmd(_Cmd& cmd);
     
-    std::optional<Xfer> _handleCmdSubmitEPX(_Cmd& cmd);
+    std::optional<XferRef> _handleCmdSubmitEP0(_Cmd& cmd);
     
-    Xfer _handleCmdSubmitEPXOut(_Cmd& cmd);
+    std::optional<XferRef> _handleCmdSubmitEPX(_Cmd& cmd);
+    
+    XferRef _handleCmdSubmitEPXOut(_Cmd& cmd);
     
     void _handleCmdSubmitEPXIn(_Cmd& cmd);
     
     void _sendDataForInEndpoint(uint8_t epIdx);
     
+    void _sendInXfer(uint8_t epIdx);
+    
+    void _schedulePoll(uint8_t epIdx);
+    
+    std::optional<XferRef> _handleCmdSubmitIso(_Cmd& cmd);
+    
+    void _completeIso(const _IsoUrb& urb);
+    
+    _Time _frameTime(uint64_t frame) const;
+    
     void _handleCmdUnlink(const _Cmd& cmd);
     
     void _handleCmdSubmitEP0StandardRequest(const _Cmd& cmd, const USB::SetupRequest& req);
     
-    void _reset(std::unique_lock<std::mutex>& lock, Err err);
+    void _reset(std::unique_lock<std::mutex>& lock, Err err, bool wait=true);
     
     const Info _info = {};
     
+    struct _Impl;
+    std::unique_ptr<_Impl> _s;
+
 
 
 #undef USB
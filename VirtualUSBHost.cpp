@@ -0,0 +1,471 @@
+#include "VirtualUSBHost.h"
+#include <cerrno>
+#include <cstring>
+#include <optional>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "LIB/Toastbox/RuntimeError.h"
+
+#define USB             Toastbox::USB
+#define Endian          Toastbox::Endian
+
+static const std::exception_ptr _ErrStopped = std::make_exception_ptr(std::runtime_error("VirtualUSBHost stopped"));
+
+static void _Recv(int socket, void* data, size_t len)
+{
+    size_t off = 0;
+    while (off < len)
+    {
+        const ssize_t sr = recv(socket, (uint8_t*)data+off, len-off, 0);
+        if (sr == 0) throw RUNTIME_ERROR("device disconnected");
+        if (sr < 0)
+        {
+            if (errno == EINTR) continue;
+            throw RUNTIME_ERROR("recv failed: %s", strerror(errno));
+        }
+        off += sr;
+    }
+}
+
+static void _CheckUrb(const VirtualUSBHost::Urb& urb, size_t minLen, const char* what)
+{
+    if (urb.status)
+        throw RUNTIME_ERROR("%s failed: status %d", what, urb.status);
+    if (urb.len < minLen)
+        throw RUNTIME_ERROR("%s returned %zu bytes, expected at least %zu", what, urb.len, minLen);
+}
+
+VirtualUSBHost::VirtualUSBHost(const Info& info) : _info(info)
+{
+    assert(_info.device);
+    assert(_info.queueDepth);
+}
+
+VirtualUSBHost::~VirtualUSBHost()
+{
+    stop();
+}
+
+void VirtualUSBHost::start()
+{
+    assert(_socket < 0);
+    int sockets[2] = {-1,-1};
+    const int ir = socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, sockets);
+    if (ir) throw RUNTIME_ERROR("socketpair failed: %s", strerror(errno));
+    _socket = sockets[0];
+    
+    // The device owns its end of the socketpair from here on
+    _info.device->start(sockets[1]);
+    _thread = std::thread([this] { _readThread(); });
+}
+
+void VirtualUSBHost::stop()
+{
+    if (_socket < 0) return;
+    // Fail the URBs in flight, and wake the read thread
+    _fail(_ErrStopped);
+    shutdown(_socket, SHUT_RDWR);
+    if (_thread.joinable()) _thread.join();
+    close(_socket);
+    _socket = -1;
+}
+
+void VirtualUSBHost::enumerate()
+{
+    constexpr uint8_t StandardDeviceIn =
+        USB::RequestType::DirectionIn|USB::RequestType::TypeStandard|USB::RequestType::RecipientDevice;
+    constexpr uint8_t StandardDeviceOut =
+        USB::RequestType::DirectionOut|USB::RequestType::TypeStandard|USB::RequestType::RecipientDevice;
+    
+    Urb urb = control({
+        .bmRequestType  = StandardDeviceIn,
+        .bRequest       = USB::Request::GetDescriptor,
+        .wValue         = (uint16_t)(USB::DescriptorType::Device<<8),
+        .wIndex         = 0,
+        .wLength        = sizeof(USB::DeviceDescriptor),
+    });
+    _CheckUrb(urb, sizeof(USB::DeviceDescriptor), "GET_DESCRIPTOR(Device)");
+    _deviceDesc.assign(urb.data.data(), urb.data.data()+urb.len);
+    
+    // Read the configuration descriptor's header to learn its total length, then the whole
+    // configuration
+    USB::SetupRequest getConfigDesc = {
+        .bmRequestType  = StandardDeviceIn,
+        .bRequest       = USB::Request::GetDescriptor,
+        .wValue         = (uint16_t)(USB::DescriptorType::Configuration<<8),
+        .wIndex         = 0,
+        .wLength        = sizeof(USB::ConfigurationDescriptor),
+    };
+    urb = control(getConfigDesc);
+    _CheckUrb(urb, sizeof(USB::ConfigurationDescriptor), "GET_DESCRIPTOR(Configuration)");
+    getConfigDesc.wLength = Endian::HFL_U16(((const USB::ConfigurationDescriptor*)urb.data.data())->wTotalLength);
+    
+    urb = control(getConfigDesc);
+    _CheckUrb(urb, getConfigDesc.wLength, "GET_DESCRIPTOR(Configuration)");
+    _configDesc.assign(urb.data.data(), urb.data.data()+urb.len);
+    
+    const USB::ConfigurationDescriptor& configDesc = *(const USB::ConfigurationDescriptor*)_configDesc.data();
+    urb = control({
+        .bmRequestType  = StandardDeviceOut,
+        .bRequest       = USB::Request::SetConfiguration,
+        .wValue         = Endian::HFL_U8(configDesc.bConfigurationValue),
+        .wIndex         = 0,
+        .wLength        = 0,
+    });
+    _CheckUrb(urb, 0, "SET_CONFIGURATION");
+}
+
+uint32_t VirtualUSBHost::submitControl(const USB::SetupRequest& req, Buffer data, Callback cb)
+{
+    const uint8_t dir = req.bmRequestType & USB::RequestType::DirectionMask;
+    [[maybe_unused]] const bool in = (dir == USB::RequestType::DirectionIn);
+    assert(in ? !data : data.len()==req.wLength);
+    return _submit(USB::Endpoint::DefaultOut|dir, &req, std::move(data), req.wLength, 0, std::move(cb));
+}
+
+uint32_t VirtualUSBHost::submitOut(uint8_t ep, Buffer data, Callback cb)
+{
+    assert((ep & USB::Endpoint::DirectionMask) == USB::Endpoint::DirectionOut);
+    const size_t len = data.len();
+    return _submit(ep, nullptr, std::move(data), len, 0, std::move(cb));
+}
+
+uint32_t VirtualUSBHost::submitIn(uint8_t ep, size_t len, Callback cb)
+{
+    assert((ep & USB::Endpoint::DirectionMask) == USB::Endpoint::DirectionIn);
+    return _submit(ep, nullptr, Buffer(), len, 0, std::move(cb));
+}
+
+uint32_t VirtualUSBHost::submitIso(uint8_t ep, size_t count, size_t packetLen, Buffer data, Callback cb)
+{
+    [[maybe_unused]] const bool in = (ep & USB::Endpoint::DirectionMask) == USB::Endpoint::DirectionIn;
+    assert(count && count<=(size_t)_IsoPacketsMax);
+    assert(in ? !data : data.len()==count*packetLen);
+    return _submit(ep, nullptr, std::move(data), count*packetLen, count, std::move(cb));
+}
+
+void VirtualUSBHost::unlink(uint32_t seqnum)
+{
+    using namespace Endian;
+    uint32_t unlinkSeqnum = 0;
+    uint8_t ep = 0;
+    {
+        auto lock = std::unique_lock(_lock);
+        if (_err) std::rethrow_exception(_err);
+        // Nothing to do if the URB already completed
+        auto it = _pending.find(seqnum);
+        if (it == _pending.end()) return;
+        ep = it->second.ep;
+        unlinkSeqnum = ++_seqnum;
+        _unlinks[unlinkSeqnum] = seqnum;
+    }
+    
+    const bool in = (ep & USB::Endpoint::DirectionMask) == USB::Endpoint::DirectionIn;
+    USBIP::HEADER header = {};
+    header.base = {
+        .command    = BFH_U32(USBIPLib::USBIP_CMD_UNLINK),
+        .seqnum     = BFH_U32(unlinkSeqnum),
+        .devid      = BFH_U32(_DevID),
+        .direction  = BFH_U32(in ? USBIPLib::USBIP_DIR_IN : USBIPLib::USBIP_DIR_OUT),
+        .ep         = BFH_U32(ep & USB::Endpoint::IndexMask),
+    };
+    header.cmd_unlink.seqnum = BFH_U32(seqnum);
+    _send(header, Buffer());
+}
+
+void VirtualUSBHost::drain()
+{
+    auto lock = std::unique_lock(_lock);
+    while (!_pending.empty() || _callbacks)
+        _signal.wait(lock);
+}
+
+VirtualUSBHost::Urb VirtualUSBHost::control(const USB::SetupRequest& req, const void* data)
+{
+    const bool in = (req.bmRequestType & USB::RequestType::DirectionMask) == USB::RequestType::DirectionIn;
+    // The data only has to outlive the transfer, so don't copy it
+    Buffer buf;
+    if (!in && req.wLength) buf = Buffer::Wrap(data, req.wLength, nullptr);
+    return _wait([&] (Callback cb) { submitControl(req, std::move(buf), std::move(cb)); });
+}
+
+VirtualUSBHost::Urb VirtualUSBHost::out(uint8_t ep, const void* data, size_t len)
+{
+    Buffer buf = Buffer::Wrap(data, len, nullptr);
+    return _wait([&] (Callback cb) { submitOut(ep, std::move(buf), std::move(cb)); });
+}
+
+VirtualUSBHost::Urb VirtualUSBHost::in(uint8_t ep, size_t len)
+{
+    return _wait([&] (Callback cb) { submitIn(ep, len, std::move(cb)); });
+}
+
+VirtualUSBHost::Urb VirtualUSBHost::iso(uint8_t ep, size_t count, size_t packetLen, const void* data)
+{
+    Buffer buf;
+    if (data) buf = Buffer::Wrap(data, count*packetLen, nullptr);
+    return _wait([&] (Callback cb) { submitIso(ep, count, packetLen, std::move(buf), std::move(cb)); });
+}
+
+uint32_t VirtualUSBHost::_submit(uint8_t ep, const USB::SetupRequest* req, Buffer data, size_t len, size_t packets, Callback cb)
+{
+    using namespace Endian;
+    uint32_t seqnum = 0;
+    {
+        auto lock = std::unique_lock(_lock);
+        // Wait for room in the queue
+        while (!_err && _pending.size()>=_info.queueDepth)
+            _signal.wait(lock);
+        if (_err) std::rethrow_exception(_err);
+        seqnum = ++_seqnum;
+        _pending[seqnum] = {.ep = ep, .cb = std::move(cb)};
+    }
+    
+    const bool in = (ep & USB::Endpoint::DirectionMask) == USB::Endpoint::DirectionIn;
+    USBIP::HEADER header = {};
+    header.base = {
+        .command    = BFH_U32(USBIPLib::USBIP_CMD_SUBMIT),
+        .seqnum     = BFH_U32(seqnum),
+        .devid      = BFH_U32(_DevID),
+        .direction  = BFH_U32(in ? USBIPLib::USBIP_DIR_IN : USBIPLib::USBIP_DIR_OUT),
+        .ep         = BFH_U32(ep & USB::Endpoint::IndexMask),
+    };
+    header.cmd_submit.transfer_buffer_length = BFH_S32((int32_t)len);
+    if (req)
+    {
+        // The setup packet is little-endian on the wire
+        const USB::SetupRequest setup = {
+            .bmRequestType  = LFH_U8(req->bmRequestType),
+            .bRequest       = LFH_U8(req->bRequest),
+            .wValue         = LFH_U16(req->wValue),
+            .wIndex         = LFH_U16(req->wIndex),
+            .wLength        = LFH_U16(req->wLength),
+        };
+        memcpy(header.cmd_submit.setup.u8, &setup, sizeof(setup));
+    }
+    
+    // Isochronous packets are equally sized, and follow each other in the buffer
+    std::vector<USBIP::ISO_PACKET_DESCRIPTOR> iso(packets);
+    if (packets)
+    {
+        const size_t packetLen = len/packets;
+        header.cmd_submit.transfer_flags = BFH_U32(USBIPLib::USBIP_URB_ISO_ASAP);
+        header.cmd_submit.number_of_packets = BFH_S32((int32_t)packets);
+        for (size_t i=0; i<packets; i++)
+        {
+            iso[i] = {
+                .offset = BFH_U32((uint32_t)(i*packetLen)),
+                .length = BFH_U32((uint32_t)packetLen),
+            };
+        }
+    }
+    
+    _send(header, (in ? Buffer() : data), iso.data(), iso.size()*sizeof(iso[0]));
+    return seqnum;
+}
+
+VirtualUSBHost::Urb VirtualUSBHost::_wait(const std::function<void(Callback)>& submit)
+{
+    std::mutex lock;
+    std::condition_variable signal;
+    std::optional<Urb> urb;
+    submit([&] (Urb&& x)
+    {
+        // Notify with the lock held, so that we can't return (destroying `signal`) before
+        // notify_all() returns
+        auto l = std::unique_lock(lock);
+        urb = std::move(x);
+        signal.notify_all();
+    });
+    
+    auto l = std::unique_lock(lock);
+    while (!urb) signal.wait(l);
+    return std::move(*urb);
+}
+
+void VirtualUSBHost::_send(const USBIP::HEADER& header, const Buffer& data, const void* iso, size_t isoLen)
+{
+    iovec iov[] = {
+        {.iov_base = (void*)&header,        .iov_len = sizeof(header)},
+        {.iov_base = (void*)data.data(),    .iov_len = data.len()},
+        {.iov_base = (void*)iso,            .iov_len = isoLen},
+    };
+    msghdr msg = {
+        .msg_iov    = iov,
+        .msg_iovlen = std::size(iov),
+    };
+    
+    auto lock = std::unique_lock(_writeLock);
+    for (;;)
+    {
+        const ssize_t sr = sendmsg(_socket, &msg, MSG_NOSIGNAL);
+        if (sr < 0)
+        {
+            if (errno == EINTR) continue;
+            // The connection is broken. Shut it down so that the read thread fails the URBs
+            // in flight, including this one.
+            shutdown(_socket, SHUT_RDWR);
+            return;
+        }
+        
+        // Skip the iovecs that were sent completely, and the sent part of the next one
+        size_t len = sr;
+        while (msg.msg_iovlen && len>=msg.msg_iov->iov_len)
+        {
+            len -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (!msg.msg_iovlen) return;
+        msg.msg_iov->iov_base = (uint8_t*)msg.msg_iov->iov_base + len;
+        msg.msg_iov->iov_len -= len;
+    }
+}
+
+void VirtualUSBHost::_readThread()
+{
+    using namespace Endian;
+    try
+    {
+        for (;;)
+        {
+            USBIP::HEADER header;
+            _Recv(_socket, &header, sizeof(header));
+            const uint32_t cmd = HFB_U32(header.base.command);
+            const uint32_t seqnum = HFB_U32(header.base.seqnum);
+            
+            switch (cmd)
+            {
+                case USBIPLib::USBIP_RET_SUBMIT:
+                {
+                    uint8_t ep = 0;
+                    {
+                        auto lock = std::unique_lock(_lock);
+                        auto it = _pending.find(seqnum);
+                        if (it == _pending.end())
+                        {
+                            // Failed by stop() meanwhile
+                            if (_err) return;
+                            throw RUNTIME_ERROR("RET_SUBMIT for unknown seqnum: %u", seqnum);
+                        }
+                        ep = it->second.ep;
+                    }
+                    
+                    const int32_t len = HFB_S32(header.ret_submit.actual_length);
+                    if (len < 0) throw RUNTIME_ERROR("invalid actual_length: %d", len);
+                    const int32_t packets = HFB_S32(header.ret_submit.number_of_packets);
+                    if (packets<0 || packets>_IsoPacketsMax)
+                        throw RUNTIME_ERROR("invalid number_of_packets: %d", packets);
+                    
+                    Urb urb = {
+                        .seqnum     = seqnum,
+                        .status     = HFB_S32(header.ret_submit.status),
+                        .len        = (size_t)len,
+                        .startFrame = HFB_S32(header.ret_submit.start_frame),
+                        .packets    = std::vector<USBIP::ISO_PACKET_DESCRIPTOR>(packets),
+                    };
+                    
+                    // Only IN replies carry data
+                    if ((ep & USB::Endpoint::DirectionMask)==USB::Endpoint::DirectionIn && len)
+                    {
+                        urb.data = _pool.alloc(len);
+                        _Recv(_socket, urb.data.data(), len);
+                    }
+                    
+                    // Followed by the isochronous packet descriptors, in either direction
+                    if (packets)
+                        _Recv(_socket, urb.packets.data(), urb.packets.size()*sizeof(urb.packets[0]));
+                    for (USBIP::ISO_PACKET_DESCRIPTOR& d : urb.packets)
+                    {
+                        d = {
+                            .offset         = HFB_U32(d.offset),
+                            .length         = HFB_U32(d.length),
+                            .actual_length  = HFB_U32(d.actual_length),
+                            .status         = HFB_U32(d.status),
+                        };
+                    }
+                    _complete(std::move(urb));
+                    break;
+                }
+                
+                case USBIPLib::USBIP_RET_UNLINK:
+                {
+                    uint32_t urbSeqnum = 0;
+                    {
+                        auto lock = std::unique_lock(_lock);
+                        auto it = _unlinks.find(seqnum);
+                        if (it == _unlinks.end())
+                        {
+                            if (_err) return;
+                            throw RUNTIME_ERROR("RET_UNLINK for unknown seqnum: %u", seqnum);
+                        }
+                        urbSeqnum = it->second;
+                        _unlinks.erase(it);
+                    }
+                    
+                    // -ECONNRESET: the device dropped the URB, so it won't complete otherwise.
+                    // (0: the URB completed before the device saw the unlink.)
+                    if (HFB_S32(header.ret_unlink.status) == -ECONNRESET)
+                        _complete({.seqnum = urbSeqnum, .status = -ECONNRESET});
+                    break;
+                }
+                
+                default:
+                    throw RUNTIME_ERROR("invalid usbip command: %u", cmd);
+            }
+        }
+    }
+    catch (const std::exception& e)
+    {
+        _fail(std::current_exception());
+    }
+}
+
+void VirtualUSBHost::_complete(Urb&& urb)
+{
+    _Pending p;
+    {
+        auto lock = std::unique_lock(_lock);
+        auto it = _pending.find(urb.seqnum);
+        if (it == _pending.end()) return; // Already failed
+        p = std::move(it->second);
+        _pending.erase(it);
+        _callbacks++;
+        _signal.notify_all();
+    }
+    
+    urb.ep = p.ep;
+    p.cb(std::move(urb));
+    
+    auto lock = std::unique_lock(_lock);
+    _callbacks--;
+    _signal.notify_all();
+}
+
+void VirtualUSBHost::_fail(_Err err)
+{
+    std::unordered_map<uint32_t,_Pending> pending;
+    {
+        auto lock = std::unique_lock(_lock);
+        if (!_err) _err = err;
+        pending = std::move(_pending);
+        _pending.clear();
+        _unlinks.clear();
+        _callbacks++;
+        _signal.notify_all();
+    }
+    
+    for (auto& [seqnum, p] : pending)
+    {
+        p.cb({
+            .seqnum = seqnum,
+            .ep     = p.ep,
+            .status = -ESHUTDOWN,
+        });
+    }
+    
+    auto lock = std::unique_lock(_lock);
+    _callbacks--;
+    _signal.notify_all();
+}
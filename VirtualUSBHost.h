@@ -0,0 +1,146 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include <unordered_map>
+#include "VirtualUSBDevice.h"
+
+// Macros until C++ supports class-scoped namespace aliases / `using namespace` in class scope
+#define USB             Toastbox::USB
+
+// VirtualUSBHost: a userspace stand-in for vhci-hcd, for driving a VirtualUSBDevice where the
+// kernel module isn't available (eg CI boxes and containers). It speaks the host side of the
+// usbip URB protocol to the device over a socketpair: it submits control, bulk, interrupt and
+// isochronous URBs (keeping up to Info::queueDepth in flight), unlinks them, and completes them as the
+// device replies.
+//
+// The device's app has to run its usual read() loop, since that's what services the URBs
+// (including the standard control requests used by enumerate()), unless the device's endpoints
+// all have handlers (see VirtualUSBDevice::setHandler()).
+class VirtualUSBHost
+{
+public:
+    struct Info
+    {
+        VirtualUSBDevice* device = nullptr; // Not started; start() starts it
+        // Max URBs in flight; submitting more blocks until one completes
+        size_t queueDepth = 32;
+    };
+    
+    struct Urb
+    {
+        uint32_t seqnum = 0;
+        uint8_t ep = 0; // Endpoint address, including the direction bit
+        // 0 on success, -ECONNRESET if the URB was unlinked, -ESHUTDOWN if the connection
+        // to the device failed (or the host was stopped) first
+        int32_t status = 0;
+        Buffer data; // The data received (IN URBs only)
+        size_t len = 0; // The number of bytes transferred
+        // Isochronous URBs only: the frame of the first packet, and the packets' descriptors
+        // (host endian). The data of IN packets is packed back to back in `data`, without
+        // the gaps between their buffers.
+        int32_t startFrame = 0;
+        std::vector<USBIP::ISO_PACKET_DESCRIPTOR> packets;
+    };
+    
+    // Called on the host's read thread when a URB completes. Mustn't submit URBs or perform
+    // synchronous transfers, since completing URBs is what makes room for them.
+    using Callback = std::function<void(Urb&& urb)>;
+    
+    VirtualUSBHost(const Info& info);
+    
+    ~VirtualUSBHost();
+    
+    // Connects to the device and starts the device
+    void start();
+    
+    // Disconnects from the device, which resets the device. URBs that are still in flight
+    // complete with -ESHUTDOWN.
+    void stop();
+    
+    // Reads the device and configuration descriptors, and selects the first configuration
+    void enumerate();
+    
+    // The descriptors read by enumerate()
+    const std::vector<uint8_t>& deviceDesc() const { return _deviceDesc; }
+    const std::vector<uint8_t>& configDesc() const { return _configDesc; }
+    
+    // Asynchronous transfers. They return the URB's seqnum (for unlink()), and `cb` is called
+    // exactly once for the URB. They only throw if the host has already failed.
+    
+    // Control transfer on endpoint 0. For OUT requests, `data` is the data stage and must be
+    // `req.wLength` bytes.
+    uint32_t submitControl(const USB::SetupRequest& req, Buffer data, Callback cb);
+    
+    // Bulk/interrupt OUT transfer of `data` to OUT endpoint `ep`
+    uint32_t submitOut(uint8_t ep, Buffer data, Callback cb);
+    
+    // Bulk/interrupt IN transfer of up to `len` bytes from IN endpoint `ep`
+    uint32_t submitIn(uint8_t ep, size_t len, Callback cb);
+    
+    // Isochronous transfer of `count` packets of up to `packetLen` bytes each, scheduled as
+    // soon as possible. For OUT endpoints, `data` holds the packets back to back (and must be
+    // count*packetLen bytes); for IN endpoints it must be empty.
+    uint32_t submitIso(uint8_t ep, size_t count, size_t packetLen, Buffer data, Callback cb);
+    
+    // Asks the device to cancel URB `seqnum`. If the device hadn't completed it yet, it
+    // completes with -ECONNRESET.
+    void unlink(uint32_t seqnum);
+    
+    // Waits until no URBs are in flight, and their callbacks have returned
+    void drain();
+    
+    // Synchronous versions of the transfers above
+    Urb control(const USB::SetupRequest& req, const void* data=nullptr);
+    Urb out(uint8_t ep, const void* data, size_t len);
+    Urb in(uint8_t ep, size_t len);
+    Urb iso(uint8_t ep, size_t count, size_t packetLen, const void* data=nullptr);
+
+private:
+    using _Err = std::exception_ptr;
+    
+    struct _Pending
+    {
+        uint8_t ep = 0;
+        Callback cb;
+    };
+    
+    uint32_t _submit(uint8_t ep, const USB::SetupRequest* req, Buffer data, size_t len, size_t packets, Callback cb);
+    
+    Urb _wait(const std::function<void(Callback)>& submit);
+    
+    void _send(const USBIP::HEADER& header, const Buffer& data, const void* iso=nullptr, size_t isoLen=0);
+    
+    void _readThread();
+    
+    void _complete(Urb&& urb);
+    
+    void _fail(_Err err);
+    
+    static constexpr uint32_t _DevID = 1;
+    static constexpr int32_t _IsoPacketsMax = 1024;
+    
+    const Info _info = {};
+    BufferPool _pool; // For the data of IN URBs
+    std::vector<uint8_t> _deviceDesc;
+    std::vector<uint8_t> _configDesc;
+    
+    int _socket = -1;
+    std::thread _thread;
+    
+    std::mutex _writeLock; // Serializes commands on `_socket`
+    
+    std::mutex _lock; // Protects the fields below
+    std::condition_variable _signal; // Signalled when a URB completes, or the host fails
+    _Err _err;
+    uint32_t _seqnum = 0;
+    std::unordered_map<uint32_t,_Pending> _pending; // URBs in flight, by seqnum
+    std::unordered_map<uint32_t,uint32_t> _unlinks; // Unlinks in flight: seqnum -> URB seqnum
+    size_t _callbacks = 0; // Completion callbacks that are running
+};
+
+#undef USB
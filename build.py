@@ -4,10 +4,14 @@ import time
 import glob
 
 additional_files = []
+# Directories with their own executables (the benchmark, `make bench`, and the tests, `make test`)
+excluded_dirs = ['Bench', 'Tests']
 
 def get_files(path:str)->list:
     result = []
     for x in os.walk(path):
+        if os.path.relpath(x[0], path).split(os.sep)[0] in excluded_dirs:
+            continue
         for y in glob.glob(os.path.join(x[0], '*.cpp')):
             result.append(y[len(path)+1:])
     # print(',\n'.join(result))
@@ -18,7 +22,7 @@ compiler_path = "g++"
 compiler_flags =   ["-O0", 
                     "-g3", 
                     "-Wall", 
-                    "-std=c++17", 
+                    "-std=c++20", 
                     "-iquote", 
                     "Lib",
                     ]
@@ -55,8 +59,8 @@ def link_all(files:list):
     # print(c_str)
     return subprocess.call(c_str, shell=True)
 
-# g++ -O0 -g3 -Wall -std=c++17 -iquote Lib main.cpp -c -o temp_files/main.o
-# g++ -O0 -g3 -Wall -std=c++17 -iquote Lib -ludev -lpthread temp_files/main.o  -o main
+# g++ -O0 -g3 -Wall -std=c++20 -iquote Lib main.cpp -c -o temp_files/main.o
+# g++ -O0 -g3 -Wall -std=c++20 -iquote Lib -ludev -lpthread temp_files/main.o  -o main
 
 
 # def convert_elf():
@@ -1,6 +1,7 @@
 #include <climits>
 #include "VirtualUSBDevice.h"
 #include "Descriptor.h"
+#include "Log.h"
 
 /* sudo apt-get install libudev-dev */
 /* sudo modprobe vhci-hcd */
@@ -47,31 +48,27 @@ static void _handleXferEP0(VirtualUSBDevice& dev, VirtualUSBDevice::Xfer&& xfer)
                     .bDataBits      = Toastbox::Endian::HFL_U8(_LineCoding.bDataBits),
                 };
                 
-                printf("SET_LINE_CODING:\n");
-                printf("  dwDTERate: %08x\n", _LineCoding.dwDTERate);
-                printf("  bCharFormat: %08x\n", _LineCoding.bCharFormat);
-                printf("  bParityType: %08x\n", _LineCoding.bParityType);
-                printf("  bDataBits: %08x\n", _LineCoding.bDataBits);
+                LOG_INFO("SET_LINE_CODING: dwDTERate=%08x bCharFormat=%08x bParityType=%08x bDataBits=%08x",
+                    _LineCoding.dwDTERate, _LineCoding.bCharFormat, _LineCoding.bParityType, _LineCoding.bDataBits);
                 return;
             }
-        
+            
             case Toastbox::USB::CDC::Request::SET_CONTROL_LINE_STATE:
             {
                 const bool dtePresent = req.wValue&1;
-                printf("SET_CONTROL_LINE_STATE:\n");
-                printf("  dtePresent=%d\n", dtePresent);
+                LOG_INFO("SET_CONTROL_LINE_STATE: dtePresent=%d", dtePresent);
                 auto lock = std::unique_lock(_State.lock);
                 _State.dtePresent = dtePresent;
                 _State.signal.notify_all();
                 return;
             }
-        
+            
             case Toastbox::USB::CDC::Request::SEND_BREAK:
             {
-                printf("SEND_BREAK:\n");
+                LOG_INFO("SEND_BREAK");
                 return;
             }
-        
+            
             default:
                 throw RUNTIME_ERROR("invalid request (DirectionOut): %x", req.bRequest);
         }
@@ -81,9 +78,9 @@ static void _handleXferEP0(VirtualUSBDevice& dev, VirtualUSBDevice::Xfer&& xfer)
         {
             case Toastbox::USB::CDC::Request::GET_LINE_CODING:
             {
-                printf("GET_LINE_CODING\n");
-                if (payloadLen != sizeof(_LineCoding))
-                    throw RUNTIME_ERROR("SET_LINE_CODING: payloadLen doesn't match sizeof(USB::CDC::LineCoding)");
+                LOG_INFO("GET_LINE_CODING");
+                if (req.wLength != sizeof(_LineCoding))
+                    throw RUNTIME_ERROR("GET_LINE_CODING: wLength doesn't match sizeof(USB::CDC::LineCoding)");
                 dev.write(Toastbox::USB::Endpoint::DefaultIn, &_LineCoding, sizeof(_LineCoding));
                 return;
             }
@@ -97,32 +94,18 @@ static void _handleXferEP0(VirtualUSBDevice& dev, VirtualUSBDevice::Xfer&& xfer)
     }
 }
 
-static void _handleXferEPX(VirtualUSBDevice& dev, VirtualUSBDevice::Xfer&& xfer)
+// Called on the device's I/O thread (see VirtualUSBDevice::setHandler())
+static void _handleXferOut2(VirtualUSBDevice::XferRef&& xfer)
 {
-    switch (xfer.ep)
-    {
-        case Endpoint::Out2:
-        {
-            printf("Endpoint::Out2: <");
-            for (size_t i=0; i<xfer.len; i++)
-            {
-                printf(" %02x", xfer.data[i]);
-            }
-            printf(" >\n\n");
-            break;
-        }
-    
-    default:
-        throw RUNTIME_ERROR("invalid endpoint: 0x%02x", xfer.ep);
-    }
+    LOG_INFO("Endpoint::Out2: < %s >", Log::Hex(xfer.data.data(), xfer.data.len()));
 }
 
 static void _handleXfer(VirtualUSBDevice& dev, VirtualUSBDevice::Xfer&& xfer)
 {
-    if (xfer.ep == 0)    // Endpoint 0
-        _handleXferEP0(dev, std::move(xfer));
-    else    // Other endpoints
-        _handleXferEPX(dev, std::move(xfer));
+    // The other endpoints have handlers
+    if (xfer.ep != 0)
+        throw RUNTIME_ERROR("invalid endpoint: 0x%02x", xfer.ep);
+    _handleXferEP0(dev, std::move(xfer));
 }
 
 static void _threadResponse(VirtualUSBDevice& dev) {
@@ -152,6 +135,7 @@ int main(int argc, const char* argv[])
     };
     
     VirtualUSBDevice dev(deviceInfo);
+    dev.setHandler(Endpoint::Out2, _handleXferOut2);
     try
     {
         try
@@ -169,7 +153,7 @@ int main(int argc, const char* argv[])
             );
         }
         
-        printf("Started\n");
+        LOG_INFO("Started");
         
         std::thread([&]{_threadResponse(dev);}).detach();
         
@@ -178,11 +162,23 @@ int main(int argc, const char* argv[])
             VirtualUSBDevice::Xfer data = *dev.read();
             _handleXfer(dev, std::move(data));
         }
-        
+    
     }
     catch (const std::exception& e)
     {
+        // Let the log catch up first, so that the error comes last
+        Log::Flush();
         fprintf(stderr, "Error: %s\n", e.what());
+        // Keep the device's recent traffic for post-mortem analysis in Wireshark
+        try
+        {
+            dev.writeTrace("VirtualUSBDevice.pcap");
+            fprintf(stderr, "Trace written to VirtualUSBDevice.pcap\n");
+        }
+        catch (const std::exception& e)
+        {
+            fprintf(stderr, "Failed to write trace: %s\n", e.what());
+        }
         // Using _exit to avoid calling destructors for static vars, since that hangs
         // in __pthread_cond_destroy, because our thread is sitting in _State.signal.wait()
         _exit(1);